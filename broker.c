@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <grp.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "plateio.h"
+#include "broker.h"
+
+/*
+* ppbroker owns /dev/PiPlates and serves the processes that set
+* PIPLATES_BROKER (or call brokerCONNECT). Pending requests are taken by bus
+* class (stops first), then highest client priority, round robin between
+* equals, and each group goes out as one bus batch. Identical side effect
+* free reads pending from several clients in the same batch are sent once
+* and the reply is copied to all.
+*
+* The shared memory carries raw bus commands, so it is only open to the
+* broker's user, or to the group named in PIPLATES_BROKER_GROUP as well.
+*/
+
+static struct brokerShm* shm;
+static volatile sig_atomic_t quit;
+static int rr;//Round robin start for equal priorities
+
+static void onSignal(int sig){
+	quit = 1;
+}
+
+static bool pending(struct brokerClient* c){
+	return __atomic_load_n(&c->pid, __ATOMIC_ACQUIRE) && c->tail != __atomic_load_n(&c->head, __ATOMIC_ACQUIRE);
+}
+
+//Whether c's next request goes before best's: bus class first, then priority.
+static bool brokerAHEAD(struct brokerClient* c, struct brokerClient* best){
+	uint32_t lc = c->slot[c->tail % BROKER_RING].lane;
+	uint32_t lb = best->slot[best->tail % BROKER_RING].lane;
+
+	if(lc != lb)
+		return lc < lb;
+	return c->priority > best->priority;
+}
+
+static struct brokerClient* brokerNEXT(void){
+	struct brokerClient* best = NULL;
+	int i;
+
+	for(i = 0; i < BROKER_CLIENTS; i++){
+		struct brokerClient* c = &shm->client[(rr + i) % BROKER_CLIENTS];
+		if(pending(c) && (!best || brokerAHEAD(c, best)))
+			best = c;
+	}
+	if(best)
+		rr = (best - shm->client + 1) % BROKER_CLIENTS;
+	return best;
+}
+
+static void brokerDONE(struct brokerClient* c, struct brokerSlot* s){
+	c->tail++;
+	c->served++;
+	__atomic_store_n(&s->state, SLOT_DONE, __ATOMIC_RELEASE);
+	futexWAKE(&s->state, 1);
+}
+
+/*
+* Reads that leave the plate as they found it, so one reply can serve every
+* client asking. Anything else may clear or advance state on the plate
+* (interrupt flags, frequency halves, scope traces, button latches) and is
+* always sent once per client.
+*/
+static bool idempotentREAD(const struct message* m){
+	int id = m->addr - (m->addr - DAQC) % 8;
+
+	switch(m->cmd){
+		case 0x00://Address
+		case 0x02://Hardware revision
+		case 0x03://Firmware revision
+			return 1;
+		case 0x20://DIN bit
+		case 0x25://DIN all
+		case 0x30://ADC
+		case 0x31://ADC all
+			return id == DAQC || id == DAQC2 || id == TINKER;
+	}
+	return 0;
+}
+
+static bool sameREAD(const struct message* a, const struct message* b){
+	return a->bytesToReturn > 0 && idempotentREAD(a) && a->addr == b->addr && a->cmd == b->cmd && a->p1 == b->p1 && a->p2 == b->p2
+		&& a->bytesToReturn == b->bytesToReturn && a->useACK == b->useACK;
+}
+
+static void brokerSERVE(struct brokerClient* c){
+	struct brokerSlot* s = &c->slot[c->tail % BROKER_RING];
+	int i;
+
+	__atomic_store_n(&s->state, SLOT_BUSY, __ATOMIC_RELEASE);
+	if(s->request != PIPLATE_SENDCMD && s->request != PIPLATE_GETINT){//Clients only get the two requests plateio makes
+		s->result = -1;
+		s->error = EINVAL;
+		brokerDONE(c, s);
+		return;
+	}
+	s->result = plateIOCTL(s->request, s->request == PIPLATE_SENDCMD ? &s->m : NULL);
+	s->error = (s->result < 0 ? errno : 0);
+
+	if(s->request == PIPLATE_SENDCMD && s->m.state){
+		for(i = 0; i < BROKER_CLIENTS; i++){
+			struct brokerClient* o = &shm->client[i];
+			struct brokerSlot* os;
+
+			if(o == c || !pending(o))
+				continue;
+			os = &o->slot[o->tail % BROKER_RING];
+			if(os->request == PIPLATE_SENDCMD && sameREAD(&os->m, &s->m)){
+				memcpy(os->m.rBuf, s->m.rBuf, s->m.bytesToReturn);
+				os->m.state = s->m.state;
+				os->result = s->result;
+				os->error = 0;
+				shm->merged++;
+				brokerDONE(o, os);
+			}
+		}
+	}
+	brokerDONE(c, s);
+}
+
+static int brokerPASS(void){
+	struct brokerClient* c;
+	int served = 0;
+
+	beginBATCH();
+	while(served < BROKER_BATCH && (c = brokerNEXT()) != NULL){
+		brokerSERVE(c);
+		served++;
+	}
+	endBATCH();
+
+	if(served)
+		shm->passes++;
+	return served;
+}
+
+//Frees the entries of clients that exited without disconnecting.
+static void brokerREAP(void){
+	int i, j;
+
+	for(i = 0; i < BROKER_CLIENTS; i++){
+		struct brokerClient* c = &shm->client[i];
+		pid_t pid = __atomic_load_n(&c->pid, __ATOMIC_ACQUIRE);
+
+		if(pid && kill(pid, 0) < 0 && errno == ESRCH){
+			for(j = 0; j < BROKER_RING; j++)
+				c->slot[j].state = SLOT_FREE;
+			c->tail = c->head;
+			c->served = 0;
+			__atomic_store_n(&c->pid, 0, __ATOMIC_RELEASE);
+		}
+	}
+}
+
+//Restricts the segment to the broker's user and PIPLATES_BROKER_GROUP, whatever the umask or whoever made it.
+static int brokerPERMS(int fd){
+	const char* name = getenv("PIPLATES_BROKER_GROUP");
+	mode_t mode = 0600;
+	struct stat sb;
+
+	if(fstat(fd, &sb) < 0 || sb.st_uid != geteuid()){
+		fprintf(stderr, "%s is not owned by this user\n", BROKER_SHM);
+		return -1;
+	}
+	if(name){
+		struct group* gr = getgrnam(name);
+
+		if(!gr){
+			fprintf(stderr, "Unknown group %s\n", name);
+			return -1;
+		}
+		if(fchown(fd, -1, gr->gr_gid) < 0){
+			perror("fchown");
+			return -1;
+		}
+		mode = 0660;
+	}
+	if(fchmod(fd, mode) < 0){
+		perror("fchmod");
+		return -1;
+	}
+	return 0;
+}
+
+int main(){
+	struct timespec idle = {1, 0};//Also how often dead clients are reaped
+	struct timespec now, reaped;
+	struct message probe = BASE_MESSAGE;
+	int fd;
+
+	unsetenv("PIPLATES_BROKER");//The broker itself talks to the device
+
+	fd = shm_open(BROKER_SHM, O_RDWR | O_CREAT, 0600);
+	if(fd < 0){
+		perror("shm_open");
+		return 1;
+	}
+	if(brokerPERMS(fd) < 0){
+		close(fd);
+		return 1;
+	}
+	if(ftruncate(fd, sizeof(struct brokerShm)) < 0){
+		perror("ftruncate");
+		return 1;
+	}
+	shm = (struct brokerShm*)mmap(NULL, sizeof(struct brokerShm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(shm == MAP_FAILED){
+		perror("mmap");
+		return 1;
+	}
+
+	if(shm->magic == BROKER_MAGIC && shm->brokerPid && kill(shm->brokerPid, 0) == 0){
+		fprintf(stderr, "ppbroker already running as %u\n", shm->brokerPid);
+		return 1;
+	}
+	if(plateIOCTL(PIPLATE_GETINT, &probe) < 0 && errno != EINTR){
+		perror("/dev/PiPlates");
+		return 1;
+	}
+
+	memset(shm, 0, sizeof(struct brokerShm));
+	shm->version = BROKER_VERSION;
+	shm->brokerPid = getpid();
+	__atomic_store_n(&shm->magic, BROKER_MAGIC, __ATOMIC_RELEASE);
+
+	signal(SIGINT, onSignal);
+	signal(SIGTERM, onSignal);
+
+	clock_gettime(CLOCK_MONOTONIC, &reaped);
+	while(!quit){
+		uint32_t bell = __atomic_load_n(&shm->doorbell, __ATOMIC_ACQUIRE);
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if(now.tv_sec - reaped.tv_sec >= idle.tv_sec){//On a timer, a busy broker never goes idle
+			brokerREAP();
+			reaped = now;
+		}
+		if(brokerPASS())
+			continue;
+		futexWAIT(&shm->doorbell, bell, &idle);
+	}
+
+	shm->magic = 0;
+	munmap(shm, sizeof(struct brokerShm));
+	shm_unlink(BROKER_SHM);
+	return 0;
+}
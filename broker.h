@@ -0,0 +1,70 @@
+#ifndef BROKER_H_INCLUDED
+#define BROKER_H_INCLUDED
+
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "../pi-plate-module/module/piplate.h"
+
+/*
+* Shared memory layout between ppbroker and the processes using the library.
+* Each client owns a ring of slots. It fills the slot at head, marks it
+* SLOT_REQUEST, bumps head and rings the doorbell; the broker serves slots by
+* bus class, then client priority, marks them SLOT_DONE and wakes the futex on
+* the slot state.
+* A free client entry always has head == tail.
+*/
+
+#define BROKER_SHM "/piplates-broker"
+#define BROKER_MAGIC 0x50504252//"PPBR"
+#define BROKER_VERSION 2
+#define BROKER_CLIENTS 8
+#define BROKER_RING 8//Slots per client
+#define BROKER_BATCH 32//Most requests served in one bus batch
+
+#define SLOT_FREE 0
+#define SLOT_REQUEST 1
+#define SLOT_BUSY 2
+#define SLOT_DONE 3
+
+struct brokerSlot {
+	uint32_t state;//Futex word, SLOT_*
+	uint32_t request;//PIPLATE_SENDCMD or PIPLATE_GETINT
+	uint32_t lane;//BUS_* class, served before client priority
+	int result;//ioctl return value
+	int error;//errno when result < 0
+	struct message m;
+};
+
+struct brokerClient {
+	uint32_t pid;//0 when the entry is free
+	int priority;//Higher is served first
+	uint32_t head;//Next slot the client fills
+	uint32_t tail;//Next slot the broker serves
+	uint64_t served;
+	struct brokerSlot slot[BROKER_RING];
+};
+
+struct brokerShm {
+	uint32_t magic;//Written last by the broker
+	uint32_t version;
+	uint32_t brokerPid;
+	uint32_t doorbell;//Futex word bumped on every submit
+	uint64_t passes;//Bus batches run
+	uint64_t merged;//Reads answered from an identical read of another client
+	struct brokerClient client[BROKER_CLIENTS];
+};
+
+static inline long futexWAIT(uint32_t* word, uint32_t val, const struct timespec* timeout){
+	return syscall(SYS_futex, word, FUTEX_WAIT, val, timeout, NULL, 0);
+}
+
+static inline void futexWAKE(uint32_t* word, int n){
+	syscall(SYS_futex, word, FUTEX_WAKE, n, NULL, NULL, 0);
+}
+
+extern int	plateIOCTL(unsigned long, struct message*);//Straight to /dev/PiPlates, never through the broker
+
+#endif /* BROKER_H_INCLUDED */
@@ -5,14 +5,27 @@
 #include <string.h>
 #include <math.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
 
 #include "../pi-plate-module/module/piplate.h"
 #include "plateio.h"
+#include "broker.h"
 
 #define INVAL_CMD -1
 
 #define RMAX 2000
 
+#define RATE_MIN 0.001//Slowest background loop, one pass per 1000 s
+
 const char* modes[9] = {"din", "dout", "button", "pwm", "range", "temp", "servo", "rgbled", "motion"};
 const char* LEDcolors[7] = {"red", "green", "yellow", "blue", "magenta", "cyan", "white"};
 const bool pcaRequired[9] = {0, 0, 0, 1, 0, 0, 0, 0, 0};
@@ -27,10 +40,14 @@ const double jThermoCoefficients[3][9] = {{0,1.9528268E1,-1.2286185,-1.0752178,-
 					  {-3.1135818702E03,3.00543684E02,-9.94773230,1.70276630E-01,-1.43033468E-03,4.73886084E-06,0,0,0}};
 
 static bool compareWith(int, int, ...);
+static int intSTACKstart(struct plateStack*);
+static void intSTACKstop(struct plateStack*);
+static void asyncSTOP(struct plateStack*);
+void daqc2pINIT(struct piplate*);
 
 int safeExtract(char* buf){
 	if(buf)
-		return buf[0];
+		return (unsigned char)buf[0];
 	return INVAL_CMD;
 }
 
@@ -59,1277 +76,5739 @@ static bool compareWith(int id, int num, ...){
 	return 0;
 }
 
-static char* sendCMD(struct piplate* plate, unsigned char cmd, unsigned char p1, unsigned char p2, int bytesToReturn){
-	struct message m = BASE_MESSAGE;
+static long long tsDIFF(const struct timespec* a, const struct timespec* b){
+	return (long long)(a->tv_sec - b->tv_sec)*1000000000 + (a->tv_nsec - b->tv_nsec);
+}
 
-	FILE *fp = fopen("/dev/PiPlates", "r");
+static void tsADD(struct timespec* t, long long ns){
+	t->tv_sec += ns / 1000000000;
+	t->tv_nsec += ns % 1000000000;
+	if(t->tv_nsec >= 1000000000){
+		t->tv_nsec -= 1000000000;
+		t->tv_sec++;
+	}else if(t->tv_nsec < 0){
+		t->tv_nsec += 1000000000;
+		t->tv_sec--;
+	}
+}
 
-	if(!fp)
-		return NULL;
+/*
+* Background loops sleep on a condition variable timed against CLOCK_MONOTONIC
+* instead of clock_nanosleep, so stopping one does not wait out a long period.
+*/
 
-	m.addr = plate->mapped_addr;
-	m.cmd = cmd;
-	m.p1 = p1;
-	m.p2 = p2;
-	m.bytesToReturn = bytesToReturn;
-	m.useACK = plate->ack;
-	m.state = 0;
+static void wakeINIT(pthread_cond_t* wake){
+	pthread_condattr_t attr;
 
-	ioctl(fileno(fp), PIPLATE_SENDCMD, &m);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(wake, &attr);
+	pthread_condattr_destroy(&attr);
+}
 
-	fclose(fp);
+//Sleeps until next or until wakeSTOP. Returns running.
+static bool wakeSLEEP(pthread_mutex_t* lock, pthread_cond_t* wake, bool* running, const struct timespec* next){
+	bool r;
 
-	if(m.state){
-		int i;
-		int size = bytesToReturn >= 0 ? bytesToReturn : BUF_SIZE;
-		static char r[BUF_SIZE];
-		for(i = 0; i < size; i ++){
-			r[i] = m.rBuf[i];
-		}
-		return r;
-	}
-	return NULL;
+	pthread_mutex_lock(lock);
+	while((r = *running) && pthread_cond_timedwait(wake, lock, next) != ETIMEDOUT);
+	pthread_mutex_unlock(lock);
+	return r;
 }
 
-struct piplate pi_plate_init(char id, char addr){
-	struct piplate plate = { };
-	if(isValid(id, addr)){
-		plate.id = id;
-		plate.addr = addr;
-		plate.mapped_addr = id + addr;
-		plate.ack = useACK(id);
-		plate.isValid = 1;
-		if(getADDR(&plate) == plate.addr)
-			return plate;
-	}
-	plate.isValid = 0;
-	return plate;
+static void wakeSTOP(pthread_mutex_t* lock, pthread_cond_t* wake, bool* running){
+	pthread_mutex_lock(lock);
+	__atomic_store_n(running, 0, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(wake);
+	pthread_mutex_unlock(lock);
 }
 
-bool getINT(){
-	FILE *fp = fopen("/dev/PiPlates", "r");
+/*
+* Plates sit on one or more stacks, each with its own device node. A stack's
+* busLock serializes access to its node and keeps multi-command sequences
+* (e.g. the two halves of a frequency reading) together when background
+* threads are running. It is recursive so a sequence can wrap commands that
+* lock it again. Stacks never wait on each other, so commands to plates on
+* different stacks go out in parallel.
+*
+* Waiters are granted the bus by class: BUS_SAFETY before BUS_NORMAL before
+* BUS_BULK. Stop commands are always BUS_SAFETY. A thread that took the bus
+* as BUS_BULK steps aside between commands whenever anyone else is waiting,
+* even inside a batch, so a stop waits for at most one command in flight or
+* one normal batch. Bulk work started inside a normal batch (lazy calibration
+* reads, say) runs as part of that batch, so normal batches are never broken
+* up.
+*/
+
+struct plateHealth {
+	int retries;
+	long backoff;//ns before the first retry, doubled after each
+	long timeout;//ns budget per command including retries, 0 for none
+	struct plateStats stats;
+	struct timespec reopen;//When an open breaker lets a command through
+	bool async;//Writes are queued, see setASYNC
+	long rangeFails[RANGE_CHANNELS];//Zero readings per range sensor
+	char modes[8];//TINKER setMODE per channel, index into modes plus 1, 0 if never set
+};
+
+struct asyncWrite {
+	char id;
+	char addr;
+	unsigned char cmd;
+	unsigned char p1;
+	unsigned char p2;
+};
+
+struct plateStack {
+	int index;//0 is the default stack
+	char path[STACK_PATH];
+	int fd;
+	pthread_mutex_t mutex;
+	pthread_cond_t free;
+	pthread_t owner;
+	int depth;//0 when nobody holds the bus
+	int lane;//Class the outermost holder took it in
+	int waiting[BUS_LANES];
+	struct busStats stats;
+	struct plateHealth health[PLATES_MAX];
+	pthread_t thread;//Dispatch thread, see intTHREADstart
+	bool running;
+	struct asyncWrite queue[ASYNC_QUEUE];
+	unsigned qHead;//Next entry filled, the queue is empty when qHead == qTail
+	unsigned qTail;//Next entry sent
+	pthread_cond_t queued;
+	pthread_t writer;
+	bool writing;//Writer thread started
+	asyncHandler onFail;
+	void* failCtx;
+	struct asyncStats async;
+};
+
+static struct plateStack stacks[STACKS_MAX];
+static int stackCount;//Only grows, stacks are never freed
+static pthread_mutex_t stackTable = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stackOnce = PTHREAD_ONCE_INIT;
+static __thread int busClass = BUS_NORMAL;
+static __thread int cmdLane = BUS_NORMAL;//Class of the command being sent, for the broker
+
+//Called with stackTable held.
+static struct plateStack* stackADD(const char* path){
+	struct plateStack* st;
+	int i;
 
-	if(!fp)
+	if(stackCount >= STACKS_MAX || strlen(path) >= STACK_PATH)
 		return NULL;
 
-	int resp = ioctl(fileno(fp), PIPLATE_GETINT);
+	st = &stacks[stackCount];
+	memset(st, 0, sizeof(struct plateStack));
+	st->index = stackCount;
+	strcpy(st->path, path);
+	st->fd = -1;
+	pthread_mutex_init(&st->mutex, NULL);
+	pthread_cond_init(&st->free, NULL);
+	pthread_cond_init(&st->queued, NULL);
+	for(i = 0; i < PLATES_MAX; i++){
+		st->health[i].retries = RETRY_DEFAULT;
+		st->health[i].backoff = BACKOFF_DEFAULT;
+	}
+	__atomic_store_n(&stackCount, stackCount + 1, __ATOMIC_RELEASE);
+	return st;
+}
 
-	fclose(fp);
+static void stackInit(void){
+	pthread_mutex_lock(&stackTable);
+	stackADD("/dev/PiPlates");
+	pthread_mutex_unlock(&stackTable);
+}
 
-	return resp;
+struct plateStack* stackDEFAULT(){
+	pthread_once(&stackOnce, stackInit);
+	return &stacks[0];
 }
 
-/* Start of system commands: */
+static struct plateStack* plateSTACK(struct piplate* plate){
+	return plate->stack ? plate->stack : stackDEFAULT();
+}
 
-int getADDR(struct piplate* plate){
-	if(plate->isValid){
-		int resp = safeExtract(sendCMD(plate, 0x00, 0, 0, 1));
-		return (resp > 0 ? resp - plate->id : resp);
+//Called with st->mutex held.
+static bool busAHEAD(struct plateStack* st, int lane){
+	int i;
+
+	for(i = 0; i < lane; i++){
+		if(st->waiting[i])
+			return 1;
 	}
-	return INVAL_CMD;
+	return 0;
 }
 
-char* getID(struct piplate* plate){
-	if(plate->isValid)
-		return sendCMD(plate, 0x01, 0, 0, -1);
-	return NULL;
+//Called with st->mutex held.
+static void busWAIT(struct plateStack* st, int lane){
+	st->waiting[lane]++;
+	while(st->depth || busAHEAD(st, lane))
+		pthread_cond_wait(&st->free, &st->mutex);
+	st->waiting[lane]--;
+	st->owner = pthread_self();
 }
 
-int getHWrev(struct piplate* plate){
-	if(plate->isValid)
-		return safeExtract(sendCMD(plate, 0x02, 0, 0, 1));
-	return INVAL_CMD;
+static bool busOWNED(struct plateStack* st){
+	return st->depth && pthread_equal(st->owner, pthread_self());
 }
 
-int getFWrev(struct piplate* plate){
-	if(plate->isValid)
-		return safeExtract(sendCMD(plate, 0x03, 0, 0, 1));
-	return INVAL_CMD;
-}
+static void busACQUIRE(struct plateStack* st, int lane){
+	struct timespec t0, t1;
+	long long waited;
 
-void intEnable(struct piplate* plate){
-	if(plate->isValid && compareWith(plate->id, 4, DAQC, DAQC2, MOTOR, THERMO))
-		sendCMD(plate, 0x04, 0, 0, 0);
+	pthread_mutex_lock(&st->mutex);
+	if(busOWNED(st)){
+		st->depth++;
+		pthread_mutex_unlock(&st->mutex);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	busWAIT(st, lane);
+	st->depth = 1;
+	st->lane = lane;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	waited = tsDIFF(&t1, &t0);
+	st->stats.grants[lane]++;
+	st->stats.totalWait[lane] += waited;
+	if(waited > st->stats.maxWait[lane])
+		st->stats.maxWait[lane] = waited;
+	pthread_mutex_unlock(&st->mutex);
 }
 
-void intDisable(struct piplate* plate){
-	if(plate->isValid && compareWith(plate->id, 4, DAQC, DAQC2, MOTOR, THERMO))
-		sendCMD(plate, 0x05, 0, 0, 0);
+static void busLOCK(struct plateStack* st){
+	busACQUIRE(st, busClass);
 }
 
-int getINTflags(struct piplate* plate){
-	if(plate->isValid && compareWith(plate->id, 3, DAQC, DAQC2, THERMO))
-		return safeExtract(sendCMD(plate, 0x06, 0, 0, 1));
-	return INVAL_CMD;
+static void busUNLOCK(struct plateStack* st){
+	pthread_mutex_lock(&st->mutex);
+	if(--st->depth == 0)
+		pthread_cond_broadcast(&st->free);
+	pthread_mutex_unlock(&st->mutex);
 }
 
-int getINTflag0(struct piplate* plate){
-	if(plate->isValid && compareWith(plate->id, 1, MOTOR))
-		return safeExtract(sendCMD(plate, 0x06, 0, 0, 1));
-	return INVAL_CMD;
+//Bulk work holding the bus lets anyone waiting go first, then takes it back.
+static void busYIELD(struct plateStack* st){
+	pthread_mutex_lock(&st->mutex);
+	if(busOWNED(st) && st->lane == BUS_BULK && busAHEAD(st, BUS_BULK)){
+		int depth = st->depth;
+
+		st->depth = 0;
+		st->stats.yields++;
+		pthread_cond_broadcast(&st->free);
+		busWAIT(st, BUS_BULK);
+		st->depth = depth;
+		st->lane = BUS_BULK;
+	}
+	pthread_mutex_unlock(&st->mutex);
 }
 
-int getINTflag1(struct piplate* plate){
-	if(plate->isValid && compareWith(plate->id, 1, MOTOR))
-		return safeExtract(sendCMD(plate, 0x07, 0, 0, 1));
-	return INVAL_CMD;
+/*
+* Gives the bus up for nap and then waits for it again in lane. Inside a batch
+* it keeps the bus and sleeps holding it, since the batch promised its
+* commands go out with nothing in between.
+*/
+static void busNAP(struct plateStack* st, int lane, const struct timespec* nap){
+	int depth, held;
+
+	pthread_mutex_lock(&st->mutex);
+	if(st->depth > 1){
+		pthread_mutex_unlock(&st->mutex);
+		nanosleep(nap, NULL);
+		return;
+	}
+	depth = st->depth;
+	held = st->lane;
+	st->depth = 0;
+	pthread_cond_broadcast(&st->free);
+	pthread_mutex_unlock(&st->mutex);
+
+	nanosleep(nap, NULL);
+
+	pthread_mutex_lock(&st->mutex);
+	busWAIT(st, lane);
+	st->depth = depth;
+	st->lane = held;
+	pthread_mutex_unlock(&st->mutex);
 }
 
-void reset(struct piplate* plate){
-	if(plate->isValid)
-		sendCMD(plate, 0x0F, 0, 0, 0);
+//Sets the calling thread's bus class and returns the previous one.
+int setBUSclass(int lane){
+	int prev = busClass;
+
+	if(lane >= BUS_SAFETY && lane <= BUS_BULK)
+		busClass = lane;
+	return prev;
 }
 
-/* End of system commands */
+int getSTACKstats(struct plateStack* st, struct busStats* stats){
+	if(!st || !stats)
+		return INVAL_CMD;
+	pthread_mutex_lock(&st->mutex);
+	*stats = st->stats;
+	pthread_mutex_unlock(&st->mutex);
+	return 0;
+}
 
-/* Start of LED commands */
+void getBUSstats(struct busStats* stats){
+	getSTACKstats(stackDEFAULT(), stats);
+}
 
-char getLEDnum(char* color, char max){
-	char led = 0;
+void resetBUSstats(){
+	int n = __atomic_load_n(&stackCount, __ATOMIC_ACQUIRE);
 	int i;
-	for(i = 0; i < max; i ++){
-		if(!strcmp(color, LEDcolors[i]))
-			led = i + 1;
+
+	for(i = 0; i < n; i++){
+		pthread_mutex_lock(&stacks[i].mutex);
+		memset(&stacks[i].stats, 0, sizeof(struct busStats));
+		pthread_mutex_unlock(&stacks[i].mutex);
 	}
+}
 
-	return led;
+//Commands that stop motion or drop outputs, they never wait behind other classes.
+static bool safetyCMD(struct piplate* plate, unsigned char cmd, unsigned char p1){
+	if(cmd == 0x0F)//reset
+		return 1;
+	if(compareWith(plate->id, 1, MOTOR))
+		return cmd == 0x16 || cmd == 0x17 || cmd == 0x1E || cmd == 0x1F || cmd == 0x32;
+	if(compareWith(plate->id, 1, DAQC2))
+		return cmd == 0xB6 || cmd == 0xBA;
+	if(compareWith(plate->id, 2, RELAY, TINKER))
+		return cmd == 0x13 && p1 == 0;
+	return 0;
 }
 
-void setLEDcolor(struct piplate* plate, char* color){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, DAQC)){
-			sendCMD(plate, 0x60, getLEDnum(color, 2), 0, 0);
-		}else if(compareWith(plate->id, 1, DAQC2)){
-			sendCMD(plate, 0x60, getLEDnum(color, 7), 0, 0);
-		}
-	}
+//Called with busLock held. The node stays open between commands.
+static int busOPEN(struct plateStack* st){
+	if(st->fd < 0)
+		st->fd = open(st->path, O_RDONLY);
+	return st->fd;
 }
 
-void setLED(struct piplate* plate){
-	if(plate->isValid){
-		if(compareWith(plate->id, 3, THERMO, MOTOR, RELAY)){
-			sendCMD(plate, 0x60, 0, 0, 0);
-		}
-	}
+/*
+* A batch holds the bus so the commands issued inside it go out back to back
+* without other threads interleaving. Batches nest. beginBATCH takes every
+* stack, in stack order, so it can mix plates from any of them; code that
+* only talks to one plate takes just that plate's stack. beginBATCHon takes
+* only the stacks in a mask built with stackBIT, so batches over plates on
+* different stacks still run in parallel.
+*/
+
+void beginBATCH(){
+	int n;
+	int i;
+
+	stackDEFAULT();
+	n = __atomic_load_n(&stackCount, __ATOMIC_ACQUIRE);
+	for(i = 0; i < n; i++)
+		busLOCK(&stacks[i]);
 }
 
-void clrLEDcolor(struct piplate* plate, char* color){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, DAQC)){
-			sendCMD(plate, 0x61, getLEDnum(color, 2), 0, 0);
-		}
+void endBATCH(){
+	int i;
+
+	for(i = __atomic_load_n(&stackCount, __ATOMIC_ACQUIRE) - 1; i >= 0; i--){
+		struct plateStack* st = &stacks[i];
+		bool mine;
+
+		pthread_mutex_lock(&st->mutex);
+		mine = busOWNED(st);
+		pthread_mutex_unlock(&st->mutex);
+		if(mine)
+			busUNLOCK(st);
 	}
 }
 
-void clrLED(struct piplate* plate){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, DAQC2)){
-			sendCMD(plate, 0x60, 0, 0, 0);
-		}else if(compareWith(plate->id, 3, THERMO, MOTOR, RELAY)){
-			sendCMD(plate, 0x61, 0, 0, 0);
-		}
+//Mask bit of the plate's stack, for beginBATCHon.
+unsigned stackBIT(struct piplate* plate){
+	return 1u << plateSTACK(plate)->index;
+}
+
+void beginBATCHon(unsigned mask){
+	int n;
+	int i;
+
+	stackDEFAULT();
+	n = __atomic_load_n(&stackCount, __ATOMIC_ACQUIRE);
+	for(i = 0; i < n; i++){
+		if(mask & (1u << i))
+			busLOCK(&stacks[i]);
 	}
 }
 
-void toggleLEDcolor(struct piplate* plate, char* color){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, DAQC)){
-			sendCMD(plate, 0x62, getLEDnum(color, 2), 0, 0);
-		}
+void endBATCHon(unsigned mask){
+	int i;
+
+	for(i = __atomic_load_n(&stackCount, __ATOMIC_ACQUIRE) - 1; i >= 0; i--){
+		if(mask & (1u << i))
+			busUNLOCK(&stacks[i]);
 	}
 }
 
-void toggleLED(struct piplate* plate){
-	if(plate->isValid){
-		if(compareWith(plate->id, 3, THERMO, MOTOR, RELAY)){
-			sendCMD(plate, 0x62, 0, 0, 0);
+/*
+* Opens another stack on its own device node, or returns the stack already
+* using path. Its commands are serialized only against each other. If the
+* interrupt thread is running the new stack gets a dispatch thread too.
+*/
+
+struct plateStack* stackOPEN(const char* path){
+	struct plateStack* st = NULL;
+	int i;
+
+	if(!path)
+		return NULL;
+
+	stackDEFAULT();
+	pthread_mutex_lock(&stackTable);
+	for(i = 0; i < stackCount; i++){
+		if(!strcmp(stacks[i].path, path)){
+			st = &stacks[i];
+			break;
 		}
 	}
+	if(!st)
+		st = stackADD(path);
+	if(st && intTHREADrunning())
+		intSTACKstart(st);
+	pthread_mutex_unlock(&stackTable);
+	return st;
 }
 
-char getLEDcolor(struct piplate* plate, char* color){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, DAQC)){
-			return safeExtract(sendCMD(plate, 0x63, getLEDnum(color, 2), 0, 0));
-		}
+//Stops the stack's dispatch and writer threads, sends queued writes and closes its node. The stack stays usable, the node reopens on the next command.
+void stackCLOSE(struct plateStack* st){
+	if(!st)
+		return;
+	intSTACKstop(st);
+	asyncSTOP(st);
+	busLOCK(st);
+	if(st->fd >= 0){
+		close(st->fd);
+		st->fd = -1;
 	}
-	return INVAL_CMD;
+	busUNLOCK(st);
 }
 
-char getLED(struct piplate* plate){
-	if(plate->isValid){
-		if(compareWith(plate->id, 2, DAQC2, THERMO)){
-			return safeExtract(sendCMD(plate, 0x63, 0, 0, 0));
-		}
+const char* stackPATH(struct plateStack* st){
+	return st ? st->path : NULL;
+}
+
+/*
+* With PIPLATES_BROKER set in the environment (to the client priority), or
+* after brokerCONNECT, commands to the default stack go to ppbroker through
+* shared memory instead of the device node. The rest of the library does not
+* see the difference. Other stacks always use their own node.
+*/
+
+static struct brokerShm* brkShm;
+static struct brokerClient* brkClient;
+static bool brkMode;
+static int brkPriority;
+static pthread_once_t brkOnce = PTHREAD_ONCE_INIT;
+
+static void brokerENV(void){
+	const char* e = getenv("PIPLATES_BROKER");
+
+	if(e){
+		brkMode = 1;
+		brkPriority = atoi(e);
 	}
-	return INVAL_CMD;
 }
-/* End of LED commands */
 
-/* Start of relay commands */
+static bool brokerALIVE(void){
+	return !(kill(brkShm->brokerPid, 0) < 0 && errno == ESRCH);
+}
 
-void relayON(struct piplate* plate, char relay){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, RELAY) && relay >= 1 && relay <=7){
-			sendCMD(plate, 0x10, relay, 0, 0);
-		}else if(compareWith(plate->id, 1, TINKER) && relay >= 1 && relay <= 2){
-			sendCMD(plate, 0x10, relay - 1, 0, 0);
+//Called with busLock held.
+static int brokerATTACH(void){
+	struct brokerShm* shm;
+	int fd;
+	int i;
+
+	if(brkShm)
+		return 0;
+
+	fd = shm_open(BROKER_SHM, O_RDWR, 0);
+	if(fd < 0)
+		return INVAL_CMD;
+	shm = (struct brokerShm*)mmap(NULL, sizeof(struct brokerShm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(shm == MAP_FAILED)
+		return INVAL_CMD;
+
+	brkShm = shm;
+	if(__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) == BROKER_MAGIC && shm->version == BROKER_VERSION && brokerALIVE()){
+		for(i = 0; i < BROKER_CLIENTS; i++){
+			uint32_t none = 0;
+			if(__atomic_compare_exchange_n(&shm->client[i].pid, &none, (uint32_t)getpid(), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+				shm->client[i].priority = brkPriority;
+				brkClient = &shm->client[i];
+				return 0;
+			}
 		}
 	}
+	brkShm = NULL;
+	munmap(shm, sizeof(struct brokerShm));
+	return INVAL_CMD;
 }
 
-void relayOFF(struct piplate* plate, char relay){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, RELAY) && relay >= 1 && relay <= 7){
-			sendCMD(plate, 0x11, relay, 0, 0);
-		}else if(compareWith(plate->id, 1, TINKER) && relay >=1 && relay <= 2){
-			sendCMD(plate, 0x11, relay - 1, 0, 0);
-		}
+//Called with busLock held.
+static void brokerDETACH(void){
+	if(brkShm){
+		if(brkClient)
+			__atomic_store_n(&brkClient->pid, 0, __ATOMIC_RELEASE);
+		munmap(brkShm, sizeof(struct brokerShm));
+		brkShm = NULL;
+		brkClient = NULL;
 	}
 }
 
-void relayTOGGLE(struct piplate* plate, char relay){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, RELAY) && relay >= 1 && relay <= 7){
-			sendCMD(plate, 0x12, relay, 0, 0);
-		}else if(compareWith(plate->id, 1, TINKER) && relay >= 1 && relay <= 2){
-			sendCMD(plate, 0x12, relay - 1, 0, 0);
+static int brokerCALL(unsigned long request, struct message* m){
+	struct brokerClient* c = brkClient;
+	struct brokerSlot* s = &c->slot[c->head % BROKER_RING];
+	struct timespec wait = {0, 200000000};
+	uint32_t st;
+	int r;
+
+	s->request = request;
+	s->lane = cmdLane;
+	if(m){
+		s->m.addr = m->addr;
+		s->m.cmd = m->cmd;
+		s->m.p1 = m->p1;
+		s->m.p2 = m->p2;
+		s->m.bytesToReturn = m->bytesToReturn;
+		s->m.useACK = m->useACK;
+		s->m.state = 0;
+	}
+	__atomic_store_n(&s->state, SLOT_REQUEST, __ATOMIC_RELEASE);
+	__atomic_store_n(&c->head, c->head + 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&brkShm->doorbell, 1, __ATOMIC_RELEASE);
+	futexWAKE(&brkShm->doorbell, 1);
+
+	while((st = __atomic_load_n(&s->state, __ATOMIC_ACQUIRE)) != SLOT_DONE){
+		if(futexWAIT(&s->state, st, &wait) < 0 && errno == ETIMEDOUT && !brokerALIVE()){
+			brokerDETACH();//Attach again on the next command, a new broker may be up by then
+			errno = EPIPE;
+			return -1;
 		}
 	}
+
+	if(m){
+		int i;
+		int size = m->bytesToReturn >= 0 && m->bytesToReturn < BUF_SIZE ? m->bytesToReturn : BUF_SIZE;
+		m->state = s->m.state;
+		for(i = 0; i < size; i++)
+			m->rBuf[i] = s->m.rBuf[i];
+	}
+	r = s->result;
+	errno = s->error;
+	__atomic_store_n(&s->state, SLOT_FREE, __ATOMIC_RELEASE);
+	return r;
 }
 
-void relayALL(struct piplate* plate, char relays){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, RELAY)){
-			if(relays >= 0 && relays <= 127)
-				sendCMD(plate, 0x13, relays, 0, 0);
-		}else if(compareWith(plate->id, 1, TINKER)){
-			if(relays >= 0 && relays <= 3)
-				sendCMD(plate, 0x13, relays, 0, 0);
-		}
+int brokerCONNECT(int priority){
+	struct plateStack* st = stackDEFAULT();
+	int r;
+
+	busLOCK(st);
+	brkPriority = priority;
+	brkMode = 1;
+	r = brokerATTACH();
+	busUNLOCK(st);
+	return r;
+}
+
+void brokerDISCONNECT(){
+	struct plateStack* st = stackDEFAULT();
+
+	busLOCK(st);
+	brokerDETACH();
+	brkMode = 0;
+	busUNLOCK(st);
+}
+
+static bool busBROKER(struct plateStack* st){
+	pthread_once(&brkOnce, brokerENV);
+	return brkMode && st->index == 0;
+}
+
+//Called with busLock held. Whether commands can go out right now.
+static bool busREADY(struct plateStack* st){
+	if(busBROKER(st))
+		return brokerATTACH() == 0;
+	return busOPEN(st) >= 0;
+}
+
+//Called with busLock held.
+static int busIOCTL(struct plateStack* st, unsigned long request, struct message* m){
+	int r;
+
+	if(!busREADY(st))
+		return -1;
+	if(busBROKER(st))
+		return brokerCALL(request, m);
+
+	r = ioctl(st->fd, request, m);
+	if(r < 0 && errno != EINTR){
+		close(st->fd);//Reopen on the next command in case the module was reloaded
+		st->fd = -1;
 	}
+	return r;
 }
 
-int relaySTATE(struct piplate* plate, char relay){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, RELAY)){
-			if(relay >= 1 && relay <= 7)
-				return safeExtract(sendCMD(plate, 0x14, 0, 0, 1));
-		}else if(compareWith(plate->id, 1, TINKER)){
-			if(relay >= 1 && relay <= 2)
-				return safeExtract(sendCMD(plate, 0x14, relay, 0, 0));
+int plateIOCTL(unsigned long request, struct message* m){
+	struct plateStack* st = stackDEFAULT();
+	int r = -1;
+
+	busLOCK(st);
+	if(busOPEN(st) >= 0){
+		r = ioctl(st->fd, request, m);
+		if(r < 0 && errno != EINTR){
+			close(st->fd);
+			st->fd = -1;
 		}
 	}
-	return INVAL_CMD;
+	busUNLOCK(st);
+	return r;
 }
 
-/* End of relay commands */
+/*
+* Failed commands are retried with exponential backoff, up to the plate's retry
+* count and within its timeout and the caller's deadline, whichever is closer.
+* A command that went out but got no reply is only retried if it is a read, so
+* writes such as toggles never run twice. After BREAKER_TRIP failures in a row
+* a plate's breaker opens and its commands fail at once for BREAKER_COOLDOWN,
+* then one command is let through to test it. The ioctl itself cannot be cut
+* short, deadlines are checked between attempts. The bus is given up while a
+* retry backs off, so a failing plate does not hold up the rest of its stack,
+* except inside a batch, which keeps the bus. Settings and counters are
+* kept per stack and type/address, so every copy of a plate struct shares them.
+*/
 
-void setMODE(struct piplate* plate, char bit, char* mode){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, TINKER)){
-			int numModes = 9;
-			int modeSelect = numModes;
-			bool channelGood = 0;
-			int i;
+static __thread int plateError;
+static __thread struct timespec callDeadline;//tv_sec 0 when unset
+static __thread bool probing;//pi_plate_init: no retries, no breaker
 
-			if (!strcmp(mode, "range")){
-				if((bit==12) || (bit==34) || (bit==56) || (bit==78))
-					channelGood = 1;
-				else
-					printf("Invalid channel pair. For range, must be 12, 34, 56, or 78.\n");
-				bit = (bit>>1) / 10;//Maps the inputs to 0, 1, 2, and 3.
-			}else{
-				if(bit >= 1 && bit <= 8)
-					channelGood = 1;
-				else
-					printf("Invalid channel. Must be 1 through 8.");
-				bit--;
-			}
+static struct plateHealth* plateHEALTH(struct piplate* plate){
+	return &plateSTACK(plate)->health[plate->mapped_addr - DAQC];
+}
 
-			if(channelGood){
-				for(i = 0; i < numModes; i++){
-					if(!strcmp(mode, modes[i]))
-						modeSelect = i;
-				}
-				if(!strcmp(mode, "led"))
-					modeSelect = 3;
+//Error of the calling thread's last command, PLATE_OK if it succeeded.
+int getERROR(){
+	return plateError;
+}
 
-				if(modeSelect != numModes){
-					if(pcaRequired[modeSelect] && bit >= 6){
-						printf("This channel cannot support this mode.\n");
-					}else{
-						sendCMD(plate, 0x90, bit, modeSelect, 0);
-					}
-				}else{
-					printf("Invalid mode.\n");
-				}
-			}
-		}
+void setRETRIES(struct piplate* plate, int retries, long backoff){
+	if(plate->isValid && retries >= 0 && backoff >= 0){
+		struct plateHealth* h = plateHEALTH(plate);
+
+		busLOCK(plateSTACK(plate));
+		h->retries = retries;
+		h->backoff = backoff;
+		busUNLOCK(plateSTACK(plate));
 	}
 }
 
+void setTIMEOUT(struct piplate* plate, long timeout){
+	if(plate->isValid && timeout >= 0){
+		struct plateHealth* h = plateHEALTH(plate);
 
-/* Start of digital output commands */
-
-void setDOUTbit(struct piplate* plate, char bit){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, DAQC)){
-			if(bit >= 0 && bit <= 6)
-				sendCMD(plate, 0x10, bit, 0, 0);
-		}else if(compareWith(plate->id, 1, DAQC2)){
-			if(bit >= 0 && bit <= 7)
-				sendCMD(plate, 0x10, bit, 0, 0);
-		}else if(compareWith(plate->id, 1, TINKER)){
-			if(bit >= 1 && bit <= 8)
-				sendCMD(plate, 0x26, bit - 1, 0, 0);
-		}
+		busLOCK(plateSTACK(plate));
+		h->timeout = timeout;
+		busUNLOCK(plateSTACK(plate));
 	}
 }
 
-void clrDOUTbit(struct piplate* plate, char bit){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, DAQC)){
-			if(bit >= 0 && bit <= 6)
-				sendCMD(plate, 0x11, bit, 0, 0);
-		}else if(compareWith(plate->id, 1, DAQC2)){
-			if(bit >= 0 && bit <= 7)
-				sendCMD(plate, 0x11, bit, 0, 0);
-		}else if(compareWith(plate->id, 1, TINKER)){
-			if(bit >= 1 && bit <= 8)
-				sendCMD(plate, 0x27, bit - 1, 0, 0);
-		}
+//Commands from this thread until endDEADLINE must finish within ns from now.
+void beginDEADLINE(long long ns){
+	clock_gettime(CLOCK_MONOTONIC, &callDeadline);
+	tsADD(&callDeadline, ns);
+}
+
+void endDEADLINE(){
+	callDeadline.tv_sec = 0;
+	callDeadline.tv_nsec = 0;
+}
+
+/*
+* Every read that goes through stamps the calling thread with when its
+* transaction started and ended on CLOCK_MONOTONIC; a read that fails clears
+* the stamp, and writes leave it alone. A reading made of several
+* commands opens a span, so its stamp covers all of them. Buffered readings
+* keep the stamp of their transaction and hand it to the thread that fetches
+* them, so getSTAMP after any reading describes that reading.
+*/
+
+static __thread struct sampleStamp lastStamp;
+static __thread int stampSpan;//Open spans
+static __thread bool stampFresh;//The next command starts the span
+static __thread bool stampBad;//A read in the open span failed
+
+static void stampOPEN(void){
+	if(stampSpan++ == 0){
+		stampFresh = 1;
+		stampBad = 0;
 	}
 }
 
-void toggleDOUTbit(struct piplate* plate, char bit){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, DAQC)){
-			if(bit >= 0 && bit <= 6)
-				sendCMD(plate, 0x12, bit, 0, 0);
-		}else if(compareWith(plate->id, 1, DAQC2)){
-			if(bit >= 0 && bit <= 7)
-				sendCMD(plate, 0x12, bit, 0, 0);
-		}else if(compareWith(plate->id, 1, TINKER)){
-			if(bit >= 1 && bit <= 8)
-				sendCMD(plate, 0x28, bit - 1, 0, 0);
-		}
+static void stampCLOSE(void){
+	stampSpan--;
+}
+
+static void stampRECORD(const struct timespec* start, const struct timespec* end){
+	if(stampSpan && stampBad)
+		return;
+	if(!stampSpan || stampFresh){
+		lastStamp.start = *start;
+		stampFresh = 0;
 	}
+	lastStamp.end = *end;
 }
 
-/* End of digital output commands */
+//A failed read leaves no stamp, so getSTAMP never describes an older reading.
+static void stampFAIL(void){
+	memset(&lastStamp, 0, sizeof(lastStamp));
+	if(stampSpan)
+		stampBad = 1;
+}
 
-/* Start of digital input commands */
+//Midpoint of the calling thread's last transaction in ns, 0 if there is none.
+static int64_t stampNS(void){
+	struct timespec mid;
 
-int getDINbit(struct piplate* plate, char bit){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, TINKER))
-			bit--;
+	if(!lastStamp.end.tv_sec)
+		return 0;
+	stampMID(&lastStamp, &mid);
+	return (int64_t)mid.tv_sec*1000000000 + mid.tv_nsec;
+}
 
-		if(compareWith(plate->id, 3, DAQC, DAQC2, TINKER)){
-			if(bit >= 0 && bit <= 7){
-				int resp = safeExtract(sendCMD(plate, 0x20, bit, 0, 1));
-				return (resp > 0 ? 1 : (resp < 0 ? INVAL_CMD : 0));
-			}
-		}
-	}
-	return INVAL_CMD;
+//Transaction behind the calling thread's last reading.
+int getSTAMP(struct sampleStamp* stamp){
+	if(!stamp || !lastStamp.end.tv_sec)
+		return INVAL_CMD;
+	*stamp = lastStamp;
+	return 0;
 }
 
-int getDINall(struct piplate* plate){
-	if(plate->isValid){
-		if(compareWith(plate->id, 3, DAQC, DAQC2, TINKER)){
-			return safeExtract(sendCMD(plate, 0x25, 0, 0, 1));
-		}
+void stampMID(const struct sampleStamp* stamp, struct timespec* mid){
+	*mid = stamp->start;
+	tsADD(mid, tsDIFF(&stamp->end, &stamp->start)/2);
+}
+
+int getHEALTH(struct piplate* plate, struct plateStats* stats){
+	if(plate->isValid && stats){
+		struct plateHealth* h = plateHEALTH(plate);
+
+		busLOCK(plateSTACK(plate));
+		*stats = h->stats;
+		busUNLOCK(plateSTACK(plate));
+		return 0;
 	}
 	return INVAL_CMD;
 }
 
-void enableDINint(struct piplate* plate, char bit, char edge){
+//Clears the counters and closes the breaker.
+void resetHEALTH(struct piplate* plate){
 	if(plate->isValid){
-		if(compareWith(plate->id, 2, DAQC, DAQC2)){
-			if(bit >= 0 && bit <= 7){
-				if( edge == 'f' || edge == 'F' )
-					sendCMD(plate, 0x21, bit, 0, 0);
-				else if( edge == 'r' || edge == 'R' )
-					sendCMD(plate, 0x22, bit, 0, 0);
-				else if( edge == 'b' || edge == 'B' )
-					sendCMD(plate, 0x23, bit, 0, 0);
-			}
-		}
+		struct plateHealth* h = plateHEALTH(plate);
+
+		busLOCK(plateSTACK(plate));
+		memset(&h->stats, 0, sizeof(struct plateStats));
+		busUNLOCK(plateSTACK(plate));
 	}
 }
 
-void disableDINint(struct piplate* plate, char bit){
-	if(plate->isValid){
-		if(compareWith(plate->id, 2, DAQC, DAQC2)){
-			if(bit >= 0 && bit <= 7)
-				sendCMD(plate, 0x24, bit, 0, 0);
+//Called with busLock held, records how a command ended.
+static void healthEND(struct plateHealth* h, int error, const struct timespec* start){
+	struct timespec now;
+	long long took;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	took = tsDIFF(&now, start);
+	plateError = error;
+	if(probing)
+		return;
+
+	h->stats.commands++;
+	if(took > h->stats.worst)
+		h->stats.worst = took;
+
+	if(error == PLATE_OK){
+		h->stats.consecutive = 0;
+		h->stats.open = 0;
+	}else if(error != PLATE_EOPEN){
+		h->stats.failures++;
+		if(error == PLATE_ETIMEOUT)
+			h->stats.timeouts++;
+		if(++h->stats.consecutive >= BREAKER_TRIP){
+			if(!h->stats.open)
+				h->stats.trips++;
+			h->stats.open = 1;
+			h->reopen = now;
+			tsADD(&h->reopen, BREAKER_COOLDOWN);
 		}
 	}
 }
 
-/* End of digital input commands */
+/* Start of async writes */
 
+/*
+* Writes to a plate set with setASYNC do not wait for its acknowledge:
+* sendCMD puts them on the stack's queue and returns. A writer thread per
+* stack sends queued writes back to back, ASYNC_BATCH per hold of the bus, and
+* checks each reply there; failures go to the stack's asyncHandler and are
+* counted. Any other command on the stack sends the queued writes first, so
+* reads see earlier writes and order is kept. A caller that finds the queue
+* full drains it itself. Writes inside a batch are sent at once, so the batch
+* is not split up by the writer thread. Stops and resets are never queued and
+* do not wait for the queue: they go out at once and the writes still queued
+* for that plate are dropped, since they were meant to run before the stop.
+*/
 
-/* Start of board led commands */
+static __thread bool draining;//This thread is sending queued writes
+static __thread char reply[BUF_SIZE];//Per thread so callers can read it after the lock is dropped
+static char* sendNOW(struct piplate*, unsigned char, unsigned char, unsigned char, int);
 
-//These ones are weird, I'll come back to them.
+static bool asyncPENDING(struct plateStack* st){
+	return __atomic_load_n(&st->qHead, __ATOMIC_ACQUIRE) != __atomic_load_n(&st->qTail, __ATOMIC_ACQUIRE);
+}
 
-/* End of board led commands */
+/*
+* Called with busLock held. Sends up to max of the writes queued so far, not
+* those queued meanwhile, so the bus is never held for an unbounded run.
+* Returns how many failed.
+*/
+static int asyncDRAIN(struct plateStack* st, unsigned max){
+	unsigned end;
+	int failed = 0;
+
+	if(draining)
+		return 0;
+	draining = 1;
+	pthread_mutex_lock(&st->mutex);
+	end = (st->qHead - st->qTail > max ? st->qTail + max : st->qHead);
+	pthread_mutex_unlock(&st->mutex);
+	for(;;){
+		struct piplate plate = { };
+		struct asyncWrite w;
+		struct asyncFail f;
+		asyncHandler fn;
+		void* ctx;
+		bool ok;
+
+		pthread_mutex_lock(&st->mutex);
+		if(st->qTail == end){
+			pthread_mutex_unlock(&st->mutex);
+			break;
+		}
+		w = st->queue[st->qTail % ASYNC_QUEUE];
+		__atomic_store_n(&st->qTail, st->qTail + 1, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&st->mutex);
+
+		plate.id = w.id;
+		plate.addr = w.addr;
+		plate.mapped_addr = w.id + w.addr;
+		plate.ack = useACK(w.id);
+		plate.isValid = 1;
+		plate.stack = st;
+		ok = (sendNOW(&plate, w.cmd, w.p1, w.p2, 0) != NULL);
+
+		pthread_mutex_lock(&st->mutex);
+		if(ok){
+			st->async.sent++;
+		}else{
+			st->async.failed++;
+			failed++;
+		}
+		fn = st->onFail;
+		ctx = st->failCtx;
+		pthread_mutex_unlock(&st->mutex);
+
+		if(!ok && fn){
+			f.id = w.id;
+			f.addr = w.addr;
+			f.cmd = w.cmd;
+			f.p1 = w.p1;
+			f.p2 = w.p2;
+			f.error = plateError;
+			fn(&f, ctx);
+		}
+	}
+	draining = 0;
+	return failed;
+}
 
+//Called with busLock held. Takes the plate's writes off the queue, keeping the order of the rest.
+static void asyncDROP(struct plateStack* st, struct piplate* plate){
+	unsigned from, to;
 
-/* Calibration Constants / Flash Memory Functions */
+	pthread_mutex_lock(&st->mutex);
+	for(from = to = st->qTail; from != st->qHead; from++){
+		struct asyncWrite* w = &st->queue[from % ASYNC_QUEUE];
 
-int CalGetByte(struct piplate* plate, char ptr){
-	if(plate->isValid){
-		if(compareWith(plate->id, 2, DAQC2, THERMO)){
-			return safeExtract(sendCMD(plate, 0xFD, 2, ptr, 1));
+		if(w->id == plate->id && w->addr == plate->addr){
+			st->async.dropped++;
+			continue;
 		}
+		if(to != from)
+			st->queue[to % ASYNC_QUEUE] = *w;
+		to++;
 	}
-	return INVAL_CMD;
+	__atomic_store_n(&st->qHead, to, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&st->mutex);
 }
 
-void CalPutByte(struct piplate* plate, char data){
-	if(plate->isValid){
-		if(compareWith(plate->id, 2, DAQC2, THERMO)){
-			sendCMD(plate, 0xFD, 1, data, 0);
-		}
-	}
+//Whether the calling thread holds the plate's bus, e.g. inside a batch.
+static bool asyncHELD(struct plateStack* st){
+	bool held;
+
+	pthread_mutex_lock(&st->mutex);
+	held = busOWNED(st);
+	pthread_mutex_unlock(&st->mutex);
+	return held;
 }
 
-void CalEraseBlock(struct piplate* plate){
-	if(plate->isValid){
-		if(compareWith(plate->id, 2, "DAQC2", THERMO)){
-			sendCMD(plate, 0xFD, 0, 0, 0);
+static void* asyncTHREAD(void* arg){
+	struct plateStack* st = (struct plateStack*)arg;
+
+	pthread_mutex_lock(&st->mutex);
+	while(st->writing){
+		if(st->qHead == st->qTail){
+			pthread_cond_wait(&st->queued, &st->mutex);
+			continue;
 		}
+		pthread_mutex_unlock(&st->mutex);
+		busACQUIRE(st, BUS_NORMAL);
+		asyncDRAIN(st, ASYNC_BATCH);
+		busUNLOCK(st);
+		pthread_mutex_lock(&st->mutex);
 	}
+	pthread_mutex_unlock(&st->mutex);
+	return NULL;
 }
 
-double binaryToDouble(char* list){
-	int i = 0;
-	int polarity = 1;
-	int expsign = 1;
-	double exp;
-	double frac;
-
-	int val = list[0];
-	for(i = 0; i < 3; i++){
-		int l = list[i + 1];
-		val = val << 8;
-		val += l;
+static void asyncPUSH(struct piplate* plate, unsigned char cmd, unsigned char p1, unsigned char p2){
+	struct plateStack* st = plateSTACK(plate);
+	struct asyncWrite* w;
+	unsigned depth;
+
+	pthread_mutex_lock(&st->mutex);
+	while(st->qHead - st->qTail >= ASYNC_QUEUE){
+		pthread_mutex_unlock(&st->mutex);
+		busLOCK(st);
+		asyncDRAIN(st, ASYNC_QUEUE);
+		busUNLOCK(st);
+		pthread_mutex_lock(&st->mutex);
 	}
-	if((val&0x80000000) != 0)//Read first bit
-		polarity = -1;
+	w = &st->queue[st->qHead % ASYNC_QUEUE];
+	w->id = plate->id;
+	w->addr = plate->addr;
+	w->cmd = cmd;
+	w->p1 = p1;
+	w->p2 = p2;
+	__atomic_store_n(&st->qHead, st->qHead + 1, __ATOMIC_RELEASE);
+
+	st->async.queued++;
+	depth = st->qHead - st->qTail;
+	if(depth > st->async.peak)
+		st->async.peak = depth;
+	if(!st->writing){
+		st->writing = 1;
+		if(pthread_create(&st->writer, NULL, asyncTHREAD, st))
+			st->writing = 0;//Left for the next command on the stack to send
+	}
+	pthread_cond_signal(&st->queued);
+	pthread_mutex_unlock(&st->mutex);
+}
 
-	exp = ((val>>24)&0x7F)-64;
-	if(exp < 0)
-		expsign = -1;
+//Stops the writer thread and sends what is still queued.
+static void asyncSTOP(struct plateStack* st){
+	pthread_t writer;
+	bool was;
+
+	pthread_mutex_lock(&st->mutex);
+	was = st->writing;
+	writer = st->writer;
+	st->writing = 0;
+	pthread_cond_broadcast(&st->queued);
+	pthread_mutex_unlock(&st->mutex);
+
+	if(was)
+		pthread_join(writer, NULL);
+	busLOCK(st);
+	asyncDRAIN(st, ASYNC_QUEUE);
+	busUNLOCK(st);
+}
 
-	val=val&0xFFFFFF;
+//Queue the plate's writes instead of waiting for each acknowledge.
+void setASYNC(struct piplate* plate, bool on){
+	if(plate->isValid)
+		__atomic_store_n(&plateHEALTH(plate)->async, on, __ATOMIC_RELEASE);
+}
 
-	double denom = 0xFFFFFF;
+void asyncHANDLER(struct plateStack* st, asyncHandler fn, void* ctx){
+	if(!st)
+		st = stackDEFAULT();
+	pthread_mutex_lock(&st->mutex);
+	st->onFail = fn;
+	st->failCtx = ctx;
+	pthread_mutex_unlock(&st->mutex);
+}
 
-	frac = expsign * (double) val / denom;
+//Sends the stack's queued writes and waits for them. Returns how many of those failed.
+int asyncFLUSH(struct plateStack* st){
+	int failed;
 
-	double r = polarity * pow(10, exp + frac);
+	if(!st)
+		st = stackDEFAULT();
+	busLOCK(st);
+	failed = asyncDRAIN(st, ASYNC_QUEUE);
+	busUNLOCK(st);
+	return failed;
+}
 
-	return r;
+int getASYNCstats(struct plateStack* st, struct asyncStats* stats){
+	if(!stats)
+		return INVAL_CMD;
+	if(!st)
+		st = stackDEFAULT();
+	pthread_mutex_lock(&st->mutex);
+	*stats = st->async;
+	stats->pending = st->qHead - st->qTail;
+	pthread_mutex_unlock(&st->mutex);
+	return 0;
 }
 
-/* Calibration Constants / Flash Memory Functions */
+/* End of async writes */
 
-/* Start of DAQC2 Oscilloscope Commands */
+static char* sendNOW(struct piplate* plate, unsigned char cmd, unsigned char p1, unsigned char p2, int bytesToReturn){
+	struct message m = BASE_MESSAGE;
+	struct plateStack* st = plateSTACK(plate);
+	struct plateHealth* h = plateHEALTH(plate);
+	struct timespec start, deadline, now;
+	int error = PLATE_OK;
+	int attempt;
+	int lane = (safetyCMD(plate, cmd, p1) ? BUS_SAFETY : busClass);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if(lane == BUS_BULK)
+		busYIELD(st);
+	busACQUIRE(st, lane);
+	if(asyncPENDING(st)){
+		if(lane == BUS_SAFETY){//The stop goes now, whatever was queued for the plate is void
+			asyncDROP(st, plate);
+		}else{//Queued writes go first, their time is not this command's
+			asyncDRAIN(st, ASYNC_QUEUE);
+			clock_gettime(CLOCK_MONOTONIC, &start);
+		}
+	}
+	cmdLane = lane;
+	deadline.tv_sec = 0;
+	if(h->timeout){
+		deadline = start;
+		tsADD(&deadline, h->timeout);
+	}
+	if(callDeadline.tv_sec && (!deadline.tv_sec || tsDIFF(&callDeadline, &deadline) < 0))
+		deadline = callDeadline;
 
-void startOSC(struct piplate* plate){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, DAQC2)){
-			plate->osc = (struct oscilloscope*)calloc(1, sizeof(struct oscilloscope));
+	m.addr = plate->mapped_addr;
+	m.cmd = cmd;
+	m.p1 = p1;
+	m.p2 = p2;
+	m.bytesToReturn = bytesToReturn;
+	m.useACK = plate->ack;
 
-			plate->osc->c1State = 1;
-			plate->osc->sRate = 9;
+	for(attempt = 0; ; attempt++){
+		long long backoff;
 
-			sendCMD(plate, 0xA1, 0, 0, 0);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if(deadline.tv_sec && tsDIFF(&deadline, &now) <= 0){
+			error = PLATE_ETIMEOUT;
+			break;
+		}
+		if(h->stats.open && !probing && tsDIFF(&h->reopen, &now) > 0){
+			error = PLATE_EOPEN;
+			break;
 		}
-	}
-}
 
-void stopOSC(struct piplate* plate){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, DAQC2)){
-			if(!plate->osc)
-				free(plate->osc);
+		m.state = 0;
+		if(busIOCTL(st, PIPLATE_SENDCMD, &m) < 0){
+			error = (st->fd < 0 && !busBROKER(st) ? PLATE_ENODEV : PLATE_EIO);
+		}else if(!m.state){
+			error = PLATE_ENORESP;
+			if(bytesToReturn == 0)//May have run, do not send it twice
+				break;
+		}else{
+			struct timespec end;
+
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			if(!draining && bytesToReturn > 0)
+				stampRECORD(&now, &end);
+			error = PLATE_OK;
+			break;
+		}
 
-			sendCMD(plate, 0xA0, 0, 0, 0);
+		if(attempt >= h->retries || probing || h->stats.open)
+			break;
+
+		backoff = (long long)h->backoff << attempt;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if(deadline.tv_sec && tsDIFF(&deadline, &now) < backoff){
+			error = PLATE_ETIMEOUT;
+			break;
+		}
+		h->stats.retries++;
+		if(backoff > 0){//Other plates on the stack go ahead meanwhile
+			struct timespec nap = {backoff / 1000000000, backoff % 1000000000};
+			busNAP(st, lane, &nap);
 		}
 	}
-}
+	healthEND(h, error, &start);
+	if(error != PLATE_OK && !draining && bytesToReturn > 0)
+		stampFAIL();
 
-void setOSCchannel(struct piplate* plate, bool c1, bool c2){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, DAQC2)){
-			plate->osc->c1State = c1;
-			plate->osc->c2State = c2;
-			sendCMD(plate, 0xA2, c1, c2, 0);
+	busUNLOCK(st);
+
+	if(error == PLATE_OK){
+		int i;
+		int size = bytesToReturn >= 0 ? bytesToReturn : BUF_SIZE;
+		for(i = 0; i < size; i ++){
+			reply[i] = m.rBuf[i];
 		}
+		return reply;
 	}
+	return NULL;
 }
 
-/*
-* Rate:		Samples/sec:
-* 0:		100
-* 1:		200
-* 2:		500
-* 3:		1,000
-* 4:		2,000
-* 5:		5,000
-* 6;		10,000
-* 7:		20,000
-* 8:		50,000
-* 9:		100,000
-* 10:		200,000
-* 11:		500,000
-* 12:		1,000,000
-* Note: #12 can only be used with a single channel input.
-*/
+static char* sendCMD(struct piplate* plate, unsigned char cmd, unsigned char p1, unsigned char p2, int bytesToReturn){
+	if(bytesToReturn == 0 && !probing && !draining && __atomic_load_n(&plateHEALTH(plate)->async, __ATOMIC_ACQUIRE)
+		&& !safetyCMD(plate, cmd, p1) && !asyncHELD(plateSTACK(plate))){
+		asyncPUSH(plate, cmd, p1, p2);
+		plateError = PLATE_OK;
+		return reply;
+	}
+	return sendNOW(plate, cmd, p1, p2, bytesToReturn);
+}
 
-void setOSCsweep(struct piplate* plate, char rate){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, DAQC2)){
-			if(rate >= 0 && rate <= 12)
-				sendCMD(plate, 0xA3, rate, 0, 0);
+//Plate on another stack from stackOPEN, NULL for the default one.
+struct piplate pi_plate_init_stack(struct plateStack* stack, char id, char addr){
+	struct piplate plate = { };
+	if(isValid(id, addr)){
+		plate.stack = (stack ? stack : stackDEFAULT());
+		plate.id = id;
+		plate.addr = addr;
+		plate.mapped_addr = id + addr;
+		plate.ack = useACK(id);
+		plate.isValid = 1;
+		probing = 1;
+		if(getADDR(&plate) == plate.addr){
+			probing = 0;
+			return plate;
 		}
+		probing = 0;
 	}
+	plate.isValid = 0;
+	return plate;
 }
 
-void getOSCtraces(struct piplate* plate){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, DAQC2)){
-			int i;
-
-			char cCount = plate->osc->c1State + plate->osc->c2State;
-			char* resp = sendCMD(plate, 0xA4, 0, 0, cCount*2048);
-
-			if(resp){
-				if(cCount == 2){
-					for(i = 0; i < 1024; i++){
-						plate->osc->trace1[i] = resp[4*i]*256 + resp[4*i+1];
-						plate->osc->trace2[i] = resp[4*i+2]*256 + resp[4*i+3];
-					}
-				}else{
-					if(plate->osc->c1State){
-						for(i = 0; i < 1024; i++)
-							plate->osc->trace1[i]=resp[2*i]*256+resp[2*i+1];
-					}else{
-						for(i = 0; i < 1024; i++)
-							plate->osc->trace2[i]=resp[2*i]*256+resp[2*i+1];
-					}
-				}
-			}
-		}
-	}
+struct piplate pi_plate_init(char id, char addr){
+	return pi_plate_init_stack(NULL, id, addr);
 }
 
-void setOSCtrigger(struct piplate* plate, char channel, char* type, char* edge, int level){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, DAQC2)){
-			char option = 0;
-			if(channel >= 1 && channel <= 2)
-				option = 128*(channel-1);
+/*
+* Plates from pi_plate_open carry an arena: one block allocated together with
+* the handle and sized for the state that plate type can use. Each kind of
+* state has a slot in it, so stopping and restarting a feature reuses the same
+* memory. Plates from pi_plate_init have no arena and fall back to calloc.
+*/
 
-			if(!strcmp(type, "normal"))//Options: "normal", "auto"
-				option += 64;
+enum { SLOT_OSC, SLOT_DSP, SLOT_STM, SLOT_MQ, SLOT_DC, SLOT_SPD, SLOT_TMP, SLOT_SERVO, SLOT_MOTION, SLOT_DAQC2P, SLOT_FMON, SLOT_RANGE, SLOT_INPUTS, SLOT_DINMON, SLOTS };
 
-			if(!strcmp(edge, "falling"))//Options: "rising", "falling"
-				option += 32;
+struct plateArena {
+	unsigned char* base;
+	size_t size;
+	size_t used;
+	void* slot[SLOTS];
+	size_t slotSize[SLOTS];
+};
 
-			if(level >= 0 && level <= 4095)
-				sendCMD(plate, 0xA6, option + (level>>8), level&0xFF, 0);
-		}
-	}
-}
+#define ARENA_ALIGN(n) (((n) + 63) & ~(size_t)63)//Slots start on their own cache line
 
-void trigOSCnow(struct piplate* plate){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, DAQC2)){
-			sendCMD(plate, 0xA7, 0, 0, 0);
-		}
-	}
-}
+//Zeroed memory for n items of size, like calloc.
+static void* plateALLOC(struct piplate* plate, int slot, size_t n, size_t size){
+	struct plateArena* a = plate->arena;
 
-void runOSC(struct piplate* plate){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, DAQC2)){
-			sendCMD(plate, 0xA5, 0, 0, 0);
+	if(a){
+		if(!a->slot[slot] && a->used + ARENA_ALIGN(n*size) <= a->size){
+			a->slot[slot] = a->base + a->used;
+			a->slotSize[slot] = ARENA_ALIGN(n*size);
+			a->used += a->slotSize[slot];
 		}
+		if(a->slot[slot] && a->slotSize[slot] >= n*size)
+			return memset(a->slot[slot], 0, n*size);
 	}
+	return calloc(n, size);
 }
 
-/* End of DAQC2 Oscilloscope Commands */
-
-/* Start of stepper motor functions */
-
-void stepperINIT(struct piplate* plate){
-	int i = 0;
+static void plateFREE(struct piplate* plate, void* p){
+	struct plateArena* a = plate->arena;
 
-	plate->stm = (struct stepperMotorParams*)calloc(2, sizeof(struct stepperMotorParams));
-	for(i = 0; i < 2; i++){
-		plate->stm[i].dir = CW;
-		plate->stm[i].resolution = FULL_STEP;
-		plate->stm[i].rate = 500;
-		plate->stm[i].acc = 0;
-	}
+	if(a && (unsigned char*)p >= a->base && (unsigned char*)p < a->base + a->size)
+		return;//Stays in its slot for the next user
+	free(p);
 }
 
-void stepperENABLE(struct piplate* plate){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, DAQC2))
-			sendCMD(plate, 0xB1, 0, 0, 0);
-	}
-}
+/* Start of shared state image */
 
-void stepperDISABLE(struct piplate* plate){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, DAQC2))
-			sendCMD(plate, 0xB0, 0, 0, 0);
-	}
-}
+/*
+* The process that owns the plates can publish what it reads and writes to
+* STATE_SHM. Each plate's entry is guarded by a seqlock: the writer makes seq
+* odd, updates the entry and makes it even again, and readers copy the entry
+* and retry if seq was odd or changed. Readers never make a syscall or touch
+* the bus. Publishing costs one pointer test per call when it is off.
+* A publisher that dies mid update leaves seq odd: readers give up after
+* STATE_RETRIES tries with PLATE_EBUSY, and the next publisher to attach
+* evens it out again.
+*/
 
-void stepperINTenable(struct piplate* plate, char motor){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, DAQC2)){
-			if(motor >= 1 && motor <= 2)
-				sendCMD(plate, 0xB7, motor-1, 0, 0);
-		}
-	}
-}
+enum { STATE_ADC, STATE_DIN, STATE_TEMP, STATE_FREQ, STATE_TACH };
+enum { STATE_DOUT, STATE_RELAY };
+enum { STATE_SET, STATE_CLR, STATE_TOGGLE, STATE_ALL };
 
-void stepperINTdisable(struct piplate* plate, char motor){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, DAQC2)){
-			if(motor >= 1 && motor <= 2)
-				sendCMD(plate, 0xB8, motor-1, 0, 0);
-		}
-	}
-}
+static struct stateImage* stImage;
+static pthread_mutex_t stLock = PTHREAD_MUTEX_INITIALIZER;//Writers within the publishing process
 
-void stepperCONFIG(struct piplate* plate, char motor, char direction, char resolution, int rate, double acceleration){
-	if(plate->isValid){
-		if(!plate->stm)
-			stepperINIT(plate);
+static int64_t stateNOW(void){
+	struct timespec t;
 
-		if(compareWith(plate->id, 1, MOTOR)){
-			if(motor >= 1 && motor <= 2 && (direction == CW || direction == CCW) && resolution >= 0 && resolution <= 3 && rate >= 1 && rate <= 2000 && acceleration >= 0 && acceleration <= 10){
-				int param1 = 0;
-				int param2 = rate & 0x00FF;
-				int cmd = 0x10 + motor - 1;
-				int increment;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (int64_t)t.tv_sec*1000000000 + t.tv_nsec;
+}
 
-				plate->stm[motor].dir = direction;
-				plate->stm[motor].resolution = resolution;
-				plate->stm[motor].rate = rate;
-				plate->stm[motor].acc = acceleration;
+static struct plateState* stateBEGIN(struct piplate* plate){
+	struct plateState* st;
 
-				if (direction == CW)
-					param1 = 0x40;
-				param1 += (resolution << 4);
-				param1 += (rate >> 8);
+	if(!stImage || !plate->isValid || plateSTACK(plate)->index)//Image covers the default stack
+		return NULL;
 
-				sendCMD(plate, cmd, param1, param2, 0);
+	st = &stImage->plate[plate->mapped_addr - DAQC];
+	pthread_mutex_lock(&stLock);
+	__atomic_store_n(&st->seq, st->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	st->id = plate->id;
+	st->addr = plate->addr;
+	st->present = 1;
+	st->updated = stateNOW();
+	return st;
+}
 
-				if(acceleration == 0)
-					increment = 0;
-				else
-					increment = (int)(1024.0 * rate / (acceleration*2000) + 0.5);
+static void stateEND(struct plateState* st){
+	__atomic_store_n(&st->seq, st->seq + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&stLock);
+}
 
-				param1 = 0x80 + (increment>>8);
-				param2 = increment & 0x00FF;
-				sendCMD(plate, cmd, param1, param2, 0);
-			}
-		}
-	}
+static struct stateInput* stateINPUT(struct plateState* st, int kind, int i){
+	if(kind == STATE_ADC && i >= 0 && i < 9)
+		return &st->adc[i];
+	if(kind == STATE_DIN)
+		return &st->din;
+	if(kind == STATE_TEMP && i >= 0 && i < 12)
+		return &st->temp[i];
+	if(kind == STATE_FREQ)
+		return &st->freq;
+	if(kind == STATE_TACH && i >= 0 && i < 4)
+		return &st->tach[i];
+	return NULL;
 }
 
-void stepperDIR(struct piplate* plate, char motor, char direction){
-	if(plate->isValid){
-		if(!plate->stm)
-			stepperINIT(plate);
+//Publishes an input reading and hands it back, so getters can return through it.
+static double stateIN(struct piplate* plate, int kind, int i, double value){
+	struct plateState* st = stateBEGIN(plate);
 
-		if(compareWith(plate->id, 1, DAQC2)){
-			if(motor >= 1 && motor <= 2){
-				sendCMD(plate, 0xB3, motor - 1, direction, 0);
-			}
-		}else if(compareWith(plate->id, 1, MOTOR)){
-			stepperCONFIG(plate, motor, direction, plate->stm[motor].resolution, plate->stm[motor].rate, plate->stm[motor].acc);
+	if(st){
+		struct stateInput* in = stateINPUT(st, kind, i);
+		if(in){
+			int64_t t = stampNS();
+			in->value = value;
+			in->time = (t ? t : st->updated);
 		}
+		stateEND(st);
 	}
+	return value;
 }
 
-void stepperRATE(struct piplate* plate, char motor, int rate, char resolution){
-	if(plate->isValid){
-		if(!plate->stm)
-			stepperINIT(plate);
+//Several readings of one kind taken together, published as one update.
+static void stateINS(struct piplate* plate, int kind, const double* values, int n){
+	struct plateState* st = stateBEGIN(plate);
+	int i;
 
-		if(compareWith(plate->id, 1, DAQC2)){
-			if(motor >= 1 && motor <= 2 && rate >= 0 && rate <= 500 && resolution >= FULL_STEP && resolution <= HALF_STEP){
-				int rateInc = (int)(rate*pow(2, 13)/1000.0 + 0.5);
-				int param1 = ((motor-1)<<7)+(rateInc>>8);
-				int param2;
+	if(st){
+		int64_t t = stampNS();
 
-				if(resolution == HALF_STEP)
-					param1 |= 0x40;
-				param2 = rateInc&0xFF;
-				sendCMD(plate, 0xB2, param1, param2, 0);
+		for(i = 0; i < n; i++){
+			struct stateInput* in = stateINPUT(st, kind, i);
+			if(in){
+				in->value = values[i];
+				in->time = (t ? t : st->updated);
 			}
-		}else if(compareWith(plate->id, 1, MOTOR)){
-			stepperCONFIG(plate, motor, plate->stm[motor].dir, resolution, rate, plate->stm[motor].acc);
 		}
+		stateEND(st);
 	}
 }
 
-void stepperACC(struct piplate* plate, char motor, double acceleration){
-	if(plate->isValid){
-		if(!plate->stm)
-			stepperINIT(plate);
+//Single digital input bit, folded into the published DIN byte.
+static int stateDINbit(struct piplate* plate, int bit, int value){
+	struct plateState* st = stateBEGIN(plate);
 
-		if(compareWith(plate->id, 1, MOTOR)){
-			stepperCONFIG(plate, motor, plate->stm[motor].dir, plate->stm[motor].resolution, plate->stm[motor].rate, acceleration);
-		}
+	if(st){
+		int din = ((int)st->din.value & ~(1 << bit)) | (value << bit);
+		st->din.value = din;
+		st->din.time = st->updated;
+		stateEND(st);
 	}
+	return value;
 }
 
-void stepperMOVE(struct piplate* plate, char motor, int steps){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, DAQC2)){
-			if(motor >= 1 && motor <= 2 && steps >= -16383 && steps <= 16383){
-				bool stepSign = (steps > 0 ? 1 : 0);
-				int param1 = ((motor - 1) << 7) + (stepSign << 6) + (steps>>8);
-				int param2 = abs(steps) & 0xFF;
-				sendCMD(plate, 0xB4, param1, param2, 0);
-			}
-		}else if(compareWith(plate->id, 1, MOTOR)){
-			if(motor >= 1 && motor <= 2 && steps <= 65535){
-				char cmd = 0x12 + motor - 1;
-				int param1 = steps>>8;
-				int param2 = steps&0xFF;
-				sendCMD(plate, cmd, param1, param2, 0);
-			}
-		}
+//Shadows an output bit change (bit is zero based) or a whole output byte.
+static void stateBITS(struct piplate* plate, int kind, int op, int bit){
+	struct plateState* st = stateBEGIN(plate);
+
+	if(st){
+		int* out = (kind == STATE_DOUT ? &st->dout : &st->relays);
+		if(op == STATE_SET)
+			*out |= (1 << bit);
+		else if(op == STATE_CLR)
+			*out &= ~(1 << bit);
+		else if(op == STATE_TOGGLE)
+			*out ^= (1 << bit);
+		else
+			*out = bit;
+		stateEND(st);
 	}
 }
 
-void stepperJOG(struct piplate* plate, char motor){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, DAQC2)){
-			if(motor >= 1 && motor <= 2)
-				sendCMD(plate, 0xB5, motor-1, 0, 0);
-		}else if(compareWith(plate->id, 1, MOTOR)){
-			if(motor >= 1 && motor <= 2)
-				sendCMD(plate, 0x14 + motor - 1, 0, 0, 0);
-		}
-	}
-}
+static void stateDAC(struct piplate* plate, int channel, double value){
+	struct plateState* st = stateBEGIN(plate);
 
-void stepperSTOP(struct piplate* plate, char motor){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, DAQC2)){
-			if(motor >= 1 && motor <= 2)
-				sendCMD(plate, 0xB6, motor - 1, 0, 0);
-		}else if(compareWith(plate->id, 1, MOTOR)){
-			if(motor >= 1 && motor <= 2)
-				sendCMD(plate, 0x16 + motor - 1, 0, 0, 0);
-		}
+	if(st){
+		if(channel >= 0 && channel < 4)
+			st->dac[channel] = value;
+		stateEND(st);
 	}
 }
 
-void stepperOFF(struct piplate* plate, char motor){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, DAQC2)){
-			if(motor >= 1 && motor <= 2)
-				sendCMD(plate, 0xBA, motor - 1, 0, 0);
-		}else if(compareWith(plate->id, 1, MOTOR)){
-				if(motor >= 1 && motor <= 2)
-					sendCMD(plate, 0x1E + motor - 1, 0, 0, 0);
-		}
+static void statePWM(struct piplate* plate, int channel, int value){
+	struct plateState* st = stateBEGIN(plate);
+
+	if(st){
+		if(channel >= 0 && channel < 6)
+			st->pwm[channel] = value;
+		stateEND(st);
 	}
 }
 
-/* End of stepper motor functions */
+static void stateSERVO(struct piplate* plate){
+	struct plateState* st = stateBEGIN(plate);
+	int i;
 
-/* Start of dc motor functions */
+	if(st){
+		for(i = 0; i < 8; i++)
+			st->servo[i] = plate->servo->angle[i];
+		stateEND(st);
+	}
+}
 
-void dcINIT(struct piplate* plate){
-	int i = 0;
+//Copies the cached dc and stepper parameters of a plate.
+static void stateMOTORS(struct piplate* plate){
+	struct plateState* st = stateBEGIN(plate);
+	int i;
 
-	plate->dc = (struct dcMotorParams*)calloc(4, sizeof(struct dcMotorParams));
-	for(i = 0; i < 4; i++){
-		plate->dc[i].dir = CW;
-		plate->dc[i].speed = 50;
-		plate->dc[i].acc = 0;
+	if(st){
+		for(i = 0; plate->dc && i < 4; i++){
+			st->dc[i].dir = plate->dc[i].dir;
+			st->dc[i].speed = plate->dc[i].speed;
+			st->dc[i].acc = plate->dc[i].acc;
+		}
+		for(i = 0; plate->stm && i < 2; i++){
+			st->stm[i].dir = plate->stm[i].dir;
+			st->stm[i].resolution = plate->stm[i].resolution;
+			st->stm[i].rate = plate->stm[i].rate;
+			st->stm[i].acc = plate->stm[i].acc;
+			st->stm[i].position = plate->stm[i].position;
+			st->stm[i].target = plate->stm[i].target;
+			st->stm[i].moving = plate->stm[i].moving;
+		}
+		stateEND(st);
 	}
 }
 
-void dcCONFIG(struct piplate* plate, char motor, char dir, char speed, double acceleration){
-	if(plate->isValid){
-		if(!plate->dc)
-			dcINIT(plate);
+//Starts publishing from this process. Only one process may publish at a time.
+int stateOPEN(){
+	struct stateImage* img;
+	int fd;
 
-		if(compareWith(plate->id, 1, MOTOR)){
-			if(motor >= 1 && motor <= 4 && (dir == CW || dir == CCW) && speed >= 0 && speed <= 100 && acceleration >= 0 && acceleration <= 10){
-				int param1 = (motor - 1) << 6;
-				int param2;
-				int cmd = 0x3A + (motor - 1);
-				int v = (int)((speed*1023.0/100.0) + 0.5);
-				int increment;
+	if(stImage)
+		return 0;
 
-				plate->dc[motor - 1].dir = dir;
-				plate->dc[motor - 1].speed = speed;
-				plate->dc[motor - 1].acc = acceleration;
+	fd = shm_open(STATE_SHM, O_RDWR | O_CREAT, 0644);
+	if(fd < 0)
+		return INVAL_CMD;
+	if(ftruncate(fd, sizeof(struct stateImage)) < 0){
+		close(fd);
+		return INVAL_CMD;
+	}
+	img = (struct stateImage*)mmap(NULL, sizeof(struct stateImage), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(img == MAP_FAILED)
+		return INVAL_CMD;
+
+	if(img->magic == STATE_MAGIC && img->writerPid && img->writerPid != (uint32_t)getpid() && !(kill(img->writerPid, 0) < 0 && errno == ESRCH)){
+		munmap(img, sizeof(struct stateImage));
+		return INVAL_CMD;
+	}
 
-				if(motor == 1 || motor == 2)
-					v = (v*5)>>3;
+	if(img->magic != STATE_MAGIC || img->version != STATE_VERSION){
+		memset(img, 0, sizeof(struct stateImage));
+		img->version = STATE_VERSION;
+		__atomic_store_n(&img->magic, STATE_MAGIC, __ATOMIC_RELEASE);
+	}else{
+		int i;
 
-				if(dir == CW)
-					param1 += 0x10;
+		for(i = 0; i < STATE_PLATES; i++){//Entries the last publisher left mid update
+			uint32_t seq = __atomic_load_n(&img->plate[i].seq, __ATOMIC_RELAXED);
+			if(seq & 1)
+				__atomic_store_n(&img->plate[i].seq, seq + 1, __ATOMIC_RELEASE);
+		}
+	}
+	img->writerPid = getpid();
 
-				param1 += (v >> 8);
-				param2 = v & 0x00FF;
-				sendCMD(plate, 0x30, param1, param2, 0);
+	pthread_mutex_lock(&stLock);
+	stImage = img;
+	pthread_mutex_unlock(&stLock);
+	return 0;
+}
 
-				if(acceleration == 0)
-					increment = 0;
-				else
-					increment = (int)(1024.0*v/(acceleration*RMAX)+0.5);
+//Stops publishing. The segment and its last values stay for readers.
+void stateCLOSE(){
+	struct stateImage* img;
 
-				param1 = (increment >> 8);
-				param2 = increment&0x00FF;
+	pthread_mutex_lock(&stLock);
+	img = stImage;
+	stImage = NULL;
+	pthread_mutex_unlock(&stLock);
 
-				sendCMD(plate, cmd, param1, param2, 0);
-			}
-		}
+	if(img){
+		img->writerPid = 0;
+		munmap(img, sizeof(struct stateImage));
 	}
 }
 
-void dcSPEED(struct piplate* plate, char motor, char speed){
-	if(plate->isValid){
-		if(!plate->dc)
-			dcINIT(plate);
+//Maps the image read only, for consumers. NULL if nobody has published yet.
+const struct stateImage* stateMAP(){
+	struct stateImage* img;
+	int fd = shm_open(STATE_SHM, O_RDONLY, 0);
 
-		if(compareWith(plate->id, 1, MOTOR)){
-			if(motor >= 1 && motor <= 4 && speed >= 0 && speed <= 100){
-				int param1 = (motor-1)<<6;
-				int param2;
-				int v = (int)((speed*1023.0/100.0) + 0.5);
-				if(motor == 1 || motor == 2)
-					v = (v*5)>>3;
-
-				param1 += (v>>8);
-				param2 = v&0x00FF;
-				sendCMD(plate, 0x33, param1, param2, 0);
-			}
-		}
+	if(fd < 0)
+		return NULL;
+	img = (struct stateImage*)mmap(NULL, sizeof(struct stateImage), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(img == MAP_FAILED)
+		return NULL;
+	if(__atomic_load_n(&img->magic, __ATOMIC_ACQUIRE) != STATE_MAGIC || img->version != STATE_VERSION){
+		munmap(img, sizeof(struct stateImage));
+		return NULL;
 	}
+	return img;
 }
 
-void dcDIR(struct piplate* plate, char motor, char dir){
-	if(plate->isValid){
-		if(!plate->dc)
-			dcINIT(plate);
-
-		if(compareWith(plate->id, 1, MOTOR)){
-			if(motor >= 1 && motor <= 4)
-				dcCONFIG(plate, motor, plate->dc[motor - 1].speed, dir, plate->dc[motor - 1].acc);
+/*
+* Consistent copy of one plate's entry. INVAL_CMD if it was never published,
+* or with getERROR at PLATE_EBUSY if it stayed mid update for STATE_RETRIES
+* tries.
+*/
+int stateREAD(const struct stateImage* img, char id, char addr, struct plateState* out){
+	const struct plateState* st;
+	uint32_t s1, s2;
+	int tries = 0;
+
+	if(!img || !out || !isValid(id, addr))
+		return INVAL_CMD;
+
+	plateError = PLATE_OK;
+	st = &img->plate[id + addr - DAQC];
+	do{
+		if(tries++ >= STATE_RETRIES){
+			plateError = PLATE_EBUSY;
+			return INVAL_CMD;
 		}
-	}
+		s1 = __atomic_load_n(&st->seq, __ATOMIC_ACQUIRE);
+		if(s1 & 1){
+			sched_yield();//Writer active, it only holds it for a few stores
+			continue;
+		}
+		memcpy(out, (const void*)st, sizeof(struct plateState));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		s2 = __atomic_load_n(&st->seq, __ATOMIC_RELAXED);
+	}while((s1 & 1) || s1 != s2);
+
+	return (out->present ? 0 : INVAL_CMD);
 }
 
-void dcACC(struct piplate* plate, char motor, double acceleration){
-	if(plate->isValid){
-		if(!plate->dc)
-			dcINIT(plate);
+/* End of shared state image */
 
-		if(compareWith(plate->id, 1, MOTOR)){
-			if(motor >= 1 && motor <= 4)
-				dcCONFIG(plate, motor, plate->dc[motor - 1].speed, plate->dc[motor - 1].dir, acceleration);
-		}
-	}
-}
+static bool busINT(struct plateStack* st){
+	int resp;
 
-void dcSTART(struct piplate* plate, char motor){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, MOTOR)){
-			sendCMD(plate, 0x31, motor-1, 0, 0);
-		}
-	}
+	busLOCK(st);
+	resp = busIOCTL(st, PIPLATE_GETINT, NULL);
+	busUNLOCK(st);
+
+	return resp > 0;
 }
 
-void dcSTOP(struct piplate* plate, char motor){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, MOTOR)){
-			sendCMD(plate, 0x32, motor-1, 0, 0);
-		}
-	}
+//Interrupt line of the default stack.
+bool getINT(){
+	return busINT(stackDEFAULT());
 }
-/* End of dc motor functions */
 
-/* Start of motor interrupt functions */
+/* Start of system commands: */
 
-void setSENSORint(struct piplate* plate, char sensor){
+int getADDR(struct piplate* plate){
 	if(plate->isValid){
-		if(compareWith(plate->id, 1, MOTOR)){
-			if(sensor >= 1 && sensor <= 4)
-				sendCMD(plate, 0x24, sensor, 0, 0);
-		}
+		int resp = safeExtract(sendCMD(plate, 0x00, 0, 0, 1));
+		return (resp > 0 ? resp - plate->id : resp);
 	}
+	return INVAL_CMD;
 }
 
-void clrSENSORint(struct piplate* plate, char sensor){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, MOTOR)){
-			if(sensor >= 1 && sensor <= 4)
-				sendCMD(plate, 0x25, sensor, 0, 0);
-		}
-	}
+char* getID(struct piplate* plate){
+	if(plate->isValid)
+		return sendCMD(plate, 0x01, 0, 0, -1);
+	return NULL;
 }
 
-void enablestepSTOPint(struct piplate* plate, char motor){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, MOTOR)){
-			if(motor >= 1 && motor <= 2)
-				sendCMD(plate, 0x1A + (motor - 1), 0, 0, 0);
-		}
-	}
+int getHWrev(struct piplate* plate){
+	if(plate->isValid)
+		return safeExtract(sendCMD(plate, 0x02, 0, 0, 1));
+	return INVAL_CMD;
 }
 
-void disablestepSTOPint(struct piplate* plate, char motor){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, MOTOR)){
-			if(motor >= 1 && motor <= 2)
-				sendCMD(plate, 0x1C + (motor - 1), 0, 0, 0);
-		}
-	}
+int getFWrev(struct piplate* plate){
+	if(plate->isValid)
+		return safeExtract(sendCMD(plate, 0x03, 0, 0, 1));
+	return INVAL_CMD;
 }
 
-void enablestepSTEADYint(struct piplate* plate, char motor){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, MOTOR)){
-			if(motor >= 1 && motor <= 2)
-				sendCMD(plate, 0x4A + (motor - 1), 0, 0, 0);
-		}
-	}
+void intEnable(struct piplate* plate){
+	if(plate->isValid && compareWith(plate->id, 4, DAQC, DAQC2, MOTOR, THERMO))
+		sendCMD(plate, 0x04, 0, 0, 0);
 }
 
-void disablestepSTEADYint(struct piplate* plate, char motor){
+void intDisable(struct piplate* plate){
+	if(plate->isValid && compareWith(plate->id, 4, DAQC, DAQC2, MOTOR, THERMO))
+		sendCMD(plate, 0x05, 0, 0, 0);
+}
+
+int getINTflags(struct piplate* plate){
+	if(plate->isValid && compareWith(plate->id, 3, DAQC, DAQC2, THERMO))
+		return safeExtract(sendCMD(plate, 0x06, 0, 0, 1));
+	return INVAL_CMD;
+}
+
+int getINTflag0(struct piplate* plate){
+	if(plate->isValid && compareWith(plate->id, 1, MOTOR))
+		return safeExtract(sendCMD(plate, 0x06, 0, 0, 1));
+	return INVAL_CMD;
+}
+
+int getINTflag1(struct piplate* plate){
+	if(plate->isValid && compareWith(plate->id, 1, MOTOR))
+		return safeExtract(sendCMD(plate, 0x07, 0, 0, 1));
+	return INVAL_CMD;
+}
+
+void reset(struct piplate* plate){
 	if(plate->isValid){
-		if(compareWith(plate->id, 1, MOTOR)){
-			if(motor >= 1 && motor <= 2)
-				sendCMD(plate, 0x4C + (motor - 1), 0, 0, 0);
-		}
+		int i;
+
+		sendCMD(plate, 0x0F, 0, 0, 0);
+
+		//The plate forgot its motor setup, send it all again next time.
+		for(i = 0; plate->dc && i < 4; i++)
+			plate->dc[i].synced = 0;
+		for(i = 0; plate->stm && i < 2; i++)
+			plate->stm[i].synced = 0;
 	}
 }
 
-void enabledcSTOPint(struct piplate* plate, char motor){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, MOTOR)){
-			if(motor >= 1 && motor <= 4)
-				sendCMD(plate, 0x34, motor - 1, 0, 0);
-		}
+/* End of system commands */
+
+/* Start of plate discovery */
+
+/*
+* The SPI bus is a single channel so probes cannot overlap on the wire. What
+* costs time is the gaps between them and the timeouts of empty addresses, so
+* every address is probed inside one batch with the device node held open, and
+* only the plates that answer are asked for their ID and revisions. A cold scan
+* is still one probe for each of the 48 type/address pairs: addresses are set
+* by jumper on each plate, so a plate at address 3 does not imply one at 0 and
+* probing address 0 first would miss it.
+*
+* The inventory is cached in PLATE_CACHE, keyed by the kernel boot id. Within
+* a boot the cached entries are just checked with one getADDR each. After a
+* reboot, or if a cached plate stops answering, the whole stack is probed
+* again. A plate hot plugged since the cache was written is only found by a
+* probe with useCache=0.
+*
+* The cache lives in a directory of its own that must belong to the calling
+* user and be closed to writes by others; the library often runs as root, so
+* it is never written through a name someone else could have planted. If the
+* directory cannot be made safe there is no cache.
+*/
+
+static const char plateTypes[6] = {DAQC, MOTOR, RELAY, DAQC2, THERMO, TINKER};
+
+static void bootID(char* id, int len){
+	FILE* f = fopen("/proc/sys/kernel/random/boot_id", "r");
+
+	id[0] = 0;
+	if(f){
+		if(fgets(id, len, f))
+			id[strcspn(id, "\n")] = 0;
+		fclose(f);
 	}
 }
 
-void disabledcSTOPint(struct piplate* plate, char motor){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, MOTOR)){
-			if(motor >= 1 && motor <= 4)
-				sendCMD(plate, 0x35, motor - 1, 0, 0);
-		}
+static void plateINFO(struct piplate* plate, struct plateInfo* info){
+	char* ident = getID(plate);
+
+	info->id = plate->id;
+	info->addr = plate->addr;
+	info->ident[0] = 0;
+	if(ident){
+		strncpy(info->ident, ident, sizeof(info->ident)-1);
+		info->ident[sizeof(info->ident)-1] = 0;
 	}
+	info->hw = getHWrev(plate);
+	info->fw = getFWrev(plate);
 }
 
-void enabledcSTEADYint(struct piplate* plate, char motor){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, MOTOR)){
-			if(motor >= 1 && motor <= 4)
-				sendCMD(plate, 0x36, motor - 1, 0, 0);
-		}
+static bool cacheDIR(void){
+	struct stat sb;
+
+	if(mkdir(PLATE_CACHE_DIR, 0755) < 0 && errno != EEXIST)
+		return 0;
+	return lstat(PLATE_CACHE_DIR, &sb) == 0 && S_ISDIR(sb.st_mode) && sb.st_uid == geteuid() && !(sb.st_mode & 022);
+}
+
+static int readCACHE(const char* boot, struct plateInfo* list, int max){
+	char line[128];
+	int n = 0;
+	int fd;
+	FILE* f;
+
+	if(!cacheDIR() || (fd = open(PLATE_CACHE, O_RDONLY | O_NOFOLLOW)) < 0)
+		return INVAL_CMD;
+	f = fdopen(fd, "r");
+	if(!f){
+		close(fd);
+		return INVAL_CMD;
+	}
+
+	if(!fgets(line, sizeof(line), f) || strncmp(line, boot, strlen(boot)) || line[strlen(boot)] != '\n'){
+		fclose(f);
+		return INVAL_CMD;
 	}
+
+	while(n < max && fgets(line, sizeof(line), f)){
+		int id, addr, hw, fw, off = 0;
+
+		if(sscanf(line, "%d %d %d %d %n", &id, &addr, &hw, &fw, &off) < 4 || !isValid(id, addr))
+			continue;
+		list[n].id = id;
+		list[n].addr = addr;
+		list[n].hw = hw;
+		list[n].fw = fw;
+		line[strcspn(line, "\n")] = 0;
+		strncpy(list[n].ident, line + off, sizeof(list[n].ident)-1);
+		list[n].ident[sizeof(list[n].ident)-1] = 0;
+		n++;
+	}
+	fclose(f);
+	return n;
 }
 
-void disabledcSTEADYint(struct piplate* plate, char motor){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, MOTOR)){
-			if(motor >= 1 && motor <= 4)
-				sendCMD(plate, 0x37, motor - 1, 0, 0);
-		}
+static void writeCACHE(const char* boot, const struct plateInfo* list, int n){
+	char tmp[] = PLATE_CACHE ".XXXXXX";
+	FILE* f;
+	int fd;
+	int i;
+
+	if(!cacheDIR() || (fd = mkstemp(tmp)) < 0)
+		return;
+	f = fdopen(fd, "w");
+	if(!f){
+		close(fd);
+		unlink(tmp);
+		return;
 	}
+	fchmod(fd, 0644);
+
+	fprintf(f, "%s\n", boot);
+	for(i = 0; i < n; i++)
+		fprintf(f, "%d %d %d %d %s\n", list[i].id, list[i].addr, list[i].hw, list[i].fw, list[i].ident);
+
+	if(fclose(f) == 0)
+		rename(tmp, PLATE_CACHE);//Readers never see a half written file
+	else
+		unlink(tmp);
 }
 
-/* End of motor interrupt functions */
+/*
+* Fills list with up to max installed plates and returns how many were found,
+* or INVAL_CMD if the device node cannot be opened. useCache=0 forces a full
+* probe (the cache is still refreshed).
+*/
 
-/* Start of thermo functions */
+int discoverPLATES(struct plateInfo* list, int max, bool useCache){
+	struct plateStack* st = stackDEFAULT();
+	char boot[64];
+	int n = 0;
+	int prev;
+	int i, j;
 
-//Convert 32 bit number to a double
-void tempINIT(struct piplate* plate){
-	int i;
+	if(!list || max <= 0)
+		return INVAL_CMD;
 
-	plate->tmp = (struct tempParams*)calloc(1, sizeof(struct tempParams));
-	for(i = 0; i < 12; i ++){
-		plate->tmp->scale[i] = KELVINS;//Set scales
+	bootID(boot, sizeof(boot));
+
+	prev = setBUSclass(BUS_BULK);
+	busLOCK(st);
+	if(!busREADY(st)){
+		busUNLOCK(st);
+		setBUSclass(prev);
+		return INVAL_CMD;
 	}
 
-	for(i = 0; i < 8; i ++){
-		plate->tmp->type[i] = 'k';//Set types
+	if(useCache && boot[0]){
+		n = readCACHE(boot, list, max);
+		for(i = 0; i < n; i++){
+			struct piplate plate = pi_plate_init(list[i].id, list[i].addr);
+			if(!plate.isValid)
+				break;
+		}
+		if(n >= 0 && i == n){
+			busUNLOCK(st);
+			setBUSclass(prev);
+			return n;
+		}
+		n = 0;
 	}
 
-	//Calibration data from flash memory
+	for(i = 0; i < 6; i++){
+		for(j = 0; j < 8; j++){
+			struct piplate plate = pi_plate_init(plateTypes[i], j);
 
-	if(compareWith(plate->id, 1, THERMO)){
-		char values[4];
-		for(i = 0; i < 4; i ++){
-			values[i] = CalGetByte(plate, i);
+			if(plate.isValid && n < max)
+				plateINFO(&plate, &list[n++]);
 		}
-		plate->tmp->calBias = binaryToDouble(values);
+	}
+	busUNLOCK(st);
+	setBUSclass(prev);
 
-		for(i = 0; i < 8; i++){
-			int j;
-			double val;
-			for(j = 0; j < 4; j++){
-				values[j]=CalGetByte(plate, 8*i+j+4);
-			}
-			plate->tmp->calOffset[i]=binaryToDouble(values);
-			for(j = 4; j < 8; j++){
-				values[j-4]=CalGetByte(plate, 8*i+j+4);
-			}
-			plate->tmp->calScale[i]=binaryToDouble(values);
+	if(boot[0])
+		writeCACHE(boot, list, n);
+	return n;
+}
+
+/* End of plate discovery */
+
+/* Start of interrupt dispatch */
+
+/*
+* Reading a plate's flags clears them, so every consumer of interrupts goes
+* through one dispatcher: it reads each attached plate's flags once per
+* interrupt and hands them to all handlers for that plate. MOTOR flags are
+* getINTflag0 in the low byte and getINTflag1 in the high byte. Every stack
+* has its own interrupt line, and with intTHREADstart its own dispatch thread,
+* so a busy stack does not delay handlers on another.
+*/
+
+static struct {
+	struct piplate* plate;
+	intHandler fn;
+	void* ctx;
+} intHandlers[INT_HANDLERS_MAX];
+static pthread_mutex_t intLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_rwlock_t intPass = PTHREAD_RWLOCK_INITIALIZER;//Held for reading across each dispatch pass
+static bool intRunning;
+static long intPeriod;
+
+int intATTACH(struct piplate* plate, intHandler fn, void* ctx){
+	int i;
+	int r = INVAL_CMD;
+
+	if(!plate->isValid || !compareWith(plate->id, 4, DAQC, DAQC2, MOTOR, THERMO) || !fn)
+		return INVAL_CMD;
+
+	pthread_mutex_lock(&intLock);
+	for(i = 0; i < INT_HANDLERS_MAX; i++){
+		if(!intHandlers[i].fn){
+			intHandlers[i].plate = plate;
+			intHandlers[i].fn = fn;
+			intHandlers[i].ctx = ctx;
+			r = 0;
+			break;
 		}
 	}
+	pthread_mutex_unlock(&intLock);
+	return r;
 }
 
-void setSCALE(struct piplate* plate, char channel, char scale){
-	if(plate->isValid){
-		if(!plate->tmp)
-			tempINIT(plate);
+void intDETACH(struct piplate* plate, intHandler fn, void* ctx){
+	int i;
 
-		if(compareWith(plate->id, 1, THERMO)){
-			if(channel >= 1 && channel <= 12){
-				if(scale == KELVINS || scale == CELSIUS || scale == FAHRENHEIT)
-					plate->tmp->scale[channel - 1] = scale;
-			}
-		}else if(compareWith(plate->id, 1, DAQC)){
-			if(channel >= 0 && channel <= 7){
-				if(scale == KELVINS || scale == CELSIUS || scale == FAHRENHEIT)
-					plate->tmp->scale[channel] = scale;
-			}
-		}else if(compareWith(plate->id, 1, TINKER)){
-			if(channel >= 1 && channel <= 8){
-				if(scale == KELVINS || scale == CELSIUS || scale == FAHRENHEIT)
-					plate->tmp->scale[channel - 1] = scale;
-			}
-		}
+	pthread_mutex_lock(&intLock);
+	for(i = 0; i < INT_HANDLERS_MAX; i++){
+		if(intHandlers[i].plate == plate && intHandlers[i].fn == fn && intHandlers[i].ctx == ctx)
+			intHandlers[i].fn = NULL;
 	}
+	pthread_mutex_unlock(&intLock);
 }
 
-void setTYPE(struct piplate* plate, char channel, char type){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, THERMO)){
-			if(!plate->tmp)
-				tempINIT(plate);
+//Waits out a dispatch pass that may still be running a handler just detached.
+static void intDRAIN(void){
+	pthread_rwlock_wrlock(&intPass);
+	pthread_rwlock_unlock(&intPass);
+}
 
-			if(channel >= 1 && channel <= 8){
-				if(type == 'k' || type == 'j')
-					plate->tmp->type[channel - 1] = type;
-			}
-		}
+//Drops every handler for a plate and waits out a dispatch pass that may still hold it.
+static void intRELEASE(struct piplate* plate){
+	int i;
+
+	pthread_mutex_lock(&intLock);
+	for(i = 0; i < INT_HANDLERS_MAX; i++){
+		if(intHandlers[i].plate == plate)
+			intHandlers[i].fn = NULL;
 	}
+	pthread_mutex_unlock(&intLock);
+
+	intDRAIN();
 }
 
-char getTYPE(struct piplate* plate, char channel){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, THERMO)){
-			if(!plate->tmp)
-				tempINIT(plate);
+static int intFLAGS(struct piplate* plate){
+	if(compareWith(plate->id, 1, MOTOR)){
+		int f0 = getINTflag0(plate);
+		int f1 = getINTflag1(plate);
+		if(f0 < 0 || f1 < 0)
+			return INVAL_CMD;
+		return (f0 & 0xFF) | ((f1 & 0xFF) << 8);
+	}
+	return getINTflags(plate);
+}
 
-			if(channel >= 1 && channel <= 8)
-				return plate->tmp->type[channel - 1];
+static int intSERVE(struct plateStack* st){
+	struct piplate* plates[INT_HANDLERS_MAX];
+	int flags[INT_HANDLERS_MAX];
+	int nPlates = 0;
+	int handled = 0;
+	struct timespec seen;
+	int i, j;
+
+	if(!busINT(st))
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &seen);
+
+	pthread_rwlock_rdlock(&intPass);
+	pthread_mutex_lock(&intLock);
+	for(i = 0; i < INT_HANDLERS_MAX; i++){
+		if(intHandlers[i].fn && plateSTACK(intHandlers[i].plate) == st){
+			for(j = 0; j < nPlates && plates[j] != intHandlers[i].plate; j++);
+			if(j == nPlates)
+				plates[nPlates++] = intHandlers[i].plate;
 		}
 	}
-}
+	pthread_mutex_unlock(&intLock);
 
-char getSCALE(struct piplate* plate, char channel){
-	if(plate->isValid){
-		if(!plate->tmp)
-			tempINIT(plate);
+	for(j = 0; j < nPlates; j++){
+		flags[j] = intFLAGS(plates[j]);
+		if(flags[j] > 0)
+			handled++;
+	}
 
-		if(compareWith(plate->id, 1, THERMO)){
-			if(channel >= 1 && channel <= 12)
-				return plate->tmp->scale[channel - 1];
-		}else if(compareWith(plate->id, 1, DAQC)){
-			if(channel >= 0 && channel <= 7)
-				return plate->tmp->scale[channel];
-		}else if(compareWith(plate->id, 1, TINKER)){
-			if(channel >= 1 && channel <= 8)
-				return plate->tmp->scale[channel - 1];
+	for(i = 0; i < INT_HANDLERS_MAX; i++){
+		intHandler fn;
+		struct piplate* plate;
+		void* ctx;
+
+		pthread_mutex_lock(&intLock);
+		fn = intHandlers[i].fn;
+		plate = intHandlers[i].plate;
+		ctx = intHandlers[i].ctx;
+		pthread_mutex_unlock(&intLock);
+
+		if(!fn)
+			continue;
+		for(j = 0; j < nPlates; j++){
+			if(plates[j] == plate && flags[j] > 0)
+				fn(plate, flags[j], &seen, ctx);
 		}
 	}
-	return INVAL_CMD;
+	pthread_rwlock_unlock(&intPass);
+	return handled;
 }
 
-double getTEMP(struct piplate* plate, char channel){
-	if(plate->isValid){
-		if(!plate->tmp)
-			tempINIT(plate);
+//Checks the interrupt line of every stack and dispatches flags. Returns the number of plates with flags set.
+int intSERVICE(){
+	int n;
+	int handled = 0;
+	int i;
 
-		if(compareWith(plate->id, 1, THERMO)){
-			if(channel >= 1 && channel <= 12){
-				int Tvals[2];
-				char* resp = sendCMD(plate, 0x70, channel - 1, 0, 4);
-				double temp;
+	stackDEFAULT();
+	n = __atomic_load_n(&stackCount, __ATOMIC_ACQUIRE);
+	for(i = 0; i < n; i++)
+		handled += intSERVE(&stacks[i]);
+	return handled;
+}
 
-				channel--;
+bool intTHREADrunning(){
+	return __atomic_load_n(&intRunning, __ATOMIC_ACQUIRE);
+}
 
-				if(!resp)
-					return INVAL_CMD;
+static void* intTHREAD(void* arg){
+	struct plateStack* st = (struct plateStack*)arg;
+	struct timespec nap = {0, 0};
 
-				Tvals[0] = resp[0] * 256 + resp[1];//T channel data
-				Tvals[1] = resp[2] * 256 + resp[3];//Cold junction data
+	nap.tv_nsec = intPeriod;
+	while(__atomic_load_n(&st->running, __ATOMIC_ACQUIRE)){
+		if(!intSERVE(st))
+			nanosleep(&nap, NULL);
+	}
+	return NULL;
+}
 
-				if(channel > 7){
-					int t = Tvals[0];
-					if(t > 0x8000){//It's negative, take the 2's complement.
-						t = t^0xFFFF;
-						t = -(t + 1);
-					}
-					temp = t / 16.0;//Celsius
-				}else{
-					int i;
-					double a = -0.00347;
-					double b = -10.888;
-					double c = 1777.3;
+//Called with stackTable held.
+static int intSTACKstart(struct plateStack* st){
+	if(__atomic_load_n(&st->running, __ATOMIC_ACQUIRE))
+		return 0;
+	__atomic_store_n(&st->running, 1, __ATOMIC_RELEASE);
+	if(pthread_create(&st->thread, NULL, intTHREAD, st)){
+		__atomic_store_n(&st->running, 0, __ATOMIC_RELEASE);
+		return INVAL_CMD;
+	}
+	return 0;
+}
+
+static void intSTACKstop(struct plateStack* st){
+	if(__atomic_exchange_n(&st->running, 0, __ATOMIC_ACQ_REL))
+		pthread_join(st->thread, NULL);
+}
+
+//Services interrupts from one background thread per stack, polling each line every period ns.
+int intTHREADstart(long period){
+	int i;
+
+	if(intTHREADrunning() || period <= 0 || period >= 1000000000)
+		return INVAL_CMD;
+
+	stackDEFAULT();
+	intPeriod = period;
+	pthread_mutex_lock(&stackTable);
+	__atomic_store_n(&intRunning, 1, __ATOMIC_RELEASE);
+	for(i = 0; i < stackCount; i++){
+		if(intSTACKstart(&stacks[i]) < 0)
+			break;
+	}
+	pthread_mutex_unlock(&stackTable);
+
+	if(i < stackCount){
+		intTHREADstop();
+		return INVAL_CMD;
+	}
+	return 0;
+}
+
+void intTHREADstop(){
+	int n = __atomic_load_n(&stackCount, __ATOMIC_ACQUIRE);
+	int i;
+
+	__atomic_store_n(&intRunning, 0, __ATOMIC_RELEASE);
+	for(i = 0; i < n; i++)
+		intSTACKstop(&stacks[i]);
+}
+
+/* End of interrupt dispatch */
+
+/* Start of LED commands */
+
+char getLEDnum(char* color, char max){
+	char led = 0;
+	int i;
+	for(i = 0; i < max; i ++){
+		if(!strcmp(color, LEDcolors[i]))
+			led = i + 1;
+	}
+
+	return led;
+}
+
+void setLEDcolor(struct piplate* plate, char* color){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC)){
+			sendCMD(plate, 0x60, getLEDnum(color, 2), 0, 0);
+		}else if(compareWith(plate->id, 1, DAQC2)){
+			sendCMD(plate, 0x60, getLEDnum(color, 7), 0, 0);
+		}
+	}
+}
+
+void setLED(struct piplate* plate){
+	if(plate->isValid){
+		if(compareWith(plate->id, 3, THERMO, MOTOR, RELAY)){
+			sendCMD(plate, 0x60, 0, 0, 0);
+		}
+	}
+}
+
+void clrLEDcolor(struct piplate* plate, char* color){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC)){
+			sendCMD(plate, 0x61, getLEDnum(color, 2), 0, 0);
+		}
+	}
+}
+
+void clrLED(struct piplate* plate){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC2)){
+			sendCMD(plate, 0x60, 0, 0, 0);
+		}else if(compareWith(plate->id, 3, THERMO, MOTOR, RELAY)){
+			sendCMD(plate, 0x61, 0, 0, 0);
+		}
+	}
+}
+
+void toggleLEDcolor(struct piplate* plate, char* color){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC)){
+			sendCMD(plate, 0x62, getLEDnum(color, 2), 0, 0);
+		}
+	}
+}
+
+void toggleLED(struct piplate* plate){
+	if(plate->isValid){
+		if(compareWith(plate->id, 3, THERMO, MOTOR, RELAY)){
+			sendCMD(plate, 0x62, 0, 0, 0);
+		}
+	}
+}
+
+char getLEDcolor(struct piplate* plate, char* color){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC)){
+			return safeExtract(sendCMD(plate, 0x63, getLEDnum(color, 2), 0, 0));
+		}
+	}
+	return INVAL_CMD;
+}
+
+char getLED(struct piplate* plate){
+	if(plate->isValid){
+		if(compareWith(plate->id, 2, DAQC2, THERMO)){
+			return safeExtract(sendCMD(plate, 0x63, 0, 0, 0));
+		}
+	}
+	return INVAL_CMD;
+}
+/* End of LED commands */
+
+/* Start of relay commands */
+
+void relayON(struct piplate* plate, char relay){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, RELAY) && relay >= 1 && relay <=7){
+			sendCMD(plate, 0x10, relay, 0, 0);
+			stateBITS(plate, STATE_RELAY, STATE_SET, relay - 1);
+		}else if(compareWith(plate->id, 1, TINKER) && relay >= 1 && relay <= 2){
+			sendCMD(plate, 0x10, relay - 1, 0, 0);
+			stateBITS(plate, STATE_RELAY, STATE_SET, relay - 1);
+		}
+	}
+}
+
+void relayOFF(struct piplate* plate, char relay){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, RELAY) && relay >= 1 && relay <= 7){
+			sendCMD(plate, 0x11, relay, 0, 0);
+			stateBITS(plate, STATE_RELAY, STATE_CLR, relay - 1);
+		}else if(compareWith(plate->id, 1, TINKER) && relay >=1 && relay <= 2){
+			sendCMD(plate, 0x11, relay - 1, 0, 0);
+			stateBITS(plate, STATE_RELAY, STATE_CLR, relay - 1);
+		}
+	}
+}
+
+void relayTOGGLE(struct piplate* plate, char relay){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, RELAY) && relay >= 1 && relay <= 7){
+			sendCMD(plate, 0x12, relay, 0, 0);
+			stateBITS(plate, STATE_RELAY, STATE_TOGGLE, relay - 1);
+		}else if(compareWith(plate->id, 1, TINKER) && relay >= 1 && relay <= 2){
+			sendCMD(plate, 0x12, relay - 1, 0, 0);
+			stateBITS(plate, STATE_RELAY, STATE_TOGGLE, relay - 1);
+		}
+	}
+}
+
+void relayALL(struct piplate* plate, char relays){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, RELAY)){
+			if(relays >= 0 && relays <= 127){
+				sendCMD(plate, 0x13, relays, 0, 0);
+				stateBITS(plate, STATE_RELAY, STATE_ALL, relays);
+			}
+		}else if(compareWith(plate->id, 1, TINKER)){
+			if(relays >= 0 && relays <= 3){
+				sendCMD(plate, 0x13, relays, 0, 0);
+				stateBITS(plate, STATE_RELAY, STATE_ALL, relays);
+			}
+		}
+	}
+}
+
+int relaySTATE(struct piplate* plate, char relay){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, RELAY)){
+			if(relay >= 1 && relay <= 7)
+				return safeExtract(sendCMD(plate, 0x14, 0, 0, 1));
+		}else if(compareWith(plate->id, 1, TINKER)){
+			if(relay >= 1 && relay <= 2)
+				return safeExtract(sendCMD(plate, 0x14, relay, 0, 0));
+		}
+	}
+	return INVAL_CMD;
+}
+
+/* End of relay commands */
+
+void setMODE(struct piplate* plate, char bit, char* mode){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, TINKER)){
+			int numModes = 9;
+			int modeSelect = numModes;
+			bool channelGood = 0;
+			int i;
+
+			if (!strcmp(mode, "range")){
+				if((bit==12) || (bit==34) || (bit==56) || (bit==78))
+					channelGood = 1;
+				else
+					printf("Invalid channel pair. For range, must be 12, 34, 56, or 78.\n");
+				bit = (bit>>1) / 10;//Maps the inputs to 0, 1, 2, and 3.
+			}else{
+				if(bit >= 1 && bit <= 8)
+					channelGood = 1;
+				else
+					printf("Invalid channel. Must be 1 through 8.");
+				bit--;
+			}
+
+			if(channelGood){
+				for(i = 0; i < numModes; i++){
+					if(!strcmp(mode, modes[i]))
+						modeSelect = i;
+				}
+				if(!strcmp(mode, "led"))
+					modeSelect = 3;
+
+				if(modeSelect != numModes){
+					if(pcaRequired[modeSelect] && bit >= 6){
+						printf("This channel cannot support this mode.\n");
+					}else{
+						sendCMD(plate, 0x90, bit, modeSelect, 0);
+						if(!strcmp(mode, "range")){
+							plateHEALTH(plate)->modes[2*bit] = modeSelect + 1;
+							plateHEALTH(plate)->modes[2*bit + 1] = modeSelect + 1;
+						}else{
+							plateHEALTH(plate)->modes[(int)bit] = modeSelect + 1;
+						}
+					}
+				}else{
+					printf("Invalid mode.\n");
+				}
+			}
+		}
+	}
+}
+
+
+/* Start of digital output commands */
+
+void setDOUTbit(struct piplate* plate, char bit){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC)){
+			if(bit >= 0 && bit <= 6){
+				sendCMD(plate, 0x10, bit, 0, 0);
+				stateBITS(plate, STATE_DOUT, STATE_SET, bit);
+			}
+		}else if(compareWith(plate->id, 1, DAQC2)){
+			if(bit >= 0 && bit <= 7){
+				sendCMD(plate, 0x10, bit, 0, 0);
+				stateBITS(plate, STATE_DOUT, STATE_SET, bit);
+			}
+		}else if(compareWith(plate->id, 1, TINKER)){
+			if(bit >= 1 && bit <= 8){
+				sendCMD(plate, 0x26, bit - 1, 0, 0);
+				stateBITS(plate, STATE_DOUT, STATE_SET, bit - 1);
+			}
+		}
+	}
+}
+
+void clrDOUTbit(struct piplate* plate, char bit){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC)){
+			if(bit >= 0 && bit <= 6){
+				sendCMD(plate, 0x11, bit, 0, 0);
+				stateBITS(plate, STATE_DOUT, STATE_CLR, bit);
+			}
+		}else if(compareWith(plate->id, 1, DAQC2)){
+			if(bit >= 0 && bit <= 7){
+				sendCMD(plate, 0x11, bit, 0, 0);
+				stateBITS(plate, STATE_DOUT, STATE_CLR, bit);
+			}
+		}else if(compareWith(plate->id, 1, TINKER)){
+			if(bit >= 1 && bit <= 8){
+				sendCMD(plate, 0x27, bit - 1, 0, 0);
+				stateBITS(plate, STATE_DOUT, STATE_CLR, bit - 1);
+			}
+		}
+	}
+}
+
+void toggleDOUTbit(struct piplate* plate, char bit){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC)){
+			if(bit >= 0 && bit <= 6){
+				sendCMD(plate, 0x12, bit, 0, 0);
+				stateBITS(plate, STATE_DOUT, STATE_TOGGLE, bit);
+			}
+		}else if(compareWith(plate->id, 1, DAQC2)){
+			if(bit >= 0 && bit <= 7){
+				sendCMD(plate, 0x12, bit, 0, 0);
+				stateBITS(plate, STATE_DOUT, STATE_TOGGLE, bit);
+			}
+		}else if(compareWith(plate->id, 1, TINKER)){
+			if(bit >= 1 && bit <= 8){
+				sendCMD(plate, 0x28, bit - 1, 0, 0);
+				stateBITS(plate, STATE_DOUT, STATE_TOGGLE, bit - 1);
+			}
+		}
+	}
+}
+
+/* End of digital output commands */
+
+/* Start of digital input commands */
+
+int getDINbit(struct piplate* plate, char bit){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, TINKER))
+			bit--;
+
+		if(compareWith(plate->id, 3, DAQC, DAQC2, TINKER)){
+			if(bit >= 0 && bit <= 7){
+				int resp = safeExtract(sendCMD(plate, 0x20, bit, 0, 1));
+				return (resp < 0 ? INVAL_CMD : stateDINbit(plate, bit, resp > 0));
+			}
+		}
+	}
+	return INVAL_CMD;
+}
+
+int getDINall(struct piplate* plate){
+	if(plate->isValid){
+		if(compareWith(plate->id, 3, DAQC, DAQC2, TINKER)){
+			int resp = safeExtract(sendCMD(plate, 0x25, 0, 0, 1));
+			return (resp < 0 ? resp : (int)stateIN(plate, STATE_DIN, 0, resp));
+		}
+	}
+	return INVAL_CMD;
+}
+
+void enableDINint(struct piplate* plate, char bit, char edge){
+	if(plate->isValid){
+		if(compareWith(plate->id, 2, DAQC, DAQC2)){
+			if(bit >= 0 && bit <= 7){
+				if( edge == 'f' || edge == 'F' )
+					sendCMD(plate, 0x21, bit, 0, 0);
+				else if( edge == 'r' || edge == 'R' )
+					sendCMD(plate, 0x22, bit, 0, 0);
+				else if( edge == 'b' || edge == 'B' )
+					sendCMD(plate, 0x23, bit, 0, 0);
+			}
+		}
+	}
+}
+
+void disableDINint(struct piplate* plate, char bit){
+	if(plate->isValid){
+		if(compareWith(plate->id, 2, DAQC, DAQC2)){
+			if(bit >= 0 && bit <= 7)
+				sendCMD(plate, 0x24, bit, 0, 0);
+		}
+	}
+}
+
+/* End of digital input commands */
+
+/* Start of DIN monitor */
+
+/*
+* Turns DIN snapshots into per-bit edges. If interrupt dispatch is running
+* when the monitor starts, the watched bits raise interrupts on both edges
+* and every interrupt from the plate takes a snapshot; the monitor thread
+* then only polls at the slowest period as a backstop. Otherwise the thread
+* polls getDINall, back at the fastest period after a change and halving
+* its rate each quiet poll down to the slowest.
+*
+* An edge seen in a snapshot happened after the previous snapshot was taken
+* (or one line poll before the interrupt was seen), so the time from then to
+* the end of the snapshot bounds its detection latency; the worst of those
+* is kept.
+*
+* A pulse that rises and falls before the snapshot leaves the level as it
+* was, but on a DAQC its interrupt flag is still set: a flagged bit that did
+* not change becomes a pair of edges, away from the level and back. A DAQC2
+* does not report which bit fired, so such an interrupt is only counted as a
+* pulse.
+*/
+
+struct dinMonitor {
+	pthread_t thread;
+	pthread_mutex_t lock;//Ring and counters
+	pthread_mutex_t snap;//One snapshot at a time, so edges stay in order
+	bool running;
+	int mask;
+	long minPeriod;//ns
+	long maxPeriod;
+	long period;//Current poll period
+	bool primed;
+	int last;//Previous snapshot
+	struct timespec prev;//When the previous snapshot started
+	struct dinEdge ring[DIN_RING];
+	unsigned head;
+	unsigned tail;
+	struct dinStats stats;
+};
+
+//Called with mon->lock held.
+static void dinPUSH(struct dinMonitor* mon, int bit, bool level){
+	if(mon->head - mon->tail >= DIN_RING){
+		mon->stats.dropped++;
+		return;
+	}
+	mon->ring[mon->head % DIN_RING].bit = bit;
+	mon->ring[mon->head % DIN_RING].level = level;
+	mon->ring[mon->head % DIN_RING].stamp = lastStamp;
+	mon->head++;
+	mon->stats.edges++;
+}
+
+/*
+* Takes a snapshot and queues its edges. seen is when the interrupt line was
+* seen and flags what the plate reported, NULL and 0 for polls.
+*/
+static void dinSNAP(struct piplate* plate, struct dinMonitor* mon, const struct timespec* seen, int flags){
+	struct timespec start, done;
+	int v, diff, pulse;
+	int i;
+
+	pthread_mutex_lock(&mon->snap);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	v = getDINall(plate);
+	clock_gettime(CLOCK_MONOTONIC, &done);
+
+	pthread_mutex_lock(&mon->lock);
+	mon->stats.snapshots++;
+	if(seen)
+		mon->stats.interrupts++;
+	if(v < 0){
+		mon->stats.misses++;
+	}else{
+		diff = (v ^ mon->last) & mon->mask;
+		if(mon->primed && diff){
+			struct timespec from = mon->prev;
+			long long latency;
+
+			if(seen){
+				struct timespec line = *seen;
+				tsADD(&line, -intPeriod);
+				if(tsDIFF(&line, &from) > 0)
+					from = line;
+			}
+			latency = tsDIFF(&done, &from);
+			if(latency > mon->stats.worst)
+				mon->stats.worst = latency;
+
+			for(i = 0; i < 8; i++){
+				if(diff & (1 << i))
+					dinPUSH(mon, i, (v >> i) & 1);
+			}
+		}
+		if(mon->primed && flags > 0){
+			if(compareWith(plate->id, 1, DAQC)){
+				pulse = flags & DAQC_INT_DIN & mon->mask & ~diff;
+				for(i = 0; i < 8; i++){
+					if(!(pulse & (1 << i)))
+						continue;
+					dinPUSH(mon, i, !((v >> i) & 1));
+					dinPUSH(mon, i, (v >> i) & 1);
+					mon->stats.pulses++;
+				}
+			}else if(!diff && (flags & ~(DAQC2_INT_STEP1_STOP | DAQC2_INT_STEP2_STOP))){
+				mon->stats.pulses++;
+			}
+		}
+		mon->period = (diff ? mon->minPeriod : (mon->period*2 < mon->maxPeriod ? mon->period*2 : mon->maxPeriod));
+		mon->last = v;
+		mon->primed = 1;
+		mon->prev = start;
+	}
+	pthread_mutex_unlock(&mon->lock);
+	pthread_mutex_unlock(&mon->snap);
+}
+
+static void dinMONint(struct piplate* plate, int flags, const struct timespec* seen, void* ctx){
+	dinSNAP(plate, (struct dinMonitor*)ctx, seen, flags);
+}
+
+static void* dinMONthread(void* arg){
+	struct piplate* plate = (struct piplate*)arg;
+	struct dinMonitor* mon = plate->dinmon;
+
+	while(__atomic_load_n(&mon->running, __ATOMIC_ACQUIRE)){
+		struct timespec nap = {0, 0};
+		long period;
+
+		dinSNAP(plate, mon, NULL, 0);
+		pthread_mutex_lock(&mon->lock);
+		period = (mon->stats.irq ? mon->maxPeriod : mon->period);
+		pthread_mutex_unlock(&mon->lock);
+		tsADD(&nap, period);
+		nanosleep(&nap, NULL);
+	}
+	return NULL;
+}
+
+//Watches the DIN bits in mask, polling every minPeriod to maxPeriod ns.
+int dinMONstart(struct piplate* plate, int mask, long minPeriod, long maxPeriod){
+	struct dinMonitor* mon;
+	int i;
+
+	if(!plate->isValid || !compareWith(plate->id, 2, DAQC, DAQC2) || plate->dinmon)
+		return INVAL_CMD;
+	if(!(mask & 0xFF) || (mask & ~0xFF) || minPeriod <= 0 || maxPeriod < minPeriod || maxPeriod > 1000000000)
+		return INVAL_CMD;
+
+	mon = (struct dinMonitor*)plateALLOC(plate, SLOT_DINMON, 1, sizeof(struct dinMonitor));
+	if(!mon)
+		return INVAL_CMD;
+	pthread_mutex_init(&mon->lock, NULL);
+	pthread_mutex_init(&mon->snap, NULL);
+	mon->mask = mask;
+	mon->minPeriod = minPeriod;
+	mon->maxPeriod = maxPeriod;
+	mon->period = minPeriod;
+	mon->running = 1;
+	plate->dinmon = mon;
+
+	if(intTHREADrunning() && intATTACH(plate, dinMONint, mon) == 0){
+		for(i = 0; i < 8; i++){
+			if(mask & (1 << i))
+				enableDINint(plate, i, 'b');
+		}
+		intEnable(plate);
+		mon->stats.irq = 1;
+	}
+
+	if(pthread_create(&mon->thread, NULL, dinMONthread, plate)){
+		mon->running = 0;
+		dinMONstop(plate);
+		return INVAL_CMD;
+	}
+	return 0;
+}
+
+//Must not be called from an interrupt handler.
+void dinMONstop(struct piplate* plate){
+	if(plate->dinmon){
+		struct dinMonitor* mon = plate->dinmon;
+		int i;
+
+		if(__atomic_exchange_n(&mon->running, 0, __ATOMIC_ACQ_REL))
+			pthread_join(mon->thread, NULL);
+		if(mon->stats.irq){
+			intDETACH(plate, dinMONint, mon);
+			intDRAIN();
+			for(i = 0; i < 8; i++){
+				if(mon->mask & (1 << i))
+					disableDINint(plate, i);
+			}
+		}
+		plate->dinmon = NULL;
+		pthread_mutex_destroy(&mon->lock);
+		pthread_mutex_destroy(&mon->snap);
+		plateFREE(plate, mon);
+	}
+}
+
+//Takes up to max queued edges, oldest first. Returns how many.
+int dinMONread(struct piplate* plate, struct dinEdge* out, int max){
+	struct dinMonitor* mon = plate->dinmon;
+	int n = 0;
+
+	if(!mon || !out || max < 0)
+		return INVAL_CMD;
+	pthread_mutex_lock(&mon->lock);
+	while(n < max && mon->tail != mon->head)
+		out[n++] = mon->ring[mon->tail++ % DIN_RING];
+	pthread_mutex_unlock(&mon->lock);
+	return n;
+}
+
+int dinMONstats(struct piplate* plate, struct dinStats* stats){
+	if(!plate->dinmon || !stats)
+		return INVAL_CMD;
+	pthread_mutex_lock(&plate->dinmon->lock);
+	*stats = plate->dinmon->stats;
+	pthread_mutex_unlock(&plate->dinmon->lock);
+	return 0;
+}
+
+/* End of DIN monitor */
+
+
+/* Start of board led commands */
+
+//These ones are weird, I'll come back to them.
+
+/* End of board led commands */
+
+
+/* Calibration Constants / Flash Memory Functions */
+
+int CalGetByte(struct piplate* plate, char ptr){
+	if(plate->isValid){
+		if(compareWith(plate->id, 2, DAQC2, THERMO)){
+			return safeExtract(sendCMD(plate, 0xFD, 2, ptr, 1));
+		}
+	}
+	return INVAL_CMD;
+}
+
+void CalPutByte(struct piplate* plate, char data){
+	if(plate->isValid){
+		if(compareWith(plate->id, 2, DAQC2, THERMO)){
+			sendCMD(plate, 0xFD, 1, data, 0);
+		}
+	}
+}
+
+void CalEraseBlock(struct piplate* plate){
+	if(plate->isValid){
+		if(compareWith(plate->id, 2, "DAQC2", THERMO)){
+			sendCMD(plate, 0xFD, 0, 0, 0);
+		}
+	}
+}
+
+double binaryToDouble(char* list){
+	int i = 0;
+	int polarity = 1;
+	int expsign = 1;
+	double exp;
+	double frac;
+
+	int val = list[0];
+	for(i = 0; i < 3; i++){
+		int l = list[i + 1];
+		val = val << 8;
+		val += l;
+	}
+	if((val&0x80000000) != 0)//Read first bit
+		polarity = -1;
+
+	exp = ((val>>24)&0x7F)-64;
+	if(exp < 0)
+		expsign = -1;
+
+	val=val&0xFFFFFF;
+
+	double denom = 0xFFFFFF;
+
+	frac = expsign * (double) val / denom;
+
+	double r = polarity * pow(10, exp + frac);
+
+	return r;
+}
+
+/* Calibration Constants / Flash Memory Functions */
+
+/* Start of DAQC2 Oscilloscope Commands */
+
+void startOSC(struct piplate* plate){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC2)){
+			if(!plate->osc)
+				plate->osc = (struct oscilloscope*)plateALLOC(plate, SLOT_OSC, 1, sizeof(struct oscilloscope));
+
+			plate->osc->c1State = 1;
+			plate->osc->c2State = 0;
+			plate->osc->sRate = 9;
+			plate->osc->trace1 = plate->osc->samples[0];
+			plate->osc->trace2 = plate->osc->samples[1];
+			plate->osc->triggerChan = 1;
+			plate->osc->triggerType = 'a';
+			plate->osc->triggerEdge = 'r';
+			plate->osc->triggerLevel = 2048;
+			plate->osc->meta.seq = 0;
+
+			sendCMD(plate, 0xA1, 0, 0, 0);
+		}
+	}
+}
+
+void stopOSC(struct piplate* plate){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC2)){
+			if(plate->osc){
+				oscRECstop(plate);
+				oscDSPdetach(plate);
+				plateFREE(plate, plate->osc);
+				plate->osc = NULL;
+			}
+
+			sendCMD(plate, 0xA0, 0, 0, 0);
+		}
+	}
+}
+
+void setOSCchannel(struct piplate* plate, bool c1, bool c2){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC2)){
+			plate->osc->c1State = c1;
+			plate->osc->c2State = c2;
+			sendCMD(plate, 0xA2, c1, c2, 0);
+		}
+	}
+}
+
+/*
+* Rate:		Samples/sec:
+* 0:		100
+* 1:		200
+* 2:		500
+* 3:		1,000
+* 4:		2,000
+* 5:		5,000
+* 6;		10,000
+* 7:		20,000
+* 8:		50,000
+* 9:		100,000
+* 10:		200,000
+* 11:		500,000
+* 12:		1,000,000
+* Note: #12 can only be used with a single channel input.
+*/
+
+const long oscRates[13] = {100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000, 1000000};
+
+void setOSCsweep(struct piplate* plate, char rate){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC2)){
+			if(rate >= 0 && rate <= 12){
+				if(plate->osc)
+					plate->osc->sRate = rate;
+				sendCMD(plate, 0xA3, rate, 0, 0);
+			}
+		}
+	}
+}
+
+long getOSCrate(char rate){
+	if(rate >= 0 && rate <= 12)
+		return oscRates[(int)rate];
+	return INVAL_CMD;
+}
+
+//Traces arrive as big endian 16 bit words. With both channels on they are interleaved c1, c2, c1, c2...
+static void unpackBE16(uint16_t* dst, const unsigned char* src, int n){
+	int i = 0;
+#ifdef __ARM_NEON
+	for(; i + 16 <= n; i += 16){
+		uint8x16x2_t v = vld2q_u8(src + 2*i);//val[0]: high bytes, val[1]: low bytes
+		uint8x16x2_t w = {{v.val[1], v.val[0]}};
+		vst2q_u8((uint8_t*)(dst + i), w);
+	}
+#endif
+	for(; i < n; i++)
+		dst[i] = (uint16_t)((src[2*i] << 8) | src[2*i+1]);
+}
+
+static void unpackBE16x2(uint16_t* dst1, uint16_t* dst2, const unsigned char* src, int n){
+	int i = 0;
+#ifdef __ARM_NEON
+	for(; i + 16 <= n; i += 16){
+		uint8x16x4_t v = vld4q_u8(src + 4*i);
+		uint8x16x2_t w1 = {{v.val[1], v.val[0]}};
+		uint8x16x2_t w2 = {{v.val[3], v.val[2]}};
+		vst2q_u8((uint8_t*)(dst1 + i), w1);
+		vst2q_u8((uint8_t*)(dst2 + i), w2);
+	}
+#endif
+	for(; i < n; i++){
+		dst1[i] = (uint16_t)((src[4*i] << 8) | src[4*i+1]);
+		dst2[i] = (uint16_t)((src[4*i+2] << 8) | src[4*i+3]);
+	}
+}
+
+struct oscRecorder {
+	int fd;
+	size_t size;
+	struct oscFileHeader* hdr;
+	struct oscIndexEntry* index;
+	struct oscRecord* records;
+	long dropped;
+};
+
+//Next free record in the capture file, or NULL when not recording or the file is full.
+static struct oscRecord* oscRECslot(struct oscilloscope* osc){
+	struct oscRecorder* rec = osc->rec;
+
+	if(!rec)
+		return NULL;
+	if(rec->hdr->count >= rec->hdr->capacity){
+		rec->dropped++;
+		return NULL;
+	}
+	return &rec->records[rec->hdr->count];
+}
+
+static void oscREClog(struct oscRecorder* rec, struct oscRecord* r, const struct oscMeta* meta){
+	uint64_t n = rec->hdr->count;
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	r->time = (int64_t)now.tv_sec*1000000000 + now.tv_nsec;
+	r->seq = meta->seq;
+	r->sampleRate = meta->sampleRate;
+	r->channels = meta->c1State + (meta->c2State << 1);
+	r->sRate = meta->sRate;
+	r->triggerChan = meta->triggerChan;
+	r->triggerType = meta->triggerType;
+	r->triggerEdge = meta->triggerEdge;
+	r->triggerLevel = meta->triggerLevel;
+	r->xferStart = (int64_t)meta->stamp.start.tv_sec*1000000000 + meta->stamp.start.tv_nsec;
+	r->xferEnd = (int64_t)meta->stamp.end.tv_sec*1000000000 + meta->stamp.end.tv_nsec;
+
+	rec->index[n].time = r->time;
+	rec->index[n].seq = r->seq;
+	rec->index[n].offset = rec->hdr->dataOffset + n*sizeof(struct oscRecord);
+
+	__atomic_store_n(&rec->hdr->count, n + 1, __ATOMIC_RELEASE);//Publish to readers
+}
+
+#define OSC_DSP_SUBSCRIBERS 8
+
+struct oscDSP {
+	bool retain;
+	bool fft;
+	int buckets;
+	double k[2];//Raw counts to volts: v = k*raw + b
+	double b[2];
+	struct oscMetrics m;
+	struct {
+		oscDSPcallback fn;
+		void* ctx;
+	} subs[OSC_DSP_SUBSCRIBERS];
+	float cosTable[OSC_LENGTH/2];//Twiddles
+	float sinTable[OSC_LENGTH/2];
+	float window[OSC_LENGTH];//Hann
+	uint16_t bitrev[OSC_LENGTH];
+	float re[OSC_LENGTH];
+	float im[OSC_LENGTH];
+	float spectrum[2][OSC_BINS];
+	uint16_t decMin[2][OSC_LENGTH];
+	uint16_t decMax[2][OSC_LENGTH];
+};
+
+//In place radix 2 FFT of dsp->re/dsp->im using the precomputed tables.
+static void oscFFT(struct oscDSP* dsp){
+	float* re = dsp->re;
+	float* im = dsp->im;
+	int i, j, n;
+
+	for(i = 0; i < OSC_LENGTH; i++){
+		j = dsp->bitrev[i];
+		if(j > i){
+			float t = re[i];
+			re[i] = re[j];
+			re[j] = t;
+			t = im[i];
+			im[i] = im[j];
+			im[j] = t;
+		}
+	}
+
+	for(n = 2; n <= OSC_LENGTH; n <<= 1){
+		int half = n >> 1;
+		int step = OSC_LENGTH / n;
+		for(i = 0; i < OSC_LENGTH; i += n){
+			for(j = 0; j < half; j++){
+				float wr = dsp->cosTable[j*step];
+				float wi = -dsp->sinTable[j*step];
+				int a = i + j;
+				int b = a + half;
+				float tr = wr*re[b] - wi*im[b];
+				float ti = wr*im[b] + wi*re[b];
+
+				re[b] = re[a] - tr;
+				im[b] = im[a] - ti;
+				re[a] += tr;
+				im[a] += ti;
+			}
+		}
+	}
+}
+
+//One pass over the big endian samples of a channel, stride bytes apart.
+static void oscDSPchannel(struct oscDSP* dsp, int c, const unsigned char* src, int stride){
+	struct oscMetrics* m = &dsp->m;
+	int nb = (dsp->buckets ? dsp->buckets : 1);
+	int per = OSC_LENGTH / nb;
+	uint64_t sum = 0;
+	uint64_t sumSq = 0;
+	uint16_t lo = 0xFFFF;
+	uint16_t hi = 0;
+	double meanRaw, meanSq;
+	int bk, i;
+
+	for(bk = 0; bk < nb; bk++){
+		uint16_t bLo = 0xFFFF;
+		uint16_t bHi = 0;
+		for(i = bk*per; i < (bk + 1)*per; i++){
+			uint16_t v = (uint16_t)((src[i*stride] << 8) | src[i*stride + 1]);
+			sum += v;
+			sumSq += (uint32_t)v*v;
+			if(v < bLo)
+				bLo = v;
+			if(v > bHi)
+				bHi = v;
+			dsp->re[i] = v;
+		}
+		dsp->decMin[c][bk] = bLo;
+		dsp->decMax[c][bk] = bHi;
+		if(bLo < lo)
+			lo = bLo;
+		if(bHi > hi)
+			hi = bHi;
+	}
+
+	meanRaw = (double)sum / OSC_LENGTH;
+	meanSq = (double)sumSq / OSC_LENGTH;
+
+	m->valid[c] = 1;
+	m->min[c] = lo;
+	m->max[c] = hi;
+	m->mean[c] = dsp->k[c]*meanRaw + dsp->b[c];
+	m->rms[c] = sqrt(dsp->k[c]*dsp->k[c]*meanSq + 2*dsp->k[c]*dsp->b[c]*meanRaw + dsp->b[c]*dsp->b[c]);
+	m->pkpk[c] = (hi - lo)*fabs(dsp->k[c]);
+	m->freq[c] = 0;
+
+	if(dsp->fft){
+		double gain = 4.0/OSC_LENGTH*fabs(dsp->k[c]);//Hann coherent gain is 1/2
+		int peak = 1;
+
+		for(i = 0; i < OSC_LENGTH; i++){
+			dsp->re[i] = (dsp->re[i] - meanRaw)*dsp->window[i];
+			dsp->im[i] = 0;
+		}
+		oscFFT(dsp);
+		for(i = 0; i < OSC_BINS; i++){
+			dsp->spectrum[c][i] = gain*sqrtf(dsp->re[i]*dsp->re[i] + dsp->im[i]*dsp->im[i]);
+			if(i > 1 && dsp->spectrum[c][i] > dsp->spectrum[c][peak])
+				peak = i;
+		}
+
+		if(dsp->spectrum[c][peak] > 0){
+			double delta = 0;
+			if(peak < OSC_BINS - 1){
+				double y0 = dsp->spectrum[c][peak - 1];
+				double y1 = dsp->spectrum[c][peak];
+				double y2 = dsp->spectrum[c][peak + 1];
+				double d = y0 - 2*y1 + y2;
+				if(d != 0)
+					delta = 0.5*(y0 - y2)/d;
+			}
+			m->freq[c] = (peak + delta)*m->sampleRate/OSC_LENGTH;
+		}
+	}
+}
+
+static void oscDSPrun(struct piplate* plate, const unsigned char* resp){
+	struct oscilloscope* osc = plate->osc;
+	struct oscDSP* dsp = osc->dsp;
+	int stride = 2*(osc->c1State + osc->c2State);
+	int i;
+
+	dsp->m.seq = osc->meta.seq;
+	dsp->m.sampleRate = osc->meta.sampleRate;
+	dsp->m.valid[0] = 0;
+	dsp->m.valid[1] = 0;
+
+	if(osc->c1State)
+		oscDSPchannel(dsp, 0, resp, stride);
+	if(osc->c2State)
+		oscDSPchannel(dsp, 1, resp + (osc->c1State ? 2 : 0), stride);
+
+	for(i = 0; i < OSC_DSP_SUBSCRIBERS; i++){
+		if(dsp->subs[i].fn)
+			dsp->subs[i].fn(plate, &dsp->m, dsp->subs[i].ctx);
+	}
+}
+
+void getOSCtraces(struct piplate* plate){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC2)){
+			struct oscilloscope* osc = plate->osc;
+			char cCount = osc->c1State + osc->c2State;
+			int prev = setBUSclass(BUS_BULK);
+			const unsigned char* resp = (const unsigned char*)sendCMD(plate, 0xA4, 0, 0, cCount*2048);
+
+			setBUSclass(prev);
+			if(resp){
+				struct oscRecord* slot = oscRECslot(osc);
+
+				//When recording, unpack straight into the mapped file.
+				osc->trace1 = (slot ? slot->trace1 : osc->samples[0]);
+				osc->trace2 = (slot ? slot->trace2 : osc->samples[1]);
+
+				//The DSP stage reads the response itself, so traces are only unpacked when wanted.
+				if(slot || !osc->dsp || osc->dsp->retain){
+					if(cCount == 2)
+						unpackBE16x2(osc->trace1, osc->trace2, resp, OSC_LENGTH);
+					else if(osc->c1State)
+						unpackBE16(osc->trace1, resp, OSC_LENGTH);
+					else
+						unpackBE16(osc->trace2, resp, OSC_LENGTH);
+				}
+
+				osc->meta.seq++;
+				osc->meta.stamp = lastStamp;
+				osc->meta.c1State = osc->c1State;
+				osc->meta.c2State = osc->c2State;
+				osc->meta.sRate = osc->sRate;
+				osc->meta.sampleRate = getOSCrate(osc->sRate);
+				osc->meta.triggerChan = osc->triggerChan;
+				osc->meta.triggerType = osc->triggerType;
+				osc->meta.triggerEdge = osc->triggerEdge;
+				osc->meta.triggerLevel = osc->triggerLevel;
+
+				if(slot)
+					oscREClog(osc->rec, slot, &osc->meta);
+				if(osc->dsp && cCount)
+					oscDSPrun(plate, resp);
+			}
+		}
+	}
+}
+
+/*
+* Converts the last captured trace of a channel (1 or 2) to volts using the
+* DAQC2 ADC calibration of inputs 0 and 1. Returns the number of samples written.
+*/
+
+int getOSCvolts(struct piplate* plate, char channel, double* volts){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC2)){
+			if(!plate->daqc2p)
+				daqc2pINIT(plate);
+
+			if(plate->osc && volts && channel >= 1 && channel <= 2){
+				const uint16_t* trace = (channel == 1 ? plate->osc->trace1 : plate->osc->trace2);
+				double scale = plate->daqc2p->calScale[channel - 1];
+				double k = 24.0/4096.0*scale;
+				double b = -12.0*scale + plate->daqc2p->calOffset[channel - 1];
+				int i;
+
+				for(i = 0; i < OSC_LENGTH; i++)
+					volts[i] = trace[i]*k + b;
+
+				return OSC_LENGTH;
+			}
+		}
+	}
+	return INVAL_CMD;
+}
+
+int oscRECstart(struct piplate* plate, const char* path, unsigned int capacity){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC2)){
+			if(plate->osc && !plate->osc->rec && path && capacity > 0){
+				struct oscRecorder* rec = (struct oscRecorder*)calloc(1, sizeof(struct oscRecorder));
+				uint64_t indexOffset = sizeof(struct oscFileHeader);
+				uint64_t dataOffset = indexOffset + (uint64_t)capacity*sizeof(struct oscIndexEntry);
+				void* map;
+
+				if(!rec)
+					return INVAL_CMD;
+				rec->size = dataOffset + (uint64_t)capacity*sizeof(struct oscRecord);
+				rec->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+				if(rec->fd < 0){
+					free(rec);
+					return INVAL_CMD;
+				}
+
+				//Reserve the blocks up front so a full disk fails here, not as SIGBUS mid-run.
+				if(posix_fallocate(rec->fd, 0, rec->size)){
+					close(rec->fd);
+					free(rec);
+					return INVAL_CMD;
+				}
+
+				map = mmap(NULL, rec->size, PROT_READ | PROT_WRITE, MAP_SHARED, rec->fd, 0);
+				if(map == MAP_FAILED){
+					close(rec->fd);
+					free(rec);
+					return INVAL_CMD;
+				}
+
+				rec->hdr = (struct oscFileHeader*)map;
+				rec->index = (struct oscIndexEntry*)((char*)map + indexOffset);
+				rec->records = (struct oscRecord*)((char*)map + dataOffset);
+
+				memcpy(rec->hdr->magic, OSC_FILE_MAGIC, 8);
+				rec->hdr->version = OSC_FILE_VERSION;
+				rec->hdr->headerSize = sizeof(struct oscFileHeader);
+				rec->hdr->recordSize = sizeof(struct oscRecord);
+				rec->hdr->capacity = capacity;
+				rec->hdr->indexOffset = indexOffset;
+				rec->hdr->dataOffset = dataOffset;
+				rec->hdr->plateAddr = plate->addr;
+				rec->hdr->count = 0;
+
+				plate->osc->rec = rec;
+				return 0;
+			}
+		}
+	}
+	return INVAL_CMD;
+}
+
+void oscRECstop(struct piplate* plate){
+	if(plate->osc && plate->osc->rec){
+		struct oscRecorder* rec = plate->osc->rec;
+
+		//Traces may point into the mapping, take them back first.
+		memcpy(plate->osc->samples[0], plate->osc->trace1, sizeof(plate->osc->samples[0]));
+		memcpy(plate->osc->samples[1], plate->osc->trace2, sizeof(plate->osc->samples[1]));
+		plate->osc->trace1 = plate->osc->samples[0];
+		plate->osc->trace2 = plate->osc->samples[1];
+		plate->osc->rec = NULL;
+
+		msync(rec->hdr, rec->size, MS_ASYNC);
+		munmap(rec->hdr, rec->size);
+		close(rec->fd);
+		free(rec);
+	}
+}
+
+long oscRECcount(struct piplate* plate){
+	if(plate->osc && plate->osc->rec)
+		return plate->osc->rec->hdr->count;
+	return INVAL_CMD;
+}
+
+long oscRECdropped(struct piplate* plate){
+	if(plate->osc && plate->osc->rec)
+		return plate->osc->rec->dropped;
+	return INVAL_CMD;
+}
+
+int oscDSPattach(struct piplate* plate, int buckets, bool fft){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC2)){
+			if(plate->osc && !plate->osc->dsp && buckets >= 0 && buckets <= OSC_LENGTH && (!buckets || OSC_LENGTH % buckets == 0)){
+				struct oscDSP* dsp;
+				int i, c;
+
+				if(!plate->daqc2p)
+					daqc2pINIT(plate);
+				if(!plate->daqc2p)
+					return INVAL_CMD;
+
+				dsp = (struct oscDSP*)plateALLOC(plate, SLOT_DSP, 1, sizeof(struct oscDSP));
+				if(!dsp)
+					return INVAL_CMD;
+				dsp->retain = 1;
+				dsp->fft = fft;
+				dsp->buckets = buckets;
+
+				for(c = 0; c < 2; c++){
+					double scale = plate->daqc2p->calScale[c];
+					dsp->k[c] = 24.0/4096.0*scale;
+					dsp->b[c] = -12.0*scale + plate->daqc2p->calOffset[c];
+					dsp->m.spectrum[c] = (fft ? dsp->spectrum[c] : NULL);
+					dsp->m.decMin[c] = (buckets ? dsp->decMin[c] : NULL);
+					dsp->m.decMax[c] = (buckets ? dsp->decMax[c] : NULL);
+				}
+				dsp->m.buckets = buckets;
+
+				for(i = 0; i < OSC_LENGTH/2; i++){
+					dsp->cosTable[i] = cos(2*M_PI*i/OSC_LENGTH);
+					dsp->sinTable[i] = sin(2*M_PI*i/OSC_LENGTH);
+				}
+				for(i = 0; i < OSC_LENGTH; i++){
+					int r = 0;
+					int bit;
+					for(bit = 1; bit < OSC_LENGTH; bit <<= 1){
+						r <<= 1;
+						if(i & bit)
+							r |= 1;
+					}
+					dsp->bitrev[i] = r;
+					dsp->window[i] = 0.5 - 0.5*cos(2*M_PI*i/(OSC_LENGTH - 1));
+				}
+
+				plate->osc->dsp = dsp;
+				return 0;
+			}
+		}
+	}
+	return INVAL_CMD;
+}
+
+void oscDSPdetach(struct piplate* plate){
+	if(plate->osc && plate->osc->dsp){
+		plateFREE(plate, plate->osc->dsp);
+		plate->osc->dsp = NULL;
+	}
+}
+
+void oscDSPretain(struct piplate* plate, bool retain){
+	if(plate->osc && plate->osc->dsp)
+		plate->osc->dsp->retain = retain;
+}
+
+int oscDSPsubscribe(struct piplate* plate, oscDSPcallback fn, void* ctx){
+	if(plate->osc && plate->osc->dsp && fn){
+		int i;
+		for(i = 0; i < OSC_DSP_SUBSCRIBERS; i++){
+			if(!plate->osc->dsp->subs[i].fn){
+				plate->osc->dsp->subs[i].fn = fn;
+				plate->osc->dsp->subs[i].ctx = ctx;
+				return 0;
+			}
+		}
+	}
+	return INVAL_CMD;
+}
+
+void oscDSPunsubscribe(struct piplate* plate, oscDSPcallback fn, void* ctx){
+	if(plate->osc && plate->osc->dsp){
+		int i;
+		for(i = 0; i < OSC_DSP_SUBSCRIBERS; i++){
+			if(plate->osc->dsp->subs[i].fn == fn && plate->osc->dsp->subs[i].ctx == ctx)
+				plate->osc->dsp->subs[i].fn = NULL;
+		}
+	}
+}
+
+const struct oscMetrics* getOSCmetrics(struct piplate* plate){
+	if(plate->osc && plate->osc->dsp)
+		return &plate->osc->dsp->m;
+	return NULL;
+}
+
+//Record layout of OSC_FILE_VERSION 1 files, before the transfer times.
+struct oscRecordV1 {
+	int64_t time;
+	uint32_t seq;
+	int32_t sampleRate;
+	uint8_t channels;
+	int8_t sRate;
+	uint8_t triggerChan;
+	char triggerType;
+	char triggerEdge;
+	uint8_t reserved[3];
+	int32_t triggerLevel;
+	uint16_t trace1[OSC_LENGTH];
+	uint16_t trace2[OSC_LENGTH];
+};
+
+struct oscReader {
+	size_t size;
+	const struct oscFileHeader* hdr;
+	const struct oscIndexEntry* index;
+	const struct oscRecord* records;
+	struct oscRecord conv;//Last version 1 record, in the current layout
+};
+
+struct oscReader* oscREADopen(const char* path){
+	struct oscReader* rd;
+	const struct oscFileHeader* hdr;
+	struct stat st;
+	void* map;
+	int fd = open(path, O_RDONLY);
+
+	if(fd < 0)
+		return NULL;
+	if(fstat(fd, &st) || st.st_size < (off_t)sizeof(struct oscFileHeader)){
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+		return NULL;
+
+	hdr = (const struct oscFileHeader*)map;
+	if(memcmp(hdr->magic, OSC_FILE_MAGIC, 8) ||
+	   (!(hdr->version == OSC_FILE_VERSION && hdr->recordSize == sizeof(struct oscRecord)) &&
+	    !(hdr->version == 1 && hdr->recordSize == sizeof(struct oscRecordV1))) ||
+	   hdr->dataOffset + (uint64_t)hdr->capacity*hdr->recordSize > (uint64_t)st.st_size){
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	rd = (struct oscReader*)calloc(1, sizeof(struct oscReader));
+	rd->size = st.st_size;
+	rd->hdr = hdr;
+	rd->index = (const struct oscIndexEntry*)((const char*)map + hdr->indexOffset);
+	rd->records = (const struct oscRecord*)((const char*)map + hdr->dataOffset);
+	return rd;
+}
+
+void oscREADclose(struct oscReader* rd){
+	if(rd){
+		munmap((void*)rd->hdr, rd->size);
+		free(rd);
+	}
+}
+
+long oscREADcount(struct oscReader* rd){
+	return (long)__atomic_load_n(&rd->hdr->count, __ATOMIC_ACQUIRE);
+}
+
+const struct oscFileHeader* oscREADheader(struct oscReader* rd){
+	return rd->hdr;
+}
+
+/*
+* Record n of the file. Version 1 records are converted, with the transfer
+* times at 0, into a copy that stays valid until the next call on the reader.
+*/
+const struct oscRecord* oscREADrecord(struct oscReader* rd, long n){
+	if(n >= 0 && n < oscREADcount(rd)){
+		const char* at = (const char*)rd->hdr + rd->index[n].offset;
+
+		if(rd->hdr->version == 1){
+			const struct oscRecordV1* v1 = (const struct oscRecordV1*)at;
+
+			rd->conv.time = v1->time;
+			rd->conv.seq = v1->seq;
+			rd->conv.sampleRate = v1->sampleRate;
+			rd->conv.channels = v1->channels;
+			rd->conv.sRate = v1->sRate;
+			rd->conv.triggerChan = v1->triggerChan;
+			rd->conv.triggerType = v1->triggerType;
+			rd->conv.triggerEdge = v1->triggerEdge;
+			rd->conv.triggerLevel = v1->triggerLevel;
+			rd->conv.xferStart = 0;
+			rd->conv.xferEnd = 0;
+			memcpy(rd->conv.trace1, v1->trace1, sizeof(v1->trace1));
+			memcpy(rd->conv.trace2, v1->trace2, sizeof(v1->trace2));
+			return &rd->conv;
+		}
+		return (const struct oscRecord*)at;
+	}
+	return NULL;
+}
+
+long oscREADfind(struct oscReader* rd, int64_t time){
+	long lo = 0;
+	long hi = oscREADcount(rd);
+
+	while(lo < hi){
+		long mid = lo + (hi - lo)/2;
+		if(rd->index[mid].time < time)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+void setOSCtrigger(struct piplate* plate, char channel, char* type, char* edge, int level){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC2)){
+			char option = 0;
+			if(channel >= 1 && channel <= 2)
+				option = 128*(channel-1);
+
+			if(!strcmp(type, "normal"))//Options: "normal", "auto"
+				option += 64;
+
+			if(!strcmp(edge, "falling"))//Options: "rising", "falling"
+				option += 32;
+
+			if(level >= 0 && level <= 4095){
+				if(plate->osc){
+					plate->osc->triggerChan = (channel == 2 ? 2 : 1);
+					plate->osc->triggerType = (option & 64 ? 'n' : 'a');
+					plate->osc->triggerEdge = (option & 32 ? 'f' : 'r');
+					plate->osc->triggerLevel = level;
+				}
+				sendCMD(plate, 0xA6, option + (level>>8), level&0xFF, 0);
+			}
+		}
+	}
+}
+
+void trigOSCnow(struct piplate* plate){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC2)){
+			sendCMD(plate, 0xA7, 0, 0, 0);
+		}
+	}
+}
+
+void runOSC(struct piplate* plate){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC2)){
+			sendCMD(plate, 0xA5, 0, 0, 0);
+		}
+	}
+}
+
+/* End of DAQC2 Oscilloscope Commands */
+
+/* Start of stepper motor functions */
+
+static void stepperTRACKint(struct piplate*, int, const struct timespec*, void*);
+static int microSTEPS(char);
+
+int stepperINIT(struct piplate* plate){
+	int i = 0;
+
+	plate->stm = (struct stepperMotorParams*)plateALLOC(plate, SLOT_STM, 2, sizeof(struct stepperMotorParams));
+	if(!plate->stm)
+		return INVAL_CMD;
+	for(i = 0; i < 2; i++){
+		plate->stm[i].dir = CW;
+		plate->stm[i].resolution = FULL_STEP;
+		plate->stm[i].rate = 500;
+		plate->stm[i].acc = 0;
+		plate->stm[i].micro = microSTEPS(FULL_STEP);
+	}
+
+	/*
+	* Resync positions on stop/steady. Only pi_plate_open handles stay at one
+	* address for their whole life, a pi_plate_init struct is often a copy on
+	* the caller's stack, so those plates keep dead-reckoned positions only.
+	* Detaching first keeps a re-init from taking a second slot.
+	*/
+	intDETACH(plate, stepperTRACKint, NULL);
+	if(plate->arena && compareWith(plate->id, 2, MOTOR, DAQC2))
+		intATTACH(plate, stepperTRACKint, NULL);
+	return 0;
+}
+
+void stepperENABLE(struct piplate* plate){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC2))
+			sendCMD(plate, 0xB1, 0, 0, 0);
+	}
+}
+
+void stepperDISABLE(struct piplate* plate){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC2))
+			sendCMD(plate, 0xB0, 0, 0, 0);
+	}
+}
+
+void stepperINTenable(struct piplate* plate, char motor){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC2)){
+			if(motor >= 1 && motor <= 2)
+				sendCMD(plate, 0xB7, motor-1, 0, 0);
+		}
+	}
+}
+
+void stepperINTdisable(struct piplate* plate, char motor){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC2)){
+			if(motor >= 1 && motor <= 2)
+				sendCMD(plate, 0xB8, motor-1, 0, 0);
+		}
+	}
+}
+
+//MOTOR stepper configuration words for command 0x10 + motor - 1: p1 in the high byte, p2 in the low byte.
+static int stepperCFGword(char direction, char resolution, int rate){
+	int param1 = 0;
+
+	if (direction == CW)
+		param1 = 0x40;
+	param1 += (resolution << 4);
+	param1 += (rate >> 8);
+
+	return (param1 << 8) + (rate & 0x00FF);
+}
+
+static int stepperINCword(int rate, double acceleration){
+	int increment;
+
+	if(acceleration == 0)
+		increment = 0;
+	else
+		increment = (int)(1024.0 * rate / (acceleration*2000) + 0.5);
+
+	return ((0x80 + (increment>>8)) << 8) + (increment & 0x00FF);
+}
+
+//DAQC2 rate word for command 0xB2.
+static int stepperRATEword(char motor, int rate, char resolution){
+	int rateInc = (int)(rate*pow(2, 13)/1000.0 + 0.5);
+	int param1 = ((motor-1)<<7)+(rateInc>>8);
+
+	if(resolution == HALF_STEP)
+		param1 |= 0x40;
+
+	return (param1 << 8) + (rateInc&0xFF);
+}
+
+//Move time for a ramp of acc seconds to rate, symmetric deceleration.
+static long long stepperDURATION(long steps, int rate, double acc){
+	double t;
+
+	if(rate <= 0)
+		return 0;
+	if(acc <= 0 || steps >= (long)(rate*acc))
+		t = acc + (double)steps/rate;
+	else
+		t = 2*sqrt(steps*acc/rate);//Never reaches rate
+	return (long long)(t*1e9);
+}
+
+//Stop interrupt bit for a motor in getINTflag0 (MOTOR) or getINTflags (DAQC2).
+static int stepperSTOPmask(struct piplate* plate, char motor){
+	if(compareWith(plate->id, 1, MOTOR))
+		return (motor == 1 ? MOTOR_INT_STEPA_STOP : MOTOR_INT_STEPB_STOP);
+	return (motor == 1 ? DAQC2_INT_STEP1_STOP : DAQC2_INT_STEP2_STOP);
+}
+
+//Steady (ramp finished) bit, MOTOR only.
+static int stepperSTEADYmask(struct piplate* plate, char motor){
+	if(compareWith(plate->id, 1, MOTOR))
+		return (motor == 1 ? MOTOR_INT_STEPA_STEADY : MOTOR_INT_STEPB_STEADY);
+	return 0;
+}
+
+/*
+* Position tracking. Positions are kept in eighth steps so moves at any
+* resolution add up. While a move or jog runs the position is estimated from
+* the start time, rate and ramp; stop interrupts snap it to the target and
+* steady interrupts re-anchor the ramp timing.
+*/
+
+static pthread_mutex_t stmLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int microSTEPS(char resolution){
+	return 8 >> resolution;
+}
+
+//Steps covered t seconds into a move of steps (jog when steps < 0) at rate with ramp time acc.
+static double stepperTRAVEL(long steps, int rate, double acc, double t){
+	double a = (acc > 0 ? rate/acc : 0);
+	double T;
+
+	if(t <= 0 || rate <= 0)
+		return 0;
+	if(steps < 0){
+		if(a == 0 || t >= acc)
+			return (a ? rate*acc/2 : 0) + rate*(t - (a ? acc : 0));
+		return a*t*t/2;
+	}
+
+	T = stepperDURATION(steps, rate, acc)*1e-9;
+	if(t >= T)
+		return steps;
+	if(a == 0)
+		return rate*t;
+	if(t < T/2 && t < acc)
+		return a*t*t/2;
+	if(T - t < acc && T - t < T/2)
+		return steps - a*(T - t)*(T - t)/2;
+	return (t < T/2 ? rate*acc/2 + rate*(t - acc) : steps - rate*acc/2 - rate*((T - t) - acc));
+}
+
+//Called with stmLock held.
+static long stepperESTIMATE(struct stepperMotorParams* stm){
+	struct timespec now;
+	double t;
+	long travel;
+
+	if(!stm->moving)
+		return stm->position;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	t = tsDIFF(&now, &stm->started)*1e-9;
+	if(stm->moving == 1){
+		long steps = labs(stm->target - stm->origin) / stm->micro;
+		travel = (long)stepperTRAVEL(steps, stm->trackRate, stm->trackAcc, t)*stm->micro;
+	}else{
+		travel = (long)stepperTRAVEL(-1, stm->trackRate, stm->trackAcc, t)*stm->micro;
+	}
+	return stm->origin + travel*stm->moveDir;
+}
+
+//Records a move (jog when jog is set) that is about to be commanded.
+static void stepperTRACK(struct piplate* plate, char motor, long steps, char dir, bool jog){
+	struct stepperMotorParams* stm = &plate->stm[motor - 1];
+
+	pthread_mutex_lock(&stmLock);
+	stm->origin = stepperESTIMATE(stm);
+	stm->micro = microSTEPS(stm->resolution);
+	stm->moveDir = (dir == CW ? 1 : -1);
+	stm->target = (jog ? stm->origin : stm->origin + steps*stm->micro*stm->moveDir);
+	stm->trackRate = stm->rate;
+	stm->trackAcc = (compareWith(plate->id, 1, MOTOR) ? stm->acc : 0);
+	stm->moving = (jog ? 2 : 1);
+	stm->position = stm->origin;
+	clock_gettime(CLOCK_MONOTONIC, &stm->started);
+	stateMOTORS(plate);
+	pthread_mutex_unlock(&stmLock);
+}
+
+static void stepperHALT(struct piplate* plate, char motor){
+	struct stepperMotorParams* stm = &plate->stm[motor - 1];
+
+	pthread_mutex_lock(&stmLock);
+	stm->position = stepperESTIMATE(stm);
+	stm->target = stm->position;
+	stm->moving = 0;
+	stateMOTORS(plate);
+	pthread_mutex_unlock(&stmLock);
+}
+
+//Settles the model on a stop flag seen at seen. Called with stmLock held.
+static void stepperSTOPPED(struct stepperMotorParams* stm, const struct timespec* seen){
+	if(stm->moving && tsDIFF(&stm->started, seen) <= 0){//A move started after the flag is not the one that stopped
+		stm->position = (stm->moving == 1 ? stm->target : stepperESTIMATE(stm));
+		stm->target = stm->position;
+		stm->moving = 0;
+	}
+}
+
+static void stepperTRACKint(struct piplate* plate, int flags, const struct timespec* seen, void* ctx){
+	char motor;
+
+	if(!plate->stm)
+		return;
+
+	pthread_mutex_lock(&stmLock);
+	for(motor = 1; motor <= 2; motor++){
+		struct stepperMotorParams* stm = &plate->stm[motor - 1];
+
+		if(flags & stepperSTOPmask(plate, motor)){
+			stepperSTOPPED(stm, seen);
+		}else if(stm->moving && (flags & stepperSTEADYmask(plate, motor))){
+			//The ramp just ended: shift the start so the model's ramp ends now too.
+			stm->started = *seen;
+			tsADD(&stm->started, -(long long)(stm->trackAcc*1e9));
+		}
+	}
+	stateMOTORS(plate);
+	pthread_mutex_unlock(&stmLock);
+}
+
+//Estimated position in eighth steps. No bus traffic.
+long stepperPOS(struct piplate* plate, char motor){
+	long pos = INVAL_CMD;
+
+	if(plate->stm && motor >= 1 && motor <= 2){
+		pthread_mutex_lock(&stmLock);
+		pos = stepperESTIMATE(&plate->stm[motor - 1]);
+		pthread_mutex_unlock(&stmLock);
+	}
+	return pos;
+}
+
+long stepperTARGET(struct piplate* plate, char motor){
+	long pos = INVAL_CMD;
+
+	if(plate->stm && motor >= 1 && motor <= 2){
+		pthread_mutex_lock(&stmLock);
+		pos = plate->stm[motor - 1].target;
+		pthread_mutex_unlock(&stmLock);
+	}
+	return pos;
+}
+
+bool stepperMOVING(struct piplate* plate, char motor){
+	bool moving = 0;
+
+	if(plate->stm && motor >= 1 && motor <= 2){
+		pthread_mutex_lock(&stmLock);
+		moving = plate->stm[motor - 1].moving;
+		pthread_mutex_unlock(&stmLock);
+	}
+	return moving;
+}
+
+void stepperSETPOS(struct piplate* plate, char motor, long position){
+	if(plate->isValid && compareWith(plate->id, 2, MOTOR, DAQC2) && motor >= 1 && motor <= 2){
+		if(!plate->stm && stepperINIT(plate))
+			return;
+
+		pthread_mutex_lock(&stmLock);
+		plate->stm[motor - 1].position = position;
+		plate->stm[motor - 1].target = position;
+		plate->stm[motor - 1].moving = 0;
+		pthread_mutex_unlock(&stmLock);
+	}
+}
+
+static int motorSYNC(struct piplate*);
+
+void stepperCONFIG(struct piplate* plate, char motor, char direction, char resolution, int rate, double acceleration){
+	if(plate->isValid){
+		if(!plate->stm && stepperINIT(plate))
+			return;
+
+		if(compareWith(plate->id, 1, MOTOR)){
+			if(motor >= 1 && motor <= 2 && (direction == CW || direction == CCW) && resolution >= 0 && resolution <= 3 && rate >= 1 && rate <= 2000 && acceleration >= 0 && acceleration <= 10){
+				plate->stm[motor - 1].dir = direction;
+				plate->stm[motor - 1].resolution = resolution;
+				plate->stm[motor - 1].rate = rate;
+				plate->stm[motor - 1].acc = acceleration;
+				plate->stm[motor - 1].used = 1;
+
+				if(!plate->txn)
+					motorSYNC(plate);
+			}
+		}
+	}
+}
+
+void stepperDIR(struct piplate* plate, char motor, char direction){
+	if(plate->isValid){
+		if(!plate->stm && stepperINIT(plate))
+			return;
+
+		if(compareWith(plate->id, 1, DAQC2)){
+			if(motor >= 1 && motor <= 2){
+				plate->stm[motor - 1].dir = direction;
+				sendCMD(plate, 0xB3, motor - 1, direction, 0);
+			}
+		}else if(compareWith(plate->id, 1, MOTOR)){
+			if(motor >= 1 && motor <= 2)
+				stepperCONFIG(plate, motor, direction, plate->stm[motor - 1].resolution, plate->stm[motor - 1].rate, plate->stm[motor - 1].acc);
+		}
+	}
+}
+
+void stepperRATE(struct piplate* plate, char motor, int rate, char resolution){
+	if(plate->isValid){
+		if(!plate->stm && stepperINIT(plate))
+			return;
+
+		if(compareWith(plate->id, 1, DAQC2)){
+			if(motor >= 1 && motor <= 2 && rate >= 0 && rate <= 500 && resolution >= FULL_STEP && resolution <= HALF_STEP){
+				int word = stepperRATEword(motor, rate, resolution);
+
+				plate->stm[motor - 1].rate = rate;
+				plate->stm[motor - 1].resolution = resolution;
+				sendCMD(plate, 0xB2, word >> 8, word & 0xFF, 0);
+			}
+		}else if(compareWith(plate->id, 1, MOTOR)){
+			if(motor >= 1 && motor <= 2)
+				stepperCONFIG(plate, motor, plate->stm[motor - 1].dir, resolution, rate, plate->stm[motor - 1].acc);
+		}
+	}
+}
+
+void stepperACC(struct piplate* plate, char motor, double acceleration){
+	if(plate->isValid){
+		if(!plate->stm && stepperINIT(plate))
+			return;
+
+		if(compareWith(plate->id, 1, MOTOR)){
+			if(motor >= 1 && motor <= 2)
+				stepperCONFIG(plate, motor, plate->stm[motor - 1].dir, plate->stm[motor - 1].resolution, plate->stm[motor - 1].rate, acceleration);
+		}
+	}
+}
+
+void stepperMOVE(struct piplate* plate, char motor, int steps){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC2)){
+			if(motor >= 1 && motor <= 2 && steps >= -16383 && steps <= 16383){
+				bool stepSign = (steps > 0 ? 1 : 0);
+				int param1 = ((motor - 1) << 7) + (stepSign << 6) + (abs(steps)>>8);
+				int param2 = abs(steps) & 0xFF;
+				if(!plate->stm && stepperINIT(plate))
+					return;
+				stepperTRACK(plate, motor, abs(steps), (stepSign ? CW : CCW), 0);
+				sendCMD(plate, 0xB4, param1, param2, 0);
+			}
+		}else if(compareWith(plate->id, 1, MOTOR)){
+			if(motor >= 1 && motor <= 2 && steps >= 0 && steps <= 65535){
+				char cmd = 0x12 + motor - 1;
+				int param1 = steps>>8;
+				int param2 = steps&0xFF;
+				if(!plate->stm && stepperINIT(plate))
+					return;
+				stepperTRACK(plate, motor, steps, plate->stm[motor - 1].dir, 0);
+				sendCMD(plate, cmd, param1, param2, 0);
+			}
+		}
+	}
+}
+
+/*
+* Synchronized multi-axis move. Every axis is validated and configured first,
+* then all start commands go out back to back in one batch. Each axis' skew
+* field gets the ns between the first start command returning and its own.
+* That is the spread in issuing the commands as the host saw it: the plates
+* report no start time, so when each motor actually began is not measured.
+* The return value is the overall spread, or INVAL_CMD if any axis is invalid.
+*/
+
+long long stepperMOVEsync(struct axisMove* axes, int n){
+	unsigned char cmd[AXIS_MAX][2];//Configuration for axis i, a 0 cmd is skipped
+	unsigned char p1[AXIS_MAX][2];
+	unsigned char p2[AXIS_MAX][2];
+	unsigned char mcmd[AXIS_MAX];//Start command for axis i
+	unsigned char m1[AXIS_MAX];
+	unsigned char m2[AXIS_MAX];
+	struct timespec first, now;
+	unsigned mask = 0;
+	int i, c;
+
+	if(!axes || n <= 0 || n > AXIS_MAX)
+		return INVAL_CMD;
+
+	for(i = 0; i < n; i++){
+		struct axisMove* a = &axes[i];
+		struct piplate* plate = a->plate;
+		int steps = abs(a->steps);
+		char dir = (a->steps >= 0 ? CW : CCW);
+		int word;
+
+		if(!plate || !plate->isValid || a->motor < 1 || a->motor > 2)
+			return INVAL_CMD;
+		if(!plate->stm && stepperINIT(plate))
+			return INVAL_CMD;
+
+		if(compareWith(plate->id, 1, MOTOR)){
+			char res = plate->stm[a->motor - 1].resolution;
+			if(a->rate < 1 || a->rate > 2000 || a->acc < 0 || a->acc > 10 || steps > 65535)
+				return INVAL_CMD;
+
+			word = stepperCFGword(dir, res, a->rate);
+			cmd[i][0] = 0x10 + a->motor - 1;
+			p1[i][0] = word >> 8;
+			p2[i][0] = word & 0xFF;
+			word = stepperINCword(a->rate, a->acc);
+			cmd[i][1] = 0x10 + a->motor - 1;
+			p1[i][1] = word >> 8;
+			p2[i][1] = word & 0xFF;
+
+			mcmd[i] = 0x12 + a->motor - 1;
+			m1[i] = steps >> 8;
+			m2[i] = steps & 0xFF;
+		}else if(compareWith(plate->id, 1, DAQC2)){
+			char res = plate->stm[a->motor - 1].resolution;
+			if(a->rate < 0 || a->rate > 500 || steps > 16383)
+				return INVAL_CMD;
+
+			word = stepperRATEword(a->motor, a->rate, res);
+			cmd[i][0] = 0xB2;
+			p1[i][0] = word >> 8;
+			p2[i][0] = word & 0xFF;
+			cmd[i][1] = 0;//Direction comes with the move on DAQC2
+
+			mcmd[i] = 0xB4;
+			m1[i] = ((a->motor - 1) << 7) + ((a->steps > 0) << 6) + (steps >> 8);
+			m2[i] = steps & 0xFF;
+		}else{
+			return INVAL_CMD;
+		}
+		mask |= stackBIT(plate);
+	}
+
+	beginBATCHon(mask);
+	for(i = 0; i < n; i++){
+		for(c = 0; c < 2; c++){
+			if(cmd[i][c])
+				sendCMD(axes[i].plate, cmd[i][c], p1[i][c], p2[i][c], 0);
+		}
+	}
+	endBATCHon(mask);
+
+	for(i = 0; i < n; i++){
+		struct stepperMotorParams* stm = &axes[i].plate->stm[axes[i].motor - 1];
+		stm->rate = axes[i].rate;
+		if(compareWith(axes[i].plate->id, 1, MOTOR))
+			stm->acc = axes[i].acc;
+		stepperTRACK(axes[i].plate, axes[i].motor, abs(axes[i].steps), (axes[i].steps >= 0 ? CW : CCW), 0);
+	}
+
+	beginBATCHon(mask);
+	for(i = 0; i < n; i++){
+		sendCMD(axes[i].plate, mcmd[i], m1[i], m2[i], 0);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if(i == 0)
+			first = now;
+		axes[i].skew = tsDIFF(&now, &first);
+	}
+	endBATCHon(mask);
+
+	for(i = 0; i < n; i++){
+		axes[i].plate->stm[axes[i].motor - 1].dir = (axes[i].steps >= 0 ? CW : CCW);
+		axes[i].plate->stm[axes[i].motor - 1].synced = 0;
+	}
+
+	return axes[n - 1].skew;
+}
+
+void stepperJOG(struct piplate* plate, char motor){
+	if(plate->isValid){
+		if(compareWith(plate->id, 2, DAQC2, MOTOR) && motor >= 1 && motor <= 2){
+			if(!plate->stm && stepperINIT(plate))
+				return;
+			stepperTRACK(plate, motor, 0, plate->stm[motor - 1].dir, 1);
+		}
+
+		if(compareWith(plate->id, 1, DAQC2)){
+			if(motor >= 1 && motor <= 2)
+				sendCMD(plate, 0xB5, motor-1, 0, 0);
+		}else if(compareWith(plate->id, 1, MOTOR)){
+			if(motor >= 1 && motor <= 2)
+				sendCMD(plate, 0x14 + motor - 1, 0, 0, 0);
+		}
+	}
+}
+
+void stepperSTOP(struct piplate* plate, char motor){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC2)){
+			if(motor >= 1 && motor <= 2)
+				sendCMD(plate, 0xB6, motor - 1, 0, 0);
+		}else if(compareWith(plate->id, 1, MOTOR)){
+			if(motor >= 1 && motor <= 2)
+				sendCMD(plate, 0x16 + motor - 1, 0, 0, 0);
+		}
+
+		if(plate->stm && compareWith(plate->id, 2, DAQC2, MOTOR) && motor >= 1 && motor <= 2)
+			stepperHALT(plate, motor);
+	}
+}
+
+void stepperOFF(struct piplate* plate, char motor){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC2)){
+			if(motor >= 1 && motor <= 2)
+				sendCMD(plate, 0xBA, motor - 1, 0, 0);
+		}else if(compareWith(plate->id, 1, MOTOR)){
+				if(motor >= 1 && motor <= 2)
+					sendCMD(plate, 0x1E + motor - 1, 0, 0, 0);
+		}
+
+		if(plate->stm && compareWith(plate->id, 2, DAQC2, MOTOR) && motor >= 1 && motor <= 2)
+			stepperHALT(plate, motor);
+	}
+}
+
+/* End of stepper motor functions */
+
+/* Start of stepper motion planner */
+
+struct planSegment {
+	int ncmd;
+	unsigned char cmd[3];
+	unsigned char p1[3];
+	unsigned char p2[3];
+	long steps;
+	char dir;
+	int rate;
+	double acc;
+	long long duration;//Estimated ns from move command to stop
+};
+
+struct motionPlan {
+	struct piplate* plate;
+	char motor;
+	char profile;
+	int count;
+	struct planSegment* segs;
+	long long total;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	bool started;
+	bool running;//Cleared by planSTOP
+	int completed;
+	bool stopped;//Set by planINT
+	bool timedOut;//A segment never reported its stop, the plan was stopped there
+	long long gapMax;//Worst ns between detecting a stop and issuing the next move
+};
+
+static void planINT(struct piplate* plate, int flags, const struct timespec* seen, void* ctx){
+	struct motionPlan* plan = (struct motionPlan*)ctx;
+
+	if(flags & stepperSTOPmask(plate, plan->motor))
+		__atomic_store_n(&plan->stopped, 1, __ATOMIC_RELEASE);
+}
+
+//Waits for the motor's stop interrupt or planSTOP. Returns 0 if the deadline passed first.
+static bool planWAITstop(struct motionPlan* plan, const struct timespec* deadline){
+	struct timespec now;
+	struct timespec nap = {0, 200000};
+
+	for(;;){
+		if(!intTHREADrunning())
+			intSERVICE();
+		if(__atomic_exchange_n(&plan->stopped, 0, __ATOMIC_ACQ_REL) || !__atomic_load_n(&plan->running, __ATOMIC_ACQUIRE))
+			return 1;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if(tsDIFF(&now, deadline) >= 0)
+			return 0;
+		nanosleep(&nap, NULL);
+	}
+}
+
+/*
+* Turns a path of absolute positions (in steps at the motor's current
+* resolution) into ready-to-send segment commands. Configuration is only
+* re-sent when a segment changes direction, rate or acceleration. The firmware
+* only ramps linearly and every segment ends at rest, so PROFILE_TRAPEZOID is
+* the only profile.
+*/
+
+struct motionPlan* planPATH(struct piplate* plate, char motor, long start, const struct pathPoint* path, int n, char profile){
+	struct motionPlan* plan;
+	char dir, res;
+	int rate, i;
+	double acc;
+	long pos = start;
+	bool daqc2;
+
+	if(!plate->isValid || !compareWith(plate->id, 2, MOTOR, DAQC2) || motor < 1 || motor > 2 || !path || n <= 0)
+		return NULL;
+	if(profile != PROFILE_TRAPEZOID)
+		return NULL;
+
+	if(!plate->stm && stepperINIT(plate))
+		return NULL;
+
+	daqc2 = compareWith(plate->id, 1, DAQC2);
+	dir = -1;//Forces the first segment to configure
+	rate = -1;
+	acc = -1;
+	res = plate->stm[motor - 1].resolution;
+
+	plan = (struct motionPlan*)calloc(1, sizeof(struct motionPlan));
+	if(!plan)
+		return NULL;
+	plan->segs = (struct planSegment*)calloc(n, sizeof(struct planSegment));
+	if(!plan->segs){
+		free(plan);
+		return NULL;
+	}
+	plan->plate = plate;
+	plan->motor = motor;
+	plan->profile = profile;
+
+	for(i = 0; i < n; i++){
+		struct planSegment* seg = &plan->segs[plan->count];
+		long delta = path[i].position - pos;
+		double segAcc = path[i].acc;
+		int word;
+
+		if(delta == 0)
+			continue;
+		if(daqc2 && (path[i].rate < 0 || path[i].rate > 500 || labs(delta) > 16383))
+			goto invalid;
+		if(!daqc2 && (path[i].rate < 1 || path[i].rate > 2000 || segAcc < 0 || segAcc > 10 || labs(delta) > 65535))
+			goto invalid;
+
+		seg->steps = delta;
+		seg->dir = (delta > 0 ? CW : CCW);
+		seg->rate = path[i].rate;
+		seg->acc = (daqc2 ? 0 : segAcc);
+		seg->duration = stepperDURATION(labs(delta), seg->rate, seg->acc);
+
+		if(daqc2){
+			if(seg->rate != rate){
+				word = stepperRATEword(motor, seg->rate, res);
+				seg->cmd[seg->ncmd] = 0xB2;
+				seg->p1[seg->ncmd] = word >> 8;
+				seg->p2[seg->ncmd++] = word & 0xFF;
+			}
+			word = ((motor - 1) << 7) + ((delta > 0) << 6) + ((labs(delta) >> 8) & 0x3F);
+			seg->cmd[seg->ncmd] = 0xB4;
+			seg->p1[seg->ncmd] = word;
+			seg->p2[seg->ncmd++] = labs(delta) & 0xFF;
+		}else{
+			if(seg->dir != dir || seg->rate != rate){
+				word = stepperCFGword(seg->dir, res, seg->rate);
+				seg->cmd[seg->ncmd] = 0x10 + motor - 1;
+				seg->p1[seg->ncmd] = word >> 8;
+				seg->p2[seg->ncmd++] = word & 0xFF;
+			}
+			if(seg->rate != rate || seg->acc != acc){
+				word = stepperINCword(seg->rate, seg->acc);
+				seg->cmd[seg->ncmd] = 0x10 + motor - 1;
+				seg->p1[seg->ncmd] = word >> 8;
+				seg->p2[seg->ncmd++] = word & 0xFF;
+			}
+			seg->cmd[seg->ncmd] = 0x12 + motor - 1;
+			seg->p1[seg->ncmd] = labs(delta) >> 8;
+			seg->p2[seg->ncmd++] = labs(delta) & 0xFF;
+		}
+
+		dir = seg->dir;
+		rate = seg->rate;
+		acc = seg->acc;
+		pos = path[i].position;
+		plan->total += seg->duration;
+		plan->count++;
+	}
+	pthread_mutex_init(&plan->lock, NULL);
+	wakeINIT(&plan->wake);
+	return plan;
+
+invalid:
+	free(plan->segs);
+	free(plan);
+	return NULL;
+}
+
+static void* planTHREAD(void* arg){
+	struct motionPlan* plan = (struct motionPlan*)arg;
+	struct piplate* plate = plan->plate;
+	struct timespec detected;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &detected);
+	for(i = 0; i < plan->count && __atomic_load_n(&plan->running, __ATOMIC_ACQUIRE); i++){
+		struct planSegment* seg = &plan->segs[i];
+		struct timespec issued, deadline;
+		long long gap;
+		int c;
+
+		__atomic_store_n(&plan->stopped, 0, __ATOMIC_RELEASE);
+		plate->stm[plan->motor - 1].rate = seg->rate;
+		plate->stm[plan->motor - 1].acc = seg->acc;
+		stepperTRACK(plate, plan->motor, labs(seg->steps), seg->dir, 0);
+		busLOCK(plateSTACK(plate));
+		clock_gettime(CLOCK_MONOTONIC, &issued);
+		for(c = 0; c < seg->ncmd; c++)
+			sendCMD(plate, seg->cmd[c], seg->p1[c], seg->p2[c], 0);
+		busUNLOCK(plateSTACK(plate));
+
+		gap = tsDIFF(&issued, &detected);
+		if(i > 0 && gap > plan->gapMax)
+			plan->gapMax = gap;
+
+		//Sleep through most of the move, then watch for the stop interrupt.
+		deadline = issued;
+		tsADD(&deadline, seg->duration*9/10);
+		if(!wakeSLEEP(&plan->lock, &plan->wake, &plan->running, &deadline))
+			break;
+		deadline = issued;
+		tsADD(&deadline, seg->duration*3/2 + 50000000);
+		if(!planWAITstop(plan, &deadline)){//Never saw the stop, do not send the next move on top of this one
+			plan->timedOut = 1;
+			stepperSTOP(plate, plan->motor);
+			break;
+		}
+		if(!__atomic_load_n(&plan->running, __ATOMIC_ACQUIRE))
+			break;
+		clock_gettime(CLOCK_MONOTONIC, &detected);
+
+		__atomic_store_n(&plan->completed, i + 1, __ATOMIC_RELEASE);
+	}
+
+	intDETACH(plate, planINT, plan);
+	plate->stm[plan->motor - 1].synced = 0;//Config words were sent directly
+
+	if(plan->count){
+		struct planSegment* last = &plan->segs[plan->count - 1];
+		plate->stm[plan->motor - 1].dir = last->dir;
+		plate->stm[plan->motor - 1].rate = last->rate;
+		if(compareWith(plate->id, 1, MOTOR))
+			plate->stm[plan->motor - 1].acc = last->acc;
+	}
+	return NULL;
+}
+
+int planRUN(struct motionPlan* plan){
+	if(!plan || plan->started)
+		return INVAL_CMD;
+
+	intEnable(plan->plate);
+	if(compareWith(plan->plate->id, 1, MOTOR))
+		enablestepSTOPint(plan->plate, plan->motor);
+	else
+		stepperINTenable(plan->plate, plan->motor);
+
+	if(intATTACH(plan->plate, planINT, plan))
+		return INVAL_CMD;
+	plan->running = 1;
+	if(pthread_create(&plan->thread, NULL, planTHREAD, plan)){
+		plan->running = 0;
+		intDETACH(plan->plate, planINT, plan);
+		return INVAL_CMD;
+	}
+	plan->started = 1;
+	return 0;
+}
+
+//Waits for the path to finish and returns the number of segments completed.
+int planWAIT(struct motionPlan* plan){
+	if(plan->started){
+		pthread_join(plan->thread, NULL);
+		plan->started = 0;
+	}
+	return plan->completed;
+}
+
+int planSTOP(struct motionPlan* plan){
+	wakeSTOP(&plan->lock, &plan->wake, &plan->running);
+	stepperSTOP(plan->plate, plan->motor);
+	return planWAIT(plan);
+}
+
+void planFREE(struct motionPlan* plan){
+	if(plan){
+		planWAIT(plan);
+		pthread_cond_destroy(&plan->wake);
+		pthread_mutex_destroy(&plan->lock);
+		free(plan->segs);
+		free(plan);
+	}
+}
+
+double planTIME(struct motionPlan* plan){
+	return plan->total*1e-9;
+}
+
+long long planGAP(struct motionPlan* plan){
+	return plan->gapMax;
+}
+
+bool planTIMEDOUT(struct motionPlan* plan){
+	return plan->timedOut;
+}
+
+/* End of stepper motion planner */
+
+/* Start of DAQC2 stepper move queue */
+
+struct moveQueue {
+	pthread_mutex_t lock;
+	int steps[MOVEQ_DEPTH];
+	int head;
+	int count;
+	bool active;//A queued move is running
+	bool ended;//stepperQUEUEend was called, running dry is expected
+	long issued;
+	long underruns;
+	long long latMin;
+	long long latMax;
+	long long latSum;
+	long latCount;
+};
+
+//Issues the next queued move for a motor. Called with the queue locked.
+static void moveQUEUEnext(struct piplate* plate, char motor, struct moveQueue* q){
+	int steps = q->steps[q->head];
+
+	q->head = (q->head + 1) % MOVEQ_DEPTH;
+	q->count--;
+	q->active = 1;
+	q->issued++;
+	stepperMOVE(plate, motor, steps);
+}
+
+static void moveQUEUEint(struct piplate* plate, int flags, const struct timespec* seen, void* ctx){
+	char motor;
+
+	for(motor = 1; motor <= 2; motor++){
+		struct moveQueue* q = &plate->mq[motor - 1];
+
+		if(!(flags & stepperSTOPmask(plate, motor)))
+			continue;
+
+		pthread_mutex_lock(&q->lock);
+		if(q->count){
+			struct timespec now;
+			long long lat;
+
+			if(plate->stm){//Land the stopped move first, the tracker may run after the next one is sent
+				pthread_mutex_lock(&stmLock);
+				stepperSTOPPED(&plate->stm[motor - 1], seen);
+				pthread_mutex_unlock(&stmLock);
+			}
+			moveQUEUEnext(plate, motor, q);
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			lat = tsDIFF(&now, seen);
+			if(!q->latCount || lat < q->latMin)
+				q->latMin = lat;
+			if(lat > q->latMax)
+				q->latMax = lat;
+			q->latSum += lat;
+			q->latCount++;
+		}else if(q->active){
+			q->active = 0;
+			if(!q->ended)//Ran dry while the caller still had moves to send
+				q->underruns++;
+		}
+		pthread_mutex_unlock(&q->lock);
+	}
+}
+
+//Needs a pi_plate_open handle: the dispatcher keeps the pointer for the plate's life.
+static int moveQUEUEinit(struct piplate* plate){
+	struct moveQueue* mq;
+	int i;
+
+	if(!plate->arena)
+		return INVAL_CMD;
+	mq = (struct moveQueue*)plateALLOC(plate, SLOT_MQ, 2, sizeof(struct moveQueue));
+	if(!mq)
+		return INVAL_CMD;
+	for(i = 0; i < 2; i++)
+		pthread_mutex_init(&mq[i].lock, NULL);
+	plate->mq = mq;
+	if(intATTACH(plate, moveQUEUEint, NULL)){
+		plate->mq = NULL;
+		for(i = 0; i < 2; i++)
+			pthread_mutex_destroy(&mq[i].lock);
+		plateFREE(plate, mq);
+		return INVAL_CMD;
+	}
+
+	intEnable(plate);
+	stepperINTenable(plate, 1);
+	stepperINTenable(plate, 2);
+	return 0;
+}
+
+/*
+* Queues a move behind the ones already pending on a DAQC2 motor. The next move
+* is issued from the interrupt dispatcher as soon as the stop flag for the
+* motor is seen, so intSERVICE or intTHREADstart must be running. Call
+* stepperQUEUEend after the last move of a stream so that its drain is not
+* counted as an underrun. Only plates from pi_plate_open can queue.
+*/
+
+int stepperQUEUE(struct piplate* plate, char motor, int steps){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC2)){
+			if(motor >= 1 && motor <= 2 && steps >= -16383 && steps <= 16383){
+				struct moveQueue* q;
+				int r = 0;
+
+				if(!plate->mq && moveQUEUEinit(plate))
+					return INVAL_CMD;
+
+				q = &plate->mq[motor - 1];
+				pthread_mutex_lock(&q->lock);
+				if(q->count == MOVEQ_DEPTH){
+					r = INVAL_CMD;
+				}else{
+					q->steps[(q->head + q->count) % MOVEQ_DEPTH] = steps;
+					q->count++;
+					q->ended = 0;
+					if(!q->active)//Idle motor, start right away
+						moveQUEUEnext(plate, motor, q);
+				}
+				pthread_mutex_unlock(&q->lock);
+				return r;
+			}
+		}
+	}
+	return INVAL_CMD;
+}
+
+void stepperQUEUEclear(struct piplate* plate, char motor){
+	if(plate->mq && motor >= 1 && motor <= 2){
+		struct moveQueue* q = &plate->mq[motor - 1];
+
+		pthread_mutex_lock(&q->lock);
+		q->count = 0;
+		q->ended = 1;
+		pthread_mutex_unlock(&q->lock);
+	}
+}
+
+//Marks the last queued move as the end of the stream.
+void stepperQUEUEend(struct piplate* plate, char motor){
+	if(plate->mq && motor >= 1 && motor <= 2){
+		struct moveQueue* q = &plate->mq[motor - 1];
+
+		pthread_mutex_lock(&q->lock);
+		q->ended = 1;
+		pthread_mutex_unlock(&q->lock);
+	}
+}
+
+int stepperQUEUEstats(struct piplate* plate, char motor, struct moveQueueStats* stats){
+	if(plate->mq && motor >= 1 && motor <= 2 && stats){
+		struct moveQueue* q = &plate->mq[motor - 1];
+
+		pthread_mutex_lock(&q->lock);
+		stats->depth = q->count;
+		stats->active = q->active;
+		stats->issued = q->issued;
+		stats->underruns = q->underruns;
+		stats->latMin = q->latMin;
+		stats->latMax = q->latMax;
+		stats->latAvg = (q->latCount ? q->latSum / q->latCount : 0);
+		pthread_mutex_unlock(&q->lock);
+		return 0;
+	}
+	return INVAL_CMD;
+}
+
+/* End of DAQC2 stepper move queue */
+
+/* Start of dc motor functions */
+
+void dcINIT(struct piplate* plate){
+	int i = 0;
+
+	plate->dc = (struct dcMotorParams*)plateALLOC(plate, SLOT_DC, 4, sizeof(struct dcMotorParams));
+	for(i = 0; i < 4; i++){
+		plate->dc[i].dir = CW;
+		plate->dc[i].speed = 50;
+		plate->dc[i].acc = 0;
+	}
+}
+
+//Speed register value for a DC motor. Motors 1 and 2 run from a scaled range.
+static int dcVALUE(char motor, char speed){
+	int v = (int)((speed*1023.0/100.0) + 0.5);
+
+	if(motor == 1 || motor == 2)
+		v = (v*5)>>3;
+	return v;
+}
+
+//Parameter words for commands 0x30 and 0x3A + motor - 1: p1 in the high byte, p2 in the low byte.
+static int dcCFGword(char motor, char dir, char speed){
+	int v = dcVALUE(motor, speed);
+	int param1 = (motor - 1) << 6;
+
+	if(dir == CW)
+		param1 += 0x10;
+
+	param1 += (v >> 8);
+	return (param1 << 8) + (v & 0x00FF);
+}
+
+static int dcINCword(char motor, char speed, double acceleration){
+	int v = dcVALUE(motor, speed);
+
+	if(acceleration == 0)
+		return 0;
+	return (int)(1024.0*v/(acceleration*RMAX)+0.5);
+}
+
+/*
+* Sends whatever part of the cached dc and MOTOR stepper configuration differs
+* from what the plate was last sent, in one batch. Returns the number of
+* commands that went out. Outside motorBEGIN/motorCOMMIT every setter syncs
+* right away.
+*/
+
+static int motorSYNC(struct piplate* plate){
+	int sent = 0;
+	bool ok;
+	int i;
+
+	busLOCK(plateSTACK(plate));
+	if(plate->dc){
+		for(i = 0; i < 4; i++){
+			struct dcMotorParams* dc = &plate->dc[i];
+			int cfg = dcCFGword(i + 1, dc->dir, dc->speed);
+			int inc = dcINCword(i + 1, dc->speed, dc->acc);
+
+			if(!dc->used)
+				continue;
+			ok = 1;
+			if(!dc->synced || cfg != dc->cfgWord){
+				plateError = PLATE_OK;
+				sendCMD(plate, 0x30, cfg >> 8, cfg & 0xFF, 0);
+				if(plateError == PLATE_OK){
+					dc->cfgWord = cfg;
+					sent++;
+				}else{
+					ok = 0;
+				}
+			}
+			if(!dc->synced || inc != dc->incWord){
+				plateError = PLATE_OK;
+				sendCMD(plate, 0x3A + i, inc >> 8, inc & 0xFF, 0);
+				if(plateError == PLATE_OK){
+					dc->incWord = inc;
+					sent++;
+				}else{
+					ok = 0;
+				}
+			}
+			dc->synced = ok;//A failed word is sent again on the next sync
+		}
+	}
+	if(plate->stm && compareWith(plate->id, 1, MOTOR)){
+		for(i = 0; i < 2; i++){
+			struct stepperMotorParams* stm = &plate->stm[i];
+			int cfg = stepperCFGword(stm->dir, stm->resolution, stm->rate);
+			int inc = stepperINCword(stm->rate, stm->acc);
+
+			if(!stm->used)
+				continue;
+			ok = 1;
+			if(!stm->synced || cfg != stm->cfgWord){
+				plateError = PLATE_OK;
+				sendCMD(plate, 0x10 + i, cfg >> 8, cfg & 0xFF, 0);
+				if(plateError == PLATE_OK){
+					stm->cfgWord = cfg;
+					sent++;
+				}else{
+					ok = 0;
+				}
+			}
+			if(!stm->synced || inc != stm->incWord){
+				plateError = PLATE_OK;
+				sendCMD(plate, 0x10 + i, inc >> 8, inc & 0xFF, 0);
+				if(plateError == PLATE_OK){
+					stm->incWord = inc;
+					sent++;
+				}else{
+					ok = 0;
+				}
+			}
+			stm->synced = ok;//A failed word is sent again on the next sync
+		}
+	}
+	busUNLOCK(plateSTACK(plate));
+	stateMOTORS(plate);
+
+	return sent;
+}
+
+void motorBEGIN(struct piplate* plate){
+	if(plate->isValid && compareWith(plate->id, 1, MOTOR))
+		plate->txn++;
+}
+
+int motorCOMMIT(struct piplate* plate){
+	if(plate->isValid && compareWith(plate->id, 1, MOTOR) && plate->txn > 0){
+		if(--plate->txn == 0)
+			return motorSYNC(plate);
+		return 0;
+	}
+	return INVAL_CMD;
+}
+
+void dcCONFIG(struct piplate* plate, char motor, char dir, char speed, double acceleration){
+	if(plate->isValid){
+		if(!plate->dc)
+			dcINIT(plate);
+
+		if(compareWith(plate->id, 1, MOTOR)){
+			if(motor >= 1 && motor <= 4 && (dir == CW || dir == CCW) && speed >= 0 && speed <= 100 && acceleration >= 0 && acceleration <= 10){
+				plate->dc[motor - 1].dir = dir;
+				plate->dc[motor - 1].speed = speed;
+				plate->dc[motor - 1].acc = acceleration;
+				plate->dc[motor - 1].used = 1;
+
+				if(!plate->txn)
+					motorSYNC(plate);
+			}
+		}
+	}
+}
+
+void dcSPEED(struct piplate* plate, char motor, char speed){
+	if(plate->isValid){
+		if(!plate->dc)
+			dcINIT(plate);
+
+		if(compareWith(plate->id, 1, MOTOR)){
+			if(motor >= 1 && motor <= 4 && speed >= 0 && speed <= 100){
+				int v = dcVALUE(motor, speed);
+				int param1 = ((motor-1)<<6) + (v>>8);
+				int param2 = v&0x00FF;
+				struct dcMotorParams* dc = &plate->dc[motor - 1];
+
+				sendCMD(plate, 0x33, param1, param2, 0);
+
+				//The plate now runs at this speed; keep the cached config word in step.
+				dc->speed = speed;
+				if(dc->synced)
+					dc->cfgWord = dcCFGword(motor, dc->dir, speed);
+				stateMOTORS(plate);
+			}
+		}
+	}
+}
+
+void dcDIR(struct piplate* plate, char motor, char dir){
+	if(plate->isValid){
+		if(!plate->dc)
+			dcINIT(plate);
+
+		if(compareWith(plate->id, 1, MOTOR)){
+			if(motor >= 1 && motor <= 4)
+				dcCONFIG(plate, motor, dir, plate->dc[motor - 1].speed, plate->dc[motor - 1].acc);
+		}
+	}
+}
+
+void dcACC(struct piplate* plate, char motor, double acceleration){
+	if(plate->isValid){
+		if(!plate->dc)
+			dcINIT(plate);
+
+		if(compareWith(plate->id, 1, MOTOR)){
+			if(motor >= 1 && motor <= 4)
+				dcCONFIG(plate, motor, plate->dc[motor - 1].dir, plate->dc[motor - 1].speed, acceleration);
+		}
+	}
+}
+
+void dcSTART(struct piplate* plate, char motor){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, MOTOR)){
+			sendCMD(plate, 0x31, motor-1, 0, 0);
+		}
+	}
+}
+
+void dcSTOP(struct piplate* plate, char motor){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, MOTOR)){
+			sendCMD(plate, 0x32, motor-1, 0, 0);
+		}
+	}
+}
+/* End of dc motor functions */
+
+/* Start of dc motor speed control */
+
+struct speedLoop {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	struct piplate* plate;
+	char motor;
+	pthread_cond_t wake;
+	bool running;
+	bool fine;//getTACHfine instead of getTACHcoarse
+	long long period;//ns
+	double setpoint;
+	double kp;
+	double ki;
+	double integral;
+	double measured;
+	int output;//Last speed sent, -1 before the first
+	long cycles;
+	long actuations;
+	long errors;
+	long overruns;
+	long long jitterMax;
+	long long jitterSum;
+};
+
+static void* speedTHREAD(void* arg){
+	struct speedLoop* loop = (struct speedLoop*)arg;
+	double dt = loop->period*1e-9;
+	struct timespec next, now;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while(__atomic_load_n(&loop->running, __ATOMIC_ACQUIRE)){
+		long long late;
+		int tach;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);//Wake-up lateness only, not the bus round trip
+		late = tsDIFF(&now, &next);
+		tach = (loop->fine ? getTACHfine(loop->plate, loop->motor) : getTACHcoarse(loop->plate, loop->motor));
+
+		pthread_mutex_lock(&loop->lock);
+		loop->cycles++;
+		if(late > loop->jitterMax)
+			loop->jitterMax = late;
+		loop->jitterSum += (late > 0 ? late : -late);
+
+		if(tach < 0){
+			loop->errors++;
+		}else{
+			double err = loop->setpoint - tach;
+			double u = loop->kp*err + loop->ki*(loop->integral + err*dt);
+			int out;
+
+			//Conditional integration so a saturated output does not wind up.
+			if((u < 100 || err < 0) && (u > 0 || err > 0))
+				loop->integral += err*dt;
+			u = loop->kp*err + loop->ki*loop->integral;
+			out = (int)(u + 0.5);
+			if(out > 100)
+				out = 100;
+			if(out < 0)
+				out = 0;
+
+			loop->measured = tach;
+			if(out != loop->output){
+				loop->output = out;
+				loop->actuations++;
+				pthread_mutex_unlock(&loop->lock);
+				dcSPEED(loop->plate, loop->motor, out);
+				pthread_mutex_lock(&loop->lock);
+			}
+		}
+		pthread_mutex_unlock(&loop->lock);
+
+		tsADD(&next, loop->period);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if(tsDIFF(&now, &next) > 0){//Missed the slot, skip ahead rather than bursting
+			pthread_mutex_lock(&loop->lock);
+			loop->overruns++;
+			pthread_mutex_unlock(&loop->lock);
+			next = now;
+		}
+		wakeSLEEP(&loop->lock, &loop->wake, &loop->running, &next);
+	}
+	return NULL;
+}
+
+/*
+* Closes a PI loop around a DC motor and its tach (motor n uses tach n) on a
+* thread of its own. The setpoint is in the units of the tach reading chosen,
+* the output is the dcSPEED percentage and is only sent when it changes.
+*/
+
+int dcSPEEDloop(struct piplate* plate, char motor, double rate, double kp, double ki, bool fine){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, MOTOR)){
+			if(motor >= 1 && motor <= 4 && rate >= RATE_MIN && rate <= 1000){
+				struct speedLoop* loop;
+
+				if(!plate->spd)
+					plate->spd = (struct speedLoop*)plateALLOC(plate, SLOT_SPD, 4, sizeof(struct speedLoop));
+				if(!plate->spd)
+					return INVAL_CMD;
+
+				loop = &plate->spd[motor - 1];
+				if(loop->running)
+					return INVAL_CMD;
+
+				pthread_mutex_init(&loop->lock, NULL);
+				wakeINIT(&loop->wake);
+				loop->plate = plate;
+				loop->motor = motor;
+				loop->fine = fine;
+				loop->period = (long long)(1e9/rate);
+				loop->kp = kp;
+				loop->ki = ki;
+				loop->integral = 0;
+				loop->output = -1;
+				loop->cycles = loop->actuations = loop->errors = loop->overruns = 0;
+				loop->jitterMax = loop->jitterSum = 0;
+				loop->running = 1;
+
+				if(pthread_create(&loop->thread, NULL, speedTHREAD, loop)){
+					loop->running = 0;
+					pthread_cond_destroy(&loop->wake);
+					pthread_mutex_destroy(&loop->lock);
+					return INVAL_CMD;
+				}
+				return 0;
+			}
+		}
+	}
+	return INVAL_CMD;
+}
+
+void dcSPEEDset(struct piplate* plate, char motor, double setpoint){
+	if(plate->spd && motor >= 1 && motor <= 4 && plate->spd[motor - 1].running){
+		struct speedLoop* loop = &plate->spd[motor - 1];
+
+		pthread_mutex_lock(&loop->lock);
+		loop->setpoint = setpoint;
+		pthread_mutex_unlock(&loop->lock);
+	}
+}
+
+void dcSPEEDstop(struct piplate* plate, char motor){
+	if(plate->spd && motor >= 1 && motor <= 4 && plate->spd[motor - 1].running){
+		struct speedLoop* loop = &plate->spd[motor - 1];
+
+		wakeSTOP(&loop->lock, &loop->wake, &loop->running);
+		pthread_join(loop->thread, NULL);
+		pthread_cond_destroy(&loop->wake);
+		pthread_mutex_destroy(&loop->lock);
+	}
+}
+
+int dcSPEEDstats(struct piplate* plate, char motor, struct speedLoopStats* stats){
+	if(plate->spd && motor >= 1 && motor <= 4 && plate->spd[motor - 1].running && stats){
+		struct speedLoop* loop = &plate->spd[motor - 1];
+
+		pthread_mutex_lock(&loop->lock);
+		stats->setpoint = loop->setpoint;
+		stats->measured = loop->measured;
+		stats->output = loop->output;
+		stats->cycles = loop->cycles;
+		stats->actuations = loop->actuations;
+		stats->errors = loop->errors;
+		stats->overruns = loop->overruns;
+		stats->jitterMax = loop->jitterMax;
+		stats->jitterAvg = (loop->cycles ? loop->jitterSum / loop->cycles : 0);
+		pthread_mutex_unlock(&loop->lock);
+		return 0;
+	}
+	return INVAL_CMD;
+}
+
+/* End of dc motor speed control */
+
+/* Start of motor interrupt functions */
+
+void setSENSORint(struct piplate* plate, char sensor){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, MOTOR)){
+			if(sensor >= 1 && sensor <= 4)
+				sendCMD(plate, 0x24, sensor, 0, 0);
+		}
+	}
+}
+
+void clrSENSORint(struct piplate* plate, char sensor){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, MOTOR)){
+			if(sensor >= 1 && sensor <= 4)
+				sendCMD(plate, 0x25, sensor, 0, 0);
+		}
+	}
+}
+
+void enablestepSTOPint(struct piplate* plate, char motor){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, MOTOR)){
+			if(motor >= 1 && motor <= 2)
+				sendCMD(plate, 0x1A + (motor - 1), 0, 0, 0);
+		}
+	}
+}
+
+void disablestepSTOPint(struct piplate* plate, char motor){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, MOTOR)){
+			if(motor >= 1 && motor <= 2)
+				sendCMD(plate, 0x1C + (motor - 1), 0, 0, 0);
+		}
+	}
+}
+
+void enablestepSTEADYint(struct piplate* plate, char motor){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, MOTOR)){
+			if(motor >= 1 && motor <= 2)
+				sendCMD(plate, 0x4A + (motor - 1), 0, 0, 0);
+		}
+	}
+}
+
+void disablestepSTEADYint(struct piplate* plate, char motor){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, MOTOR)){
+			if(motor >= 1 && motor <= 2)
+				sendCMD(plate, 0x4C + (motor - 1), 0, 0, 0);
+		}
+	}
+}
+
+void enabledcSTOPint(struct piplate* plate, char motor){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, MOTOR)){
+			if(motor >= 1 && motor <= 4)
+				sendCMD(plate, 0x34, motor - 1, 0, 0);
+		}
+	}
+}
+
+void disabledcSTOPint(struct piplate* plate, char motor){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, MOTOR)){
+			if(motor >= 1 && motor <= 4)
+				sendCMD(plate, 0x35, motor - 1, 0, 0);
+		}
+	}
+}
+
+void enabledcSTEADYint(struct piplate* plate, char motor){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, MOTOR)){
+			if(motor >= 1 && motor <= 4)
+				sendCMD(plate, 0x36, motor - 1, 0, 0);
+		}
+	}
+}
+
+void disabledcSTEADYint(struct piplate* plate, char motor){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, MOTOR)){
+			if(motor >= 1 && motor <= 4)
+				sendCMD(plate, 0x37, motor - 1, 0, 0);
+		}
+	}
+}
+
+/* End of motor interrupt functions */
+
+/* Start of thermo functions */
+
+//Convert 32 bit number to a double
+void tempINIT(struct piplate* plate){
+	int i;
+
+	plate->tmp = (struct tempParams*)plateALLOC(plate, SLOT_TMP, 1, sizeof(struct tempParams));
+	for(i = 0; i < 12; i ++){
+		plate->tmp->scale[i] = KELVINS;//Set scales
+	}
+
+	for(i = 0; i < 8; i ++){
+		plate->tmp->type[i] = 'k';//Set types
+	}
+
+	//Calibration data from flash memory
+
+	if(compareWith(plate->id, 1, THERMO)){
+		char values[4];
+		int prev = setBUSclass(BUS_BULK);
+
+		for(i = 0; i < 4; i ++){
+			values[i] = CalGetByte(plate, i);
+		}
+		plate->tmp->calBias = binaryToDouble(values);
+
+		for(i = 0; i < 8; i++){
+			int j;
+			double val;
+			for(j = 0; j < 4; j++){
+				values[j]=CalGetByte(plate, 8*i+j+4);
+			}
+			plate->tmp->calOffset[i]=binaryToDouble(values);
+			for(j = 4; j < 8; j++){
+				values[j-4]=CalGetByte(plate, 8*i+j+4);
+			}
+			plate->tmp->calScale[i]=binaryToDouble(values);
+		}
+		setBUSclass(prev);
+	}
+}
+
+void setSCALE(struct piplate* plate, char channel, char scale){
+	if(plate->isValid){
+		if(!plate->tmp)
+			tempINIT(plate);
+
+		if(compareWith(plate->id, 1, THERMO)){
+			if(channel >= 1 && channel <= 12){
+				if(scale == KELVINS || scale == CELSIUS || scale == FAHRENHEIT)
+					plate->tmp->scale[channel - 1] = scale;
+			}
+		}else if(compareWith(plate->id, 1, DAQC)){
+			if(channel >= 0 && channel <= 7){
+				if(scale == KELVINS || scale == CELSIUS || scale == FAHRENHEIT)
+					plate->tmp->scale[channel] = scale;
+			}
+		}else if(compareWith(plate->id, 1, TINKER)){
+			if(channel >= 1 && channel <= 8){
+				if(scale == KELVINS || scale == CELSIUS || scale == FAHRENHEIT)
+					plate->tmp->scale[channel - 1] = scale;
+			}
+		}
+	}
+}
+
+void setTYPE(struct piplate* plate, char channel, char type){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, THERMO)){
+			if(!plate->tmp)
+				tempINIT(plate);
+
+			if(channel >= 1 && channel <= 8){
+				if(type == 'k' || type == 'j')
+					plate->tmp->type[channel - 1] = type;
+			}
+		}
+	}
+}
+
+char getTYPE(struct piplate* plate, char channel){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, THERMO)){
+			if(!plate->tmp)
+				tempINIT(plate);
+
+			if(channel >= 1 && channel <= 8)
+				return plate->tmp->type[channel - 1];
+		}
+	}
+}
+
+char getSCALE(struct piplate* plate, char channel){
+	if(plate->isValid){
+		if(!plate->tmp)
+			tempINIT(plate);
+
+		if(compareWith(plate->id, 1, THERMO)){
+			if(channel >= 1 && channel <= 12)
+				return plate->tmp->scale[channel - 1];
+		}else if(compareWith(plate->id, 1, DAQC)){
+			if(channel >= 0 && channel <= 7)
+				return plate->tmp->scale[channel];
+		}else if(compareWith(plate->id, 1, TINKER)){
+			if(channel >= 1 && channel <= 8)
+				return plate->tmp->scale[channel - 1];
+		}
+	}
+	return INVAL_CMD;
+}
+
+double getTEMP(struct piplate* plate, char channel){
+	if(plate->isValid){
+		if(!plate->tmp)
+			tempINIT(plate);
+
+		if(compareWith(plate->id, 1, THERMO)){
+			if(channel >= 1 && channel <= 12){
+				int Tvals[2];
+				char* resp = sendCMD(plate, 0x70, channel - 1, 0, 4);
+				double temp;
+
+				channel--;
+
+				if(!resp)
+					return INVAL_CMD;
+
+				Tvals[0] = resp[0] * 256 + resp[1];//T channel data
+				Tvals[1] = resp[2] * 256 + resp[3];//Cold junction data
+
+				if(channel > 7){
+					int t = Tvals[0];
+					if(t > 0x8000){//It's negative, take the 2's complement.
+						t = t^0xFFFF;
+						t = -(t + 1);
+					}
+					temp = t / 16.0;//Celsius
+				}else{
+					int i;
+					double a = -0.00347;
+					double b = -10.888;
+					double c = 1777.3;
 
 					double coldJunctionV = 0;
 					double vMeas;
 					double vHot;
 					int k = 1;
 
-					temp = Tvals[1] * 2400.0/65535.0;//Convert cold junction data to voltage
-					c -= temp;
-					temp = (-b-sqrt(pow(b, 2) - (4*a*c)))/(2 * a) + 30.0; //Convert voltage to temperature
+					temp = Tvals[1] * 2400.0/65535.0;//Convert cold junction data to voltage
+					c -= temp;
+					temp = (-b-sqrt(pow(b, 2) - (4*a*c)))/(2 * a) + 30.0; //Convert voltage to temperature
+
+					if(plate->tmp->type[channel] == 'k'){
+						for(i = 0; i < 10; i ++){
+							coldJunctionV += kVoltageCoefficients[i] * pow(temp, i);
+						}
+					}else{
+						for(i = 0; i < 9; i ++){
+							coldJunctionV += jVoltageCoefficients[i]*pow(temp, i);
+						}
+					}
+
+					vMeas=((Tvals[0]*2.4/65535.0)-plate->tmp->calOffset[channel])/plate->tmp->calScale[channel]*1000;
+
+					vHot=vMeas+coldJunctionV-(plate->tmp->calBias * 1000.0);
+
+					temp = 0;
+					if(plate->tmp->type[channel] == 'k'){
+						for(i = 0; i < 10; i++){
+							k = (vHot < 0) ? 0 : ((vHot > 20.644) ? 2 : 1);
+							temp += kThermoCoefficients[k][i]*pow(vHot, i);
+						}
+					}else{
+						for(i = 0; i < 10; i ++){
+							k = (vHot < 0) ? 0 : ((vHot > 42.919) ? 2 : 1);
+							temp += jThermoCoefficients[k][i]*pow(vHot, i);
+						}
+					}
+				}
+				if(plate->tmp->scale[channel] == KELVINS)
+					temp += 273.15;
+				else if(plate->tmp->scale[channel] == FAHRENHEIT)
+					temp = temp * 1.8 + 32.0;
+
+				temp = ((int) (temp * 1000)) / 1000.0;//Round
+				return stateIN(plate, STATE_TEMP, channel, temp);
+			}
+		}else if(compareWith(plate->id, 1, DAQC)){
+			if(channel >= 0 && channel <= 7){
+				double temp;
+				char* resp;
+
+				sendCMD(plate, 0x70, channel, 0, 0);
+				sleep(1);
+				resp = sendCMD(plate, 0x71, channel, 0, 2);
+
+				if(resp){
+					int t = resp[0] * 256 + resp[1];
+					if(t > 0x8000){
+						t = t^0xFFFF;
+						t = -(t + 1);
+					}
+					temp = (double)t;
+					if(plate->tmp->scale[channel] == KELVINS)
+						temp += 273.15;
+					if(plate->tmp->scale[channel] == FAHRENHEIT)
+						temp = temp * 1.8 + 32.0;
+
+					temp = ((int) (temp * 1000)) / 1000.0;
+					return stateIN(plate, STATE_TEMP, channel, temp);
+				}
+			}
+		}else if(compareWith(plate->id, 1, TINKER)){
+			if(channel >= 1 && channel <= 8){
+				char* resp = sendCMD(plate, 0x71, (--channel), 0, 2);
+
+				if(resp){
+					int t = resp[0]*256 + resp[1];
+					double temp;
+					if(t > 0x8000){
+						t = t^0xFFFF;
+						t = -(t+1);
+					}
+					temp = t / 16.0;
+					if(plate->tmp->scale[channel] == KELVINS)
+						temp += 273.15;
+					if(plate->tmp->scale[channel] == FAHRENHEIT)
+						temp = temp * 1.8 + 32.0;
+
+					temp = ((int)(10000*temp))/10000.0;
+					sleep(.05);//Throttle value
+					return stateIN(plate, STATE_TEMP, channel, temp);
+				}
+			}
+		}
+	}
+	return INVAL_CMD;
+}
+
+double getCOLD(struct piplate* plate, char scale){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, THERMO)){
+			if(scale == CELSIUS || scale == FAHRENHEIT || scale == KELVINS){
+				if(!plate->tmp)
+					tempINIT(plate);
+
+				int cjval = 0;
+				char* resp = sendCMD(plate, 0x70, 0, 0, 4);
+				double temp = 0;
+
+				if(resp){
+					double a = -0.00347;
+					double b = -10.888;
+					double c = 1777.3;
+
+					cjval = resp[2] * 256 + resp[3];
+					temp = cjval*2400.0/65535.0;
+					c -= temp;
+					temp = (-b-sqrt(pow(b, 2) - (4*a*c)))/(2*a) + 30.0;
+
+					if(scale == KELVINS)
+						temp += 273.15;
+					else if(scale == FAHRENHEIT)
+						temp = temp * 1.8 + 32.0;
+
+					temp = ((int) (temp * 1000)) / 1000.0;
+					return temp;
+				}
+			}
+		}
+	}
+	return INVAL_CMD;
+}
+
+double getRAW(struct piplate* plate, char channel){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, THERMO)){
+			if(channel >= 1 && channel <= 8){
+				channel--;
+				if(!plate->tmp)
+					tempINIT(plate);
+
+				int tVals[2] = {0, 0};
+				char* resp = sendCMD(plate, 0x70, channel, 0, 4);
+				double temp = 0;
+				double vMeas;
+				double vRaw;
+
+				if(resp){
+					tVals[0] = resp[0] * 256 + resp[1];
+					tVals[1] = resp[2] * 256 + resp[3];
+
+					vMeas = ((tVals[0] * 2.4 / 65535.0) - plate->tmp->calOffset[channel])/plate->tmp->calScale[channel]*1000;
+					vRaw = vMeas - (plate->tmp->calBias * 1000);
+
+					return vRaw;
+				}
+			}
+		}
+	}
+	return INVAL_CMD;
+}
+
+void setLINEFREQ(struct piplate* plate, char freq){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, THERMO)){
+			if(freq == 50 || freq == 60){
+				sendCMD(plate, 0x73, freq, 0, 0);
+			}
+		}
+	}
+}
+
+void setSMOOTH(struct piplate* plate){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, THERMO)){
+			sendCMD(plate, 0x74, 1, 0, 0);
+		}
+	}
+}
+
+void clrSMOOTH(struct piplate* plate){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, THERMO)){
+			sendCMD(plate, 0x74, 0, 0, 0);
+		}
+	}
+}
+
+/* End of thermo functions */
+
+void daqc2pINIT(struct piplate* plate){
+	int i, j, cSign;
+	char vals[6];
+	int prev = setBUSclass(BUS_BULK);
+
+	plate->daqc2p = (struct DAQC2CalParams*)plateALLOC(plate, SLOT_DAQC2P, 1, sizeof(struct DAQC2CalParams));
+	if(!plate->daqc2p){
+		setBUSclass(prev);
+		return;
+	}
+
+	for(i = 0; i < 8; i++){
+		for(j = 0; j < 6; j++){
+			vals[j] = CalGetByte(plate, 6*i+j);
+		}
+
+		//calScale
+		cSign = vals[0]&0x80;
+		plate->daqc2p->calScale[i] = 0.04*((vals[0]&0x7F)*256+vals[1])/32767.0;
+		if(cSign)
+			plate->daqc2p->calScale[i] *= -1;
+
+		plate->daqc2p->calScale[i]+=1;
+
+		//calOffset
+		cSign = vals[2]&0x80;
+		plate->daqc2p->calOffset[i] = 0.2*((vals[2]&0x7F)*256+vals[3])/32767.0;
+		if(cSign)
+			plate->daqc2p->calOffset[i] *= -1;
+
+		//calDAC
+		cSign = vals[4]&0x80;
+		plate->daqc2p->calDAC[i] = 0.04*((vals[4]&0x7F)*256+vals[5])/32767.0;
+		if(cSign)
+			plate->daqc2p->calDAC[i] *= -1;
+
+		plate->daqc2p->calDAC[i] += 1;
+	}
+	setBUSclass(prev);
+}
+
+/* Start of ADC functions */
+
+double getADC(struct piplate* plate, char channel){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, TINKER)){
+			if(channel >= 1 && channel <= 4){
+				char* resp = sendCMD(plate, 0x30, channel - 1, 0, 2);
+
+				if(resp){
+					double value = resp[0] * 256 + resp[1];
+
+					value = (value * 5.1 * 2.4/4095.0);
+					value = ((int)(value * 1000))/1000.0;
+					return stateIN(plate, STATE_ADC, channel - 1, value);
+				}
+			}
+		}else if(compareWith(plate->id, 1, DAQC)){
+			if(channel >= 0 && channel <= 8){
+				char* resp = sendCMD(plate, 0x30, channel, 0, 2);
+
+				if(resp){
+					double value = resp[0] * 256 + resp[1];
+
+					value = (value * 4.096/1024.0);
+					value = ((int)(value * 1000))/1000.0;
+
+					if(channel == 8)
+						value *= 2;
+
+					return stateIN(plate, STATE_ADC, channel, value);
+				}
+			}
+		}else if(compareWith(plate->id, 1, DAQC2)){
+			if(!plate->daqc2p)
+				daqc2pINIT(plate);
+
+			if(channel >= 0 && channel <= 8){
+				char* resp = sendCMD(plate, 0x30, channel, 0, 2);
+
+				if(resp){
+					double value = resp[0] * 256 + resp[1];
+					if(channel == 8){
+						value = value * 5.0*2.4/65536.0;
+					}else{
+						value = (value*24.0/65536.0)-12.0;
+						value = value * plate->daqc2p->calScale[channel] + plate->daqc2p->calOffset[channel];
+						value = ((int)(value*1000))/1000.0;
+					}
+					return stateIN(plate, STATE_ADC, channel, value);
+				}
+			}
+		}
+	}
+	return INVAL_CMD;
+}
+
+double* getADCall(struct piplate* plate){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, TINKER)){
+			char* resp = sendCMD(plate, 0x31, 0, 0, 8);
+
+			if(resp){
+				int i;
+				static double vals[4];
+
+				for(i = 0; i < 4; i++){
+					vals[i] = (256*resp[2*i]+resp[2*i+1]);
+					vals[i] = ((int)(vals[i]*1000))/1000.0;
+				}
+
+				stateINS(plate, STATE_ADC, vals, 4);
+				return vals;
+			}
+		}else if(compareWith(plate->id, 1, DAQC)){
+			int i;
+			static double vals[8];
+
+			stampOPEN();
+			for(i = 0; i < 8; i++){
+				char* resp = sendCMD(plate, 0x30, i, 0, 2);
+
+				if(resp){
+					vals[i] = resp[0]*256+resp[1];
+					vals[i] = vals[i] * 4.096 / 1024.0;
+					vals[i] = ((int)(vals[i]*1000))/1000.0;
+				}else{
+					stampCLOSE();
+					return NULL;
+				}
+			}
+			stampCLOSE();
+
+			stateINS(plate, STATE_ADC, vals, 8);
+			return vals;
+		}else if(compareWith(plate->id, 1, DAQC2)){
+			if(!plate->daqc2p)
+				daqc2pINIT(plate);
+
+			char* resp = sendCMD(plate, 0x31, 0, 0, 16);
+
+			if(resp){
+				int i;
+				static double vals[8];
+
+				for(i = 0; i < 8; i++){
+					vals[i] = resp[2*i]*256+resp[2*i+1];
+					vals[i] = vals[i]*24.0/65536.0 - 12.0;
+					vals[i] = vals[i]*plate->daqc2p->calScale[i] + plate->daqc2p->calOffset[i];
+					vals[i] = ((int)(vals[i]*1000))/1000.0;
+				}
+
+				stateINS(plate, STATE_ADC, vals, 8);
+				return vals;
+			}
+		}
+	}
+	return NULL;
+}
+/* End of ADC functions */
+
+/* Start of DAC functions */
+
+double getDAC(struct piplate* plate, char channel){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC)){
+			if(channel == 0 || channel == 1){
+				char* resp = sendCMD(plate, 0x40+channel+2, 0, 0, 2);
+				if(resp){
+					double value = resp[0] * 256 + resp[1];
+					double Vcc = getADC(plate, 8);
+					value = value * Vcc / 1023.0;
+					return value;
+				}
+			}
+		}else if(compareWith(plate->id, 1, DAQC2)){
+			if(channel >= 0 && channel <= 3){
+				char* resp = sendCMD(plate, 0x40+channel+4, 0, 0, 2);
+				if(resp){
+					double value = resp[0]*256+resp[1];
+					value=value/1000.0;
+					return value;
+				}
+			}
+		}
+	}
+	return INVAL_CMD;
+}
+
+void setDAC(struct piplate* plate, char channel, double value){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC)){
+			if(value >= 0 && value <= 4.095 && (channel == 0 || channel == 1)){
+				struct sampleStamp keep = lastStamp;//The Vcc read is not the caller's reading
+				double Vcc = getADC(plate, 8);
+				lastStamp = keep;
+				int v = (int)(value/Vcc * 1024);
+				char hibyte = v>>8;
+				char lobyte = v - (hibyte<<8);
+				sendCMD(plate, 0x40+channel, hibyte, lobyte, 0);
+				stateDAC(plate, channel, value);
+			}
+		}else if(compareWith(plate->id, 1, DAQC2)){
+			if(value >= 0 && value <= 4.095 && channel >= 0 && channel <= 3){
+				char hibyte;
+				char lobyte;
+				int v = (int)(value*plate->daqc2p->calDAC[channel]*1000);
+				if(v > 4095)
+					v=4095;
+
+				hibyte = v>>8;
+				lobyte = v - (hibyte<<8);
+				sendCMD(plate, 0x40+channel, hibyte, lobyte, 0);
+				stateDAC(plate, channel, value);
+			}
+		}
+	}
+}
+
+/* End of DAC functions */
+
+/* Start of PWM and FREQ commands */
+
+void setPWM(struct piplate* plate, char channel, int value){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, TINKER)){
+			if(channel >= 1 && channel <= 6 && value >= 0 && value <= 100){
+				int registerVal = (int) (value*1024.0/100.0 + 0.5);
+				char param1 = ((channel - 1) << 4)+(registerVal >> 8);
+				char param2 = registerVal & 0x00FF;
+				sendCMD(plate, 0xC0, param1, param2, 0);
+				statePWM(plate, channel - 1, value);
+			}
+		}else if(compareWith(plate->id, 1, DAQC)){
+			if(value <= 1023 && value >= 0 && channel >= 0 && channel <= 1){
+				char hibyte = value>>8;
+				char lobyte = value - (hibyte<<8);
+				sendCMD(plate, 0x40+channel, hibyte, lobyte, 0);
+				statePWM(plate, channel, value);
+			}
+		}else if(compareWith(plate->id, 1, DAQC2)){
+			if(!plate->daqc2p)
+				daqc2pINIT(plate);
+
+			if(value >= 0 && value <= 100 && channel >= 0 && channel <= 1){
+				int registerVal = (int) (value*1023.0/100.0 + 0.5);
+				char param1 = (channel << 7) + (registerVal>>8);
+				char param2 = registerVal&0xFF;
+				sendCMD(plate, 0xC1, param1, param2, 0);
+				plate->daqc2p->pwm[channel] = value;
+				statePWM(plate, channel, value);
+			}
+		}
+	}
+}
 
-					if(plate->tmp->type[channel] == 'k'){
-						for(i = 0; i < 10; i ++){
-							coldJunctionV += kVoltageCoefficients[i] * pow(temp, i);
-						}
-					}else{
-						for(i = 0; i < 9; i ++){
-							coldJunctionV += jVoltageCoefficients[i]*pow(temp, i);
-						}
-					}
+int getPWM(struct piplate* plate, char channel){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC)){
+			if(channel >= 0 && channel <= 1){
+				char* resp = sendCMD(plate, 0x40+channel+2, 0, 0, 2);
 
-					vMeas=((Tvals[0]*2.4/65535.0)-plate->tmp->calOffset[channel])/plate->tmp->calScale[channel]*1000;
+				if(resp)
+					return (resp[0] * 256 + resp[1]);
+			}
+		}else if(compareWith(plate->id, 1, DAQC2)){
+			if(!plate->daqc2p)
+				daqc2pINIT(plate);
 
-					vHot=vMeas+coldJunctionV-(plate->tmp->calBias * 1000.0);
+			if(channel >= 0 && channel <= 1){
+				return plate->daqc2p->pwm[channel];
+			}
+		}
+	}
+	return INVAL_CMD;
+}
 
-					temp = 0;
-					if(plate->tmp->type[channel] == 'k'){
-						for(i = 0; i < 10; i++){
-							k = (vHot < 0) ? 0 : ((vHot > 20.644) ? 2 : 1);
-							temp += kThermoCoefficients[k][i]*pow(vHot, i);
-						}
-					}else{
-						for(i = 0; i < 10; i ++){
-							k = (vHot < 0) ? 0 : ((vHot > 42.919) ? 2 : 1);
-							temp += jThermoCoefficients[k][i]*pow(vHot, i);
-						}
-					}
-				}
-				if(plate->tmp->scale[channel] == KELVINS)
-					temp += 273.15;
-				else if(plate->tmp->scale[channel] == FAHRENHEIT)
-					temp = temp * 1.8 + 32.0;
+//Reads the 32 bit period count. Both halves are fetched back to back under the bus lock.
+static int readFREQcounts(struct piplate* plate, int* counts){
+	unsigned char hi[2];
+	unsigned char* resp;
+	int ok = 0;
+
+	busLOCK(plateSTACK(plate));
+	stampOPEN();
+	resp = (unsigned char*)sendCMD(plate, 0xC0, 0, 0, 2);//First 2 bytes
+	if(resp){
+		hi[0] = resp[0];
+		hi[1] = resp[1];
+		resp = (unsigned char*)sendCMD(plate, 0xC0, 0, 0, 2);//Lower 2 bytes
+		if(resp){
+			*counts = (int)(((unsigned)hi[0]<<24) + (hi[1]<<16) + (resp[0]<<8) + resp[1]);
+			ok = 1;
+		}
+	}
+	stampCLOSE();
+	busUNLOCK(plateSTACK(plate));
 
-				temp = ((int) (temp * 1000)) / 1000.0;//Round
-				return temp;
+	return ok;
+}
+
+double getFREQ(struct piplate* plate){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC2)){
+			double freq = 0;
+			int counts;
+
+			if(readFREQcounts(plate, &counts)){
+				if(counts > 0)
+					freq = 6000000.0/counts;
+
+				return stateIN(plate, STATE_FREQ, 0, ((int)(freq*100))/100.0);
 			}
-		}else if(compareWith(plate->id, 1, DAQC)){
-			if(channel >= 0 && channel <= 7){
-				double temp;
-				char* resp;
+		}
+	}
+	return INVAL_CMD;
+}
 
-				sendCMD(plate, 0x70, channel, 0, 0);
-				sleep(1);
-				resp = sendCMD(plate, 0x71, channel, 0, 2);
+struct freqMonitor {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	bool running;
+	long long period;//ns, over a second below 1 Hz so a 32-bit long will not do
+	int window;
+	char filter;
+	double samples[FREQ_WINDOW_MAX];
+	int head;
+	int fill;
+	double value;
+	struct timespec stamp;//CLOCK_MONOTONIC time of the last valid reading
+	struct sampleStamp sample;//Its transaction
+	long reads;
+	long invalid;
+};
+
+static double freqFILTER(struct freqMonitor* mon){
+	double sorted[FREQ_WINDOW_MAX];
+	double sum = 0;
+	int i, j;
+
+	if(mon->filter != FREQ_MEDIAN){
+		for(i = 0; i < mon->fill; i++)
+			sum += mon->samples[i];
+		return sum / mon->fill;
+	}
 
-				if(resp){
-					int t = resp[0] * 256 + resp[1];
-					if(t > 0x8000){
-						t = t^0xFFFF;
-						t = -(t + 1);
-					}
-					temp = (double)t;
-					if(plate->tmp->scale[channel] == KELVINS)
-						temp += 273.15;
-					if(plate->tmp->scale[channel] == FAHRENHEIT)
-						temp = temp * 1.8 + 32.0;
+	for(i = 0; i < mon->fill; i++){//Insertion sort, the window is small
+		double v = mon->samples[i];
+		for(j = i; j > 0 && sorted[j - 1] > v; j--)
+			sorted[j] = sorted[j - 1];
+		sorted[j] = v;
+	}
+	if(mon->fill & 1)
+		return sorted[mon->fill/2];
+	return (sorted[mon->fill/2 - 1] + sorted[mon->fill/2]) / 2;
+}
 
-					temp = ((int) (temp * 1000)) / 1000.0;
-					return temp;
+static void* freqMONthread(void* arg){
+	struct piplate* plate = (struct piplate*)arg;
+	struct freqMonitor* mon = plate->fmon;
+	struct timespec next;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while(__atomic_load_n(&mon->running, __ATOMIC_ACQUIRE)){
+		int counts;
+		bool ok = readFREQcounts(plate, &counts);
+
+		pthread_mutex_lock(&mon->lock);
+		mon->reads++;
+		if(!ok || counts <= 0){
+			mon->invalid++;
+		}else{
+			mon->samples[mon->head] = 6000000.0/counts;
+			mon->head = (mon->head + 1) % mon->window;
+			if(mon->fill < mon->window)
+				mon->fill++;
+			mon->value = freqFILTER(mon);
+			mon->sample = lastStamp;
+			clock_gettime(CLOCK_MONOTONIC, &mon->stamp);
+		}
+		pthread_mutex_unlock(&mon->lock);
+
+		tsADD(&next, mon->period);
+		wakeSLEEP(&mon->lock, &mon->wake, &mon->running, &next);
+	}
+	return NULL;
+}
+
+int freqMONstart(struct piplate* plate, double rate, int window, char filter){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC2)){
+			if(!plate->fmon && rate >= RATE_MIN && rate <= 1000 && window >= 1 && window <= FREQ_WINDOW_MAX && (filter == FREQ_AVERAGE || filter == FREQ_MEDIAN)){
+				struct freqMonitor* mon = (struct freqMonitor*)plateALLOC(plate, SLOT_FMON, 1, sizeof(struct freqMonitor));
+
+				if(!mon)
+					return INVAL_CMD;
+				pthread_mutex_init(&mon->lock, NULL);
+				wakeINIT(&mon->wake);
+				mon->period = (long long)(1e9/rate);
+				mon->window = window;
+				mon->filter = filter;
+				mon->running = 1;
+				plate->fmon = mon;
+
+				if(pthread_create(&mon->thread, NULL, freqMONthread, plate)){
+					plate->fmon = NULL;
+					pthread_cond_destroy(&mon->wake);
+					pthread_mutex_destroy(&mon->lock);
+					plateFREE(plate, mon);
+					return INVAL_CMD;
 				}
+				return 0;
 			}
-		}else if(compareWith(plate->id, 1, TINKER)){
-			if(channel >= 1 && channel <= 8){
-				char* resp = sendCMD(plate, 0x71, (--channel), 0, 2);
+		}
+	}
+	return INVAL_CMD;
+}
 
-				if(resp){
-					int t = resp[0]*256 + resp[1];
-					double temp;
-					if(t > 0x8000){
-						t = t^0xFFFF;
-						t = -(t+1);
-					}
-					temp = t / 16.0;
-					if(plate->tmp->scale[channel] == KELVINS)
-						temp += 273.15;
-					if(plate->tmp->scale[channel] == FAHRENHEIT)
-						temp = temp * 1.8 + 32.0;
+void freqMONstop(struct piplate* plate){
+	if(plate->fmon){
+		struct freqMonitor* mon = plate->fmon;
 
-					temp = ((int)(10000*temp))/10000.0;
-					sleep(.05);//Throttle value
-					return temp;
-				}
+		wakeSTOP(&mon->lock, &mon->wake, &mon->running);
+		pthread_join(mon->thread, NULL);
+		plate->fmon = NULL;
+		pthread_cond_destroy(&mon->wake);
+		pthread_mutex_destroy(&mon->lock);
+		plateFREE(plate, mon);
+	}
+}
+
+//Latest filtered frequency without touching the bus. age gets the seconds since that reading, getSTAMP its transaction.
+double freqMONget(struct piplate* plate, double* age){
+	double value = INVAL_CMD;
+
+	if(plate->fmon){
+		struct freqMonitor* mon = plate->fmon;
+
+		pthread_mutex_lock(&mon->lock);
+		if(mon->fill){
+			value = mon->value;
+			lastStamp = mon->sample;
+			if(age){
+				struct timespec now;
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				*age = (now.tv_sec - mon->stamp.tv_sec) + (now.tv_nsec - mon->stamp.tv_nsec)*1e-9;
+			}
+		}
+		pthread_mutex_unlock(&mon->lock);
+	}
+	return value;
+}
+
+long freqMONinvalid(struct piplate* plate){
+	long n = INVAL_CMD;
+
+	if(plate->fmon){
+		pthread_mutex_lock(&plate->fmon->lock);
+		n = plate->fmon->invalid;
+		pthread_mutex_unlock(&plate->fmon->lock);
+	}
+	return n;
+}
+
+/* End of PWM and FREQ commands */
+
+/* Start of Function Generator commands */
+
+void fgON(struct piplate* plate, char chan){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC2)){
+			if(chan >= 1 && chan <= 4){
+				sendCMD(plate, 0x91, chan - 1, 0, 0);
+			}
+		}
+	}
+}
+
+void fgOFF(struct piplate* plate, char chan){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC2)){
+			if(chan >= 1 && chan <= 4){
+				sendCMD(plate, 0x90, chan - 1, 0, 0);
+			}
+		}
+	}
+}
+
+void fgFREQ(struct piplate* plate, char chan, int freq){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC2)){
+			if(chan >= 1 && chan <= 4 && freq >= 10 && freq <= 20000){
+				int phase_add = (int)(freq*65536.0/100000.0 + 0.5);
+				sendCMD(plate, 0x92 + chan - 1, phase_add>>8, phase_add&0xFF, 0);
+			}
+		}
+	}
+}
+
+void fgTYPE(struct piplate* plate, char chan, char type){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC2)){
+			if(chan >= 1 && chan <= 4 && type >= 1 && type <= 7){
+				sendCMD(plate, 0x96, chan-1, type-1, 0);
+			}
+		}
+	}
+}
+
+void fgLEVEL(struct piplate* plate, char chan, char level){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC2)){
+			if(chan >= 1 && chan <= 4 && level >= 1 && level <= 4){
+				sendCMD(plate, 0x97, chan-1, level, 0);
 			}
 		}
 	}
+}
+
+/* End of Function Generator commands */
+
+/* Start of DAQC switch commands */
+
+bool getSWstate(struct piplate* plate){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC)){
+			return safeExtract(sendCMD(plate, 0x50, 0, 0, 1));
+		}
+	}
+	return INVAL_CMD;
+}
+
+void enableSWint(struct piplate* plate){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC)){
+			sendCMD(plate, 0x51, 0, 0, 0);
+		}
+	}
+}
+
+void disableSWint(struct piplate* plate){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC)){
+			sendCMD(plate, 0x52, 0, 0, 0);
+		}
+	}
+}
+
+void enableSWpower(struct piplate* plate){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC)){
+			sendCMD(plate, 0x53, 0, 0, 0);
+		}
+	}
+}
+
+void disableSWpower(struct piplate* plate){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, DAQC)){
+			sendCMD(plate, 0x54, 0, 0, 0);
+		}
+	}
+}
+
+/* End of DAQC switch commands */
+
+/* Start of motor sensor commands */
+
+char getSENSORS(struct piplate* plate){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, MOTOR)){
+			return safeExtract(sendCMD(plate, 0x20, 0, 0, 1));
+		}
+	}
 	return INVAL_CMD;
 }
 
-double getCOLD(struct piplate* plate, char scale){
+int getTACHcoarse(struct piplate* plate, char tachnum){
 	if(plate->isValid){
-		if(compareWith(plate->id, 1, THERMO)){
-			if(scale == CELSIUS || scale == FAHRENHEIT || scale == KELVINS){
-				if(!plate->tmp)
-					tempINIT(plate);
-
-				int cjval = 0;
-				char* resp = sendCMD(plate, 0x70, 0, 0, 4);
-				double temp = 0;
+		if(compareWith(plate->id, 1, MOTOR)){
+			if(tachnum >= 1 && tachnum <= 4){
+				unsigned char* resp = (unsigned char*)sendCMD(plate, 0x22, tachnum, 0, 2);
 
 				if(resp){
-					double a = -0.00347;
-					double b = -10.888;
-					double c = 1777.3;
-
-					cjval = resp[2] * 256 + resp[3];
-					temp = cjval*2400.0/65535.0;
-					c -= temp;
-					temp = (-b-sqrt(pow(b, 2) - (4*a*c)))/(2*a) + 30.0;
-
-					if(scale == KELVINS)
-						temp += 273.15;
-					else if(scale == FAHRENHEIT)
-						temp = temp * 1.8 + 32.0;
-
-					temp = ((int) (temp * 1000)) / 1000.0;
-					return temp;
+					return (int)stateIN(plate, STATE_TACH, tachnum - 1, resp[0]*256 + resp[1]);
 				}
 			}
 		}
@@ -1337,28 +5816,14 @@ double getCOLD(struct piplate* plate, char scale){
 	return INVAL_CMD;
 }
 
-double getRAW(struct piplate* plate, char channel){
+int getTACHfine(struct piplate* plate, char tachnum){
 	if(plate->isValid){
-		if(compareWith(plate->id, 1, THERMO)){
-			if(channel >= 1 && channel <= 8){
-				channel--;
-				if(!plate->tmp)
-					tempINIT(plate);
-
-				int tVals[2] = {0, 0};
-				char* resp = sendCMD(plate, 0x70, channel, 0, 4);
-				double temp = 0;
-				double vMeas;
-				double vRaw;
+		if(compareWith(plate->id, 1, MOTOR)){
+			if(tachnum >= 1 && tachnum <= 4){
+				unsigned char* resp = (unsigned char*)sendCMD(plate, 0x23, tachnum, 0, 2);
 
 				if(resp){
-					tVals[0] = resp[0] * 256 + resp[1];
-					tVals[1] = resp[2] * 256 + resp[3];
-
-					vMeas = ((tVals[0] * 2.4 / 65535.0) - plate->tmp->calOffset[channel])/plate->tmp->calScale[channel]*1000;
-					vRaw = vMeas - (plate->tmp->calBias * 1000);
-
-					return vRaw;
+					return (int)stateIN(plate, STATE_TACH, tachnum - 1, resp[0]*256 + resp[1]);
 				}
 			}
 		}
@@ -1366,672 +5831,1534 @@ double getRAW(struct piplate* plate, char channel){
 	return INVAL_CMD;
 }
 
-void setLINEFREQ(struct piplate* plate, char freq){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, THERMO)){
-			if(freq == 50 || freq == 60){
-				sendCMD(plate, 0x73, freq, 0, 0);
-			}
-		}
+/* End of motor sensor commands */
+
+/* Start of servo commands */
+
+//Rebuilds the clockStart table for the current servoLow/servoHigh.
+static void servoTABLE(struct servoParams* sp){
+	int i;
+
+	for(i = 0; i < SERVO_STEPS; i++){
+		double angle = i/10.0;
+		double clockDec = 1e-3*(sp->servoLow + (sp->servoHigh - sp->servoLow)*(180-angle)/180.0);
+		clockDec = (int)((clockDec*49e6)/12.0);
+		sp->clock[i] = 65536-clockDec;
 	}
 }
 
-void setSMOOTH(struct piplate* plate){
+void servoINIT(struct piplate* plate){
+	int i;
+
+	plate->servo = (struct servoParams*)plateALLOC(plate, SLOT_SERVO, 1, sizeof(struct servoParams));
+	if(!plate->servo)
+		return;
+
+	plate->servo->servoLow = 0.6;
+	plate->servo->servoHigh = 2.35;
+	for(i = 0; i < 8; i++)
+		plate->servo->angle[i] = -1;
+	servoTABLE(plate->servo);
+}
+
+//Sends a servo's clock value unless the plate already has it.
+static bool servoWRITE(struct piplate* plate, int servo, int clockStart){
+	struct servoParams* sp = plate->servo;
+
+	if((sp->sentMask & (1 << servo)) && sp->sent[servo] == clockStart)
+		return 0;
+
+	sendCMD(plate, 0x50+servo, (clockStart>>8), (clockStart&0xFF), 0);
+	sp->sent[servo] = clockStart;
+	sp->sentMask |= (1 << servo);
+	return 1;
+}
+
+void setSERVO(struct piplate* plate, char servo, double angle){
 	if(plate->isValid){
-		if(compareWith(plate->id, 1, THERMO)){
-			sendCMD(plate, 0x74, 1, 0, 0);
+		if(compareWith(plate->id, 1, TINKER)){
+			if(!plate->servo)
+				servoINIT(plate);
+
+			if(servo >= 1 && servo <= 8 && angle >= 0 && angle <= 180){
+				double clockDec;
+				int clockStart;
+
+				servo--;
+				clockDec = 1e-3*(plate->servo->servoLow + (plate->servo->servoHigh - plate->servo->servoLow)*(180-angle)/180.0);
+				clockDec = (int)((clockDec*49e6)/12.0);
+				clockStart = 65536-clockDec;
+				plate->servo->angle[(int)servo] = angle;
+				plate->servo->sentMask &= ~(1 << servo);//Always send on an explicit call
+				servoWRITE(plate, servo, clockStart);
+				stateSERVO(plate);
+			}
 		}
 	}
 }
 
-void clrSMOOTH(struct piplate* plate){
+void setSERVO2(struct piplate* plate, char servo, double pw){
 	if(plate->isValid){
-		if(compareWith(plate->id, 1, THERMO)){
-			sendCMD(plate, 0x74, 0, 0, 0);
+		if(compareWith(plate->id, 1, TINKER)){
+			if(!plate->servo)
+				servoINIT(plate);
+
+			if(servo >= 1 && servo <= 8){
+				double clockDec;
+				int clockStart;
+				if(pw > 2.45)
+					pw = 2.45;
+				if(pw < 0.5)
+					pw = 0.5;
+				servo--;
+
+				clockDec=1e-3*pw;
+				clockDec=(int)((clockDec*49e6)/12.0);
+				clockStart = 65536-clockDec;
+				plate->servo->angle[(int)servo] = -1;
+				plate->servo->sentMask &= ~(1 << servo);
+				servoWRITE(plate, servo, clockStart);
+				stateSERVO(plate);
+			}
 		}
 	}
 }
 
-/* End of thermo functions */
-
-void daqc2pINIT(struct piplate* plate){
-	int i, j, cSign;
-	char vals[6];
+void setSERVOlow(struct piplate* plate, double value){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, TINKER)){
+			if(!plate->servo)
+				servoINIT(plate);
 
-	plate->daqc2p = (struct DAQC2CalParams*)calloc(1, sizeof(struct DAQC2CalParams));
+			if(value > 2.45)
+				value = 2.45;
+			if(value < 0.5)
+				value = 0.5;
 
-	for(i = 0; i < 8; i++){
-		for(j = 0; j < 6; j++){
-			vals[j] = CalGetByte(plate, 6*i+j);
+			plate->servo->servoLow = value;
+			servoTABLE(plate->servo);
 		}
+	}
+}
 
-		//calScale
-		cSign = vals[0]&0x80;
-		plate->daqc2p->calScale[i] = 0.04*((vals[0]&0x7F)*256+vals[1])/32767.0;
-		if(cSign)
-			plate->daqc2p->calScale[i] *= -1;
-
-		plate->daqc2p->calScale[i]+=1;
-
-		//calOffset
-		cSign = vals[2]&0x80;
-		plate->daqc2p->calOffset[i] = 0.2*((vals[2]&0x7F)*256+vals[3])/32767.0;
-		if(cSign)
-			plate->daqc2p->calOffset[i] *= -1;
+void setSERVOhigh(struct piplate* plate, double value){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, TINKER)){
+			if(!plate->servo)
+				servoINIT(plate);
 
-		//calDAC
-		cSign = vals[4]&0x80;
-		plate->daqc2p->calDAC[i] = 0.04*((vals[4]&0x7F)*256+vals[5])/32767.0;
-		if(cSign)
-			plate->daqc2p->calDAC[i] *= -1;
+			if(value > 2.45)
+				value = 2.45;
+			if(value < 0.5)
+				value = 0.5;
 
-		plate->daqc2p->calDAC[i] += 1;
+			plate->servo->servoHigh = value;
+			servoTABLE(plate->servo);
+		}
 	}
 }
 
-/* Start of ADC functions */
+/*
+* Writes a whole frame: angles[0..7] for servos 1-8, a negative angle leaves
+* that servo alone. Values come from the 0.1 degree table and channels whose
+* clock value did not change are skipped. Returns the number of servos written.
+*/
 
-double getADC(struct piplate* plate, char channel){
+int setSERVOall(struct piplate* plate, const double* angles){
 	if(plate->isValid){
 		if(compareWith(plate->id, 1, TINKER)){
-			if(channel >= 1 && channel <= 4){
-				char* resp = sendCMD(plate, 0x30, channel - 1, 0, 2);
+			int sent = 0;
+			int i;
 
-				if(resp){
-					double value = resp[0] * 256 + resp[1];
+			if(!plate->servo)
+				servoINIT(plate);
+			if(!angles)
+				return INVAL_CMD;
 
-					value = (value * 5.1 * 2.4/4095.0);
-					value = ((int)(value * 1000))/1000.0;
-					return value;
+			busLOCK(plateSTACK(plate));
+			for(i = 0; i < 8; i++){
+				if(angles[i] >= 0 && angles[i] <= 180){
+					plate->servo->angle[i] = angles[i];
+					sent += servoWRITE(plate, i, plate->servo->clock[(int)(angles[i]*10 + 0.5)]);
 				}
 			}
-		}else if(compareWith(plate->id, 1, DAQC)){
-			if(channel >= 0 && channel <= 8){
-				char* resp = sendCMD(plate, 0x30, channel, 0, 2);
+			busUNLOCK(plateSTACK(plate));
+			stateSERVO(plate);
+			return sent;
+		}
+	}
+	return INVAL_CMD;
+}
 
-				if(resp){
-					double value = resp[0] * 256 + resp[1];
+struct servoMotion {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	bool running;
+	long long period;//ns per frame
+	unsigned char active;//Bit per servo being moved
+	double from[8];
+	double to[8];
+	double duration[8];//Seconds
+	struct timespec t0[8];
+	long frames;
+	long writes;
+};
+
+static void* servoTHREAD(void* arg){
+	struct piplate* plate = (struct piplate*)arg;
+	struct servoMotion* mo = plate->servo->motion;
+	struct timespec next, now;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while(__atomic_load_n(&mo->running, __ATOMIC_ACQUIRE)){
+		double frame[8];
+		int i, n;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		pthread_mutex_lock(&mo->lock);
+		for(i = 0; i < 8; i++){
+			frame[i] = -1;
+			if(mo->active & (1 << i)){
+				double f = (mo->duration[i] > 0 ? tsDIFF(&now, &mo->t0[i])*1e-9/mo->duration[i] : 1);
+				if(f >= 1){
+					f = 1;
+					mo->active &= ~(1 << i);
+				}
+				frame[i] = mo->from[i] + (mo->to[i] - mo->from[i])*f;
+			}
+		}
+		pthread_mutex_unlock(&mo->lock);
 
-					value = (value * 4.096/1024.0);
-					value = ((int)(value * 1000))/1000.0;
+		n = setSERVOall(plate, frame);
 
-					if(channel == 8)
-						value *= 2;
+		pthread_mutex_lock(&mo->lock);
+		mo->frames++;
+		mo->writes += (n > 0 ? n : 0);
+		pthread_mutex_unlock(&mo->lock);
 
-					return value;
-				}
-			}
-		}else if(compareWith(plate->id, 1, DAQC2)){
-			if(!plate->daqc2p)
-				daqc2pINIT(plate);
+		tsADD(&next, mo->period);
+		wakeSLEEP(&mo->lock, &mo->wake, &mo->running, &next);
+	}
+	return NULL;
+}
 
-			if(channel >= 0 && channel <= 8){
-				char* resp = sendCMD(plate, 0x30, channel, 0, 2);
+int servoMOTIONstart(struct piplate* plate, double fps){
+	if(plate->isValid){
+		if(compareWith(plate->id, 1, TINKER)){
+			struct servoMotion* mo;
 
-				if(resp){
-					double value = resp[0] * 256 + resp[1];
-					if(channel == 8){
-						value = value * 5.0*2.4/65536.0;
-					}else{
-						value = (value*24.0/65536.0)-12.0;
-						value = value * plate->daqc2p->calScale[channel] + plate->daqc2p->calOffset[channel];
-						value = ((int)(value*1000))/1000.0;
-					}
-					return value;
-				}
+			if(!plate->servo)
+				servoINIT(plate);
+			if(!plate->servo || plate->servo->motion || fps < RATE_MIN || fps > 500)
+				return INVAL_CMD;
+
+			mo = (struct servoMotion*)plateALLOC(plate, SLOT_MOTION, 1, sizeof(struct servoMotion));
+			if(!mo)
+				return INVAL_CMD;
+			pthread_mutex_init(&mo->lock, NULL);
+			wakeINIT(&mo->wake);
+			mo->period = (long long)(1e9/fps);
+			mo->running = 1;
+			plate->servo->motion = mo;
+
+			if(pthread_create(&mo->thread, NULL, servoTHREAD, plate)){
+				plate->servo->motion = NULL;
+				pthread_cond_destroy(&mo->wake);
+				pthread_mutex_destroy(&mo->lock);
+				plateFREE(plate, mo);
+				return INVAL_CMD;
 			}
+			return 0;
 		}
 	}
 	return INVAL_CMD;
 }
 
-double* getADCall(struct piplate* plate){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, TINKER)){
-			char* resp = sendCMD(plate, 0x31, 0, 0, 8);
+void servoMOTIONstop(struct piplate* plate){
+	if(plate->servo && plate->servo->motion){
+		struct servoMotion* mo = plate->servo->motion;
 
-			if(resp){
-				int i;
-				static double vals[4];
+		wakeSTOP(&mo->lock, &mo->wake, &mo->running);
+		pthread_join(mo->thread, NULL);
+		plate->servo->motion = NULL;
+		pthread_cond_destroy(&mo->wake);
+		pthread_mutex_destroy(&mo->lock);
+		plateFREE(plate, mo);
+	}
+}
 
-				for(i = 0; i < 4; i++){
-					vals[i] = (256*resp[2*i]+resp[2*i+1]);
-					vals[i] = ((int)(vals[i]*1000))/1000.0;
-				}
+//Moves a servo to angle over seconds, interpolated by the motion thread.
+void servoMOVE(struct piplate* plate, char servo, double angle, double seconds){
+	if(plate->servo && plate->servo->motion && servo >= 1 && servo <= 8 && angle >= 0 && angle <= 180 && seconds >= 0){
+		struct servoMotion* mo = plate->servo->motion;
+		int i = servo - 1;
+
+		pthread_mutex_lock(&mo->lock);
+		if(mo->active & (1 << i)){//Start from wherever the running move has got to
+			struct timespec now;
+			double f;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			f = (mo->duration[i] > 0 ? tsDIFF(&now, &mo->t0[i])*1e-9/mo->duration[i] : 1);
+			mo->from[i] = mo->from[i] + (mo->to[i] - mo->from[i])*(f > 1 ? 1 : f);
+		}else{
+			mo->from[i] = (plate->servo->angle[i] >= 0 ? plate->servo->angle[i] : angle);
+		}
+		mo->to[i] = angle;
+		mo->duration[i] = seconds;
+		clock_gettime(CLOCK_MONOTONIC, &mo->t0[i]);
+		mo->active |= (1 << i);
+		pthread_mutex_unlock(&mo->lock);
+	}
+}
+
+bool servoMOVING(struct piplate* plate){
+	bool moving = 0;
+
+	if(plate->servo && plate->servo->motion){
+		pthread_mutex_lock(&plate->servo->motion->lock);
+		moving = plate->servo->motion->active != 0;
+		pthread_mutex_unlock(&plate->servo->motion->lock);
+	}
+	return moving;
+}
+
+/* End of servo commands */
+
+/* Start of miscellaneous commands */
+
+double changeUnits(double value, char units){
+	if(units == CM)
+		value /= 58.326;
+	if(units == IN)
+		value /= 148.148;
 
-				return vals;
-			}
-		}else if(compareWith(plate->id, 1, DAQC)){
-			int i;
-			static double vals[8];
+	value = ((int)(100*value))/100.0;
+	return value;
+}
 
-			for(i = 0; i < 8; i++){
-				char* resp = sendCMD(plate, 0x30, i, 0, 2);
+static int rangeCHANNELS(struct piplate* plate){
+	return compareWith(plate->id, 1, DAQC) ? 7 : 4;
+}
 
-				if(resp){
-					vals[i] = resp[0]*256+resp[1];
-					vals[i] = vals[i] * 4.096 / 1024.0;
-					vals[i] = ((int)(vals[i]*1000))/1000.0;
-				}else{
-					return NULL;
-				}
-			}
+//Channel index from getRANGE numbering: DAQC 0-6, TINKER sensor pairs 12, 34, 56 and 78.
+static int rangeINDEX(struct piplate* plate, char channel){
+	if(compareWith(plate->id, 1, TINKER)){
+		if(channel == 12 || channel == 34 || channel == 56 || channel == 78)
+			return (channel>>1)/10;
+	}else if(compareWith(plate->id, 1, DAQC)){
+		if(channel >= 0 && channel <= 6)
+			return channel;
+	}
+	return INVAL_CMD;
+}
 
-			return vals;
-		}else if(compareWith(plate->id, 1, DAQC2)){
-			if(!plate->daqc2p)
-				daqc2pINIT(plate);
+//A zero reading means the sensor did not answer, it is counted against the channel.
+static double rangeVALUE(struct piplate* plate, int index, unsigned char* resp, char units){
+	int r;
 
-			char* resp = sendCMD(plate, 0x31, 0, 0, 16);
+	if(!resp)
+		return INVAL_CMD;
+	r = resp[0]*256 + resp[1];
+	if(r == 0){
+		__atomic_add_fetch(&plateHEALTH(plate)->rangeFails[index], 1, __ATOMIC_RELAXED);
+		return INVAL_CMD;
+	}
+	if(compareWith(plate->id, 1, TINKER))
+		return changeUnits((r<<1)*12.0/49.0, units);
+	return changeUnits(r, units);
+}
 
-			if(resp){
-				int i;
-				static double vals[8];
+double getRANGE(struct piplate* plate, char channel, char units){
+	if(plate->isValid && (units == CM || units == IN)){
+		int i = rangeINDEX(plate, channel);
 
-				for(i = 0; i < 8; i++){
-					vals[i] = resp[2*i]*256+resp[2*i+1];
-					vals[i] = vals[i]*24.0/65536.0 - 12.0;
-					vals[i] = vals[i]*plate->daqc2p->calScale[i] + plate->daqc2p->calOffset[i];
-					vals[i] = ((int)(vals[i]*1000))/1000.0;
-				}
+		if(i >= 0){
+			if(compareWith(plate->id, 1, DAQC)){
+				struct timespec echo = {0, RANGE_ECHO};
 
-				return vals;
+				sendCMD(plate, 0x80, i, 0, 0);//Initate measurement
+				nanosleep(&echo, NULL);
 			}
+			return rangeVALUE(plate, i, (unsigned char*)sendCMD(plate, 0x81, i, 0, 2), units);
 		}
 	}
-	return NULL;
+	return INVAL_CMD;
 }
-/* End of ADC functions */
 
-/* Start of DAC functions */
+double getRANGEfast(struct piplate* plate, char channel, char units){
+	if(plate->isValid && compareWith(plate->id, 1, TINKER) && (units == CM || units == IN)){
+		int i = rangeINDEX(plate, channel);
 
-double getDAC(struct piplate* plate, char channel){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, DAQC)){
-			if(channel == 0 || channel == 1){
-				char* resp = sendCMD(plate, 0x40+channel+2, 0, 0, 2);
-				if(resp){
-					double value = resp[0] * 256 + resp[1];
-					double Vcc = getADC(plate, 8);
-					value = value * Vcc / 1023.0;
-					return value;
-				}
-			}
-		}else if(compareWith(plate->id, 1, DAQC2)){
-			if(channel >= 0 && channel <= 3){
-				char* resp = sendCMD(plate, 0x40+channel+4, 0, 0, 2);
-				if(resp){
-					double value = resp[0]*256+resp[1];
-					value=value/1000.0;
-					return value;
-				}
-			}
-		}
+		if(i >= 0)
+			return rangeVALUE(plate, i, (unsigned char*)sendCMD(plate, 0x82, i, 0, 2), units);
 	}
 	return INVAL_CMD;
 }
 
-void setDAC(struct piplate* plate, char channel, double value){
+long getRANGEfails(struct piplate* plate, char channel){
 	if(plate->isValid){
-		if(compareWith(plate->id, 1, DAQC)){
-			if(value >= 0 && value <= 4.095 && (channel == 0 || channel == 1)){
-				double Vcc = getADC(plate, 8);
-				int v = (int)(value/Vcc * 1024);
-				char hibyte = v>>8;
-				char lobyte = v - (hibyte<<8);
-				sendCMD(plate, 0x40+channel, hibyte, lobyte, 0);
-			}
-		}else if(compareWith(plate->id, 1, DAQC2)){
-			if(value >= 0 && value <= 4.095 && channel >= 0 && channel <= 3){
-				char hibyte;
-				char lobyte;
-				int v = (int)(value*plate->daqc2p->calDAC[channel]*1000);
-				if(v > 4095)
-					v=4095;
+		int i = rangeINDEX(plate, channel);
 
-				hibyte = v>>8;
-				lobyte = v - (hibyte<<8);
-				sendCMD(plate, 0x40+channel, hibyte, lobyte, 0);
-			}
-		}
+		if(i >= 0)
+			return __atomic_load_n(&plateHEALTH(plate)->rangeFails[i], __ATOMIC_RELAXED);
 	}
+	return INVAL_CMD;
 }
 
-/* End of DAC functions */
-
-/* Start of PWM and FREQ commands */
+/*
+* A scan reads several range sensors in groups. Each group is a mask of channel
+* indexes (DAQC bits 0-6, TINKER bits 0-3 for the pairs 12 to 78). On DAQC all
+* sensors of a group are triggered back to back, the bus is let go during the
+* echo time, and then all are read back in one go; groups run one after
+* another, so sensors that hear each other belong in different groups. TINKER
+* ranges continuously, its groups are only read.
+*/
 
-void setPWM(struct piplate* plate, char channel, int value){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, TINKER)){
-			if(channel >= 1 && channel <= 6 && value >= 0 && value <= 100){
-				int registerVal = (int) (value*1024.0/100.0 + 0.5);
-				char param1 = ((channel - 1) << 4)+(registerVal >> 8);
-				char param2 = registerVal & 0x00FF;
-				sendCMD(plate, 0xC0, param1, param2, 0);
-			}
-		}else if(compareWith(plate->id, 1, DAQC)){
-			if(value <= 1023 && value >= 0 && channel >= 0 && channel <= 1){
-				char hibyte = value>>8;
-				char lobyte = value - (hibyte<<8);
-				sendCMD(plate, 0x40+channel, hibyte, lobyte, 0);
-			}
-		}else if(compareWith(plate->id, 1, DAQC2)){
-			if(!plate->daqc2p)
-				daqc2pINIT(plate);
+static bool rangeGROUPS(struct piplate* plate, const char* groups, int n, char units){
+	int g;
 
-			if(value >= 0 && value <= 100 && channel >= 0 && channel <= 1){
-				int registerVal = (int) (value*1023.0/100.0 + 0.5);
-				char param1 = (channel << 7) + (registerVal>>8);
-				char param2 = registerVal&0xFF;
-				sendCMD(plate, 0xC1, param1, param2, 0);
-				plate->daqc2p->pwm[channel] = value;
-			}
-		}
+	if(!plate->isValid || !compareWith(plate->id, 2, DAQC, TINKER) || !groups)
+		return 0;
+	if(n < 1 || n > RANGE_CHANNELS || (units != CM && units != IN))
+		return 0;
+	for(g = 0; g < n; g++){
+		if(!groups[g] || (groups[g] & 0xFF) >> rangeCHANNELS(plate))
+			return 0;
 	}
+	return 1;
 }
 
-int getPWM(struct piplate* plate, char channel){
-	if(plate->isValid){
+int rangeSCAN(struct piplate* plate, const char* groups, int n, char units, double* out){
+	struct plateStack* st;
+	int got = 0;
+	int g, i;
+
+	if(!out || !rangeGROUPS(plate, groups, n, units))
+		return INVAL_CMD;
+
+	st = plateSTACK(plate);
+	for(i = 0; i < RANGE_CHANNELS; i++)
+		out[i] = INVAL_CMD;
+	stampOPEN();//From the first trigger to the last read
+	for(g = 0; g < n; g++){
+		int mask = groups[g] & 0xFF;
+
 		if(compareWith(plate->id, 1, DAQC)){
-			if(channel >= 0 && channel <= 1){
-				char* resp = sendCMD(plate, 0x40+channel+2, 0, 0, 2);
+			struct timespec due;
 
-				if(resp)
-					return (resp[0] * 256 + resp[1]);
+			busLOCK(st);
+			for(i = 0; i < 7; i++){
+				if(mask & (1 << i))
+					sendCMD(plate, 0x80, i, 0, 0);
 			}
-		}else if(compareWith(plate->id, 1, DAQC2)){
-			if(!plate->daqc2p)
-				daqc2pINIT(plate);
+			clock_gettime(CLOCK_MONOTONIC, &due);
+			busUNLOCK(st);
 
-			if(channel >= 0 && channel <= 1){
-				return plate->daqc2p->pwm[channel];
+			tsADD(&due, RANGE_ECHO);
+			while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR);
+		}
+
+		busLOCK(st);
+		for(i = 0; i < rangeCHANNELS(plate); i++){
+			if(mask & (1 << i)){
+				out[i] = rangeVALUE(plate, i, (unsigned char*)sendCMD(plate, 0x81, i, 0, 2), units);
+				if(out[i] >= 0)
+					got++;
 			}
 		}
+		busUNLOCK(st);
 	}
-	return INVAL_CMD;
+	stampCLOSE();
+	return got;
 }
 
-double getFREQ(struct piplate* plate){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, DAQC2)){
-			double freq = 0;
-			char* resp1 = sendCMD(plate, 0xC0, 0, 0, 2);//First 2 bytes
-			char* resp2 = sendCMD(plate, 0xC0, 0, 0, 2);//Lower 2 bytes
-
-			if(resp1 && resp2){
-				int counts = (resp1[0]<<24) + (resp1[1]<<16) + (resp2[0]<<8) + resp2[1];
-				if(counts > 0)
-					freq = 6000000.0/counts;
-
-				return ((int)(freq*100))/100.0;
-			}
+struct rangeScan {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	bool running;
+	char groups[RANGE_CHANNELS];
+	int nGroups;
+	char units;
+	long long period;//ns between scan starts, 0 for back to back
+	double value[RANGE_CHANNELS];
+	struct timespec stamp;//CLOCK_MONOTONIC end of the last scan
+	struct sampleStamp sample;//Its transactions
+	long scans;
+	double rate;//Achieved scans/sec, smoothed
+};
+
+static void* rangeSCANthread(void* arg){
+	struct piplate* plate = (struct piplate*)arg;
+	struct rangeScan* scan = plate->range;
+	struct timespec next;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while(__atomic_load_n(&scan->running, __ATOMIC_ACQUIRE)){
+		double v[RANGE_CHANNELS];
+		struct timespec now;
+
+		rangeSCAN(plate, scan->groups, scan->nGroups, scan->units, v);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		pthread_mutex_lock(&scan->lock);
+		memcpy(scan->value, v, sizeof(v));
+		if(scan->scans){
+			double r = 1e9/tsDIFF(&now, &scan->stamp);
+			scan->rate = (scan->scans == 1 ? r : scan->rate + (r - scan->rate)/8);
+		}
+		scan->stamp = now;
+		scan->sample = lastStamp;
+		scan->scans++;
+		pthread_mutex_unlock(&scan->lock);
+
+		if(scan->period){
+			tsADD(&next, scan->period);
+			if(tsDIFF(&next, &now) < 0)//Overran, start again from now
+				next = now;
+			wakeSLEEP(&scan->lock, &scan->wake, &scan->running, &next);
 		}
 	}
-	return INVAL_CMD;
+	return NULL;
 }
 
-/* End of PWM and FREQ commands */
+//Scans the groups from a background thread at rate scans/sec, 0 to scan back to back.
+int rangeSCANstart(struct piplate* plate, const char* groups, int n, char units, double rate){
+	struct rangeScan* scan;
+
+	if(plate->range || rate < 0 || (rate > 0 && rate < RATE_MIN) || rate > 100 || !rangeGROUPS(plate, groups, n, units))
+		return INVAL_CMD;
+
+	scan = (struct rangeScan*)plateALLOC(plate, SLOT_RANGE, 1, sizeof(struct rangeScan));
+	if(!scan)
+		return INVAL_CMD;
+	pthread_mutex_init(&scan->lock, NULL);
+	wakeINIT(&scan->wake);
+	memcpy(scan->groups, groups, n);
+	scan->nGroups = n;
+	scan->units = units;
+	scan->period = (rate > 0 ? (long long)(1e9/rate) : 0);
+	scan->running = 1;
+	plate->range = scan;
+
+	if(pthread_create(&scan->thread, NULL, rangeSCANthread, plate)){
+		plate->range = NULL;
+		pthread_cond_destroy(&scan->wake);
+		pthread_mutex_destroy(&scan->lock);
+		plateFREE(plate, scan);
+		return INVAL_CMD;
+	}
+	return 0;
+}
 
-/* Start of Function Generator commands */
+void rangeSCANstop(struct piplate* plate){
+	if(plate->range){
+		struct rangeScan* scan = plate->range;
 
-void fgON(struct piplate* plate, char chan){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, DAQC2)){
-			if(chan >= 1 && chan <= 4){
-				sendCMD(plate, 0x91, chan - 1, 0, 0);
-			}
-		}
+		wakeSTOP(&scan->lock, &scan->wake, &scan->running);
+		pthread_join(scan->thread, NULL);
+		plate->range = NULL;
+		pthread_cond_destroy(&scan->wake);
+		pthread_mutex_destroy(&scan->lock);
+		plateFREE(plate, scan);
 	}
 }
 
-void fgOFF(struct piplate* plate, char chan){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, DAQC2)){
-			if(chan >= 1 && chan <= 4){
-				sendCMD(plate, 0x90, chan - 1, 0, 0);
+//Latest scan without touching the bus, INVAL_CMD for channels not scanned or failed. age gets the seconds since it ended, getSTAMP its span.
+int rangeSCANget(struct piplate* plate, double* out, double* age){
+	int r = INVAL_CMD;
+
+	if(plate->range && out){
+		struct rangeScan* scan = plate->range;
+
+		pthread_mutex_lock(&scan->lock);
+		if(scan->scans){
+			memcpy(out, scan->value, sizeof(scan->value));
+			lastStamp = scan->sample;
+			if(age){
+				struct timespec now;
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				*age = tsDIFF(&now, &scan->stamp)*1e-9;
 			}
+			r = 0;
 		}
+		pthread_mutex_unlock(&scan->lock);
 	}
+	return r;
 }
 
-void fgFREQ(struct piplate* plate, char chan, int freq){
+double rangeSCANrate(struct piplate* plate){
+	double rate = INVAL_CMD;
+
+	if(plate->range){
+		pthread_mutex_lock(&plate->range->lock);
+		rate = plate->range->rate;
+		pthread_mutex_unlock(&plate->range->lock);
+	}
+	return rate;
+}
+
+bool getMOTION(struct piplate* plate, char channel){
 	if(plate->isValid){
-		if(compareWith(plate->id, 1, DAQC2)){
-			if(chan >= 1 && chan <= 4 && freq >= 10 && freq <= 20000){
-				int phase_add = (int)(freq*65536.0/100000.0 + 0.5);
-				sendCMD(plate, 0x92 + chan - 1, phase_add>>8, phase_add&0xFF, 0);
+		if(compareWith(plate->id, 1, TINKER)){
+			if(channel >= 1 && channel <= 4){
+				char* resp = sendCMD(plate, 0x30, (--channel), 0, 2);
+
+				if(resp){
+					double val = resp[0] * 256 + resp[1];
+					val = val * 5.10 * 2.4 / 4095.0;
+					sleep(0.05);//Necessary throttle on this function to allow plate's motion buffer to refill
+					if(val >= 2.5)
+						return 1;
+					return 0;
+				}
 			}
 		}
 	}
+	return INVAL_CMD;
 }
 
-void fgTYPE(struct piplate* plate, char chan, char type){
+double getPOT(struct piplate* plate, char channel, double range){
 	if(plate->isValid){
-		if(compareWith(plate->id, 1, DAQC2)){
-			if(chan >= 1 && chan <= 4 && type >= 1 && type <= 7){
-				sendCMD(plate, 0x96, chan-1, type-1, 0);
+		if(compareWith(plate->id, 1, TINKER)){
+			if(channel >= 1 && channel <= 4 && range <= 12){
+				double max = (range >= 0 ? range : 5.0);
+				char* resp = sendCMD(plate, 0x30, channel - 1, 0, 2);
+
+				if(resp){
+					double val = resp[0]*256 + resp[1];
+					val = val * 5.10 * 2.4 / 4095.0;
+					val = ((int)(1000*(100*val/max)))/1000.0;
+					if(val > 100.0)
+						val = 100.0;
+
+					return val;
+				}
 			}
 		}
 	}
+	return INVAL_CMD;
 }
 
-void fgLEVEL(struct piplate* plate, char chan, char level){
+bool getBUTTON(struct piplate* plate, char channel){
 	if(plate->isValid){
-		if(compareWith(plate->id, 1, DAQC2)){
-			if(chan >= 1 && chan <= 4 && level >= 1 && level <= 4){
-				sendCMD(plate, 0x97, chan-1, level, 0);
+		if(compareWith(plate->id, 1, TINKER)){
+			if(channel >= 1 && channel <= 8){
+				char* resp = sendCMD(plate, 0x2A, (--channel), 0, 1);
+				sleep(0.05);
+				return safeExtract(resp);
 			}
 		}
 	}
 }
 
-/* End of Function Generator commands */
+/* End of miscellaneous commands */
 
-/* Start of DAQC switch commands */
+/* Start of input scanner */
 
-bool getSWstate(struct piplate* plate){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, DAQC)){
-			return safeExtract(sendCMD(plate, 0x50, 0, 0, 1));
-		}
+/*
+* Watches TINKER inputs from one thread: 0x25 reads every channel set to din
+* with setMODE, 0x31 the analog side, which covers motion sensors
+* (thresholded at INPUT_MOTION_V) and pots, and each button channel is read
+* through its 0x2A latch like getBUTTON, so a press shorter than the scan
+* period still counts. A digital or motion level has to hold for the
+* debounce time before it counts, and subscribers only hear about changes
+* and presses.
+*/
+
+struct inputScan {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	bool running;
+	long long period;//ns
+	long debounce;//ns
+	double potStep;//Percent a pot has to move to be reported
+	int dinMask;//Channels read with 0x25, bit 0 is channel 1
+	int buttonMask;//Channels read with 0x2A
+	int motionMask;
+	int potMask;
+	double potRange[4];//Volts at 100 percent
+	int level;//Debounced levels, same bits
+	int pending;//Channels whose raw level differs from level
+	struct timespec since[8];//When each pending change was first seen
+	double pot[4];//Last reported pot values
+	bool primed;//First good scan taken
+	struct sampleStamp sample;//Transactions of the last good scan
+	long scans;
+	long misses;//Scans with a read that failed
+	struct {
+		inputHandler fn;
+		void* ctx;
+	} subs[INPUT_SUBS];
+};
+
+//Called with in->lock held. Returns whether the debounced level of ch changed to raw.
+static bool inputEDGE(struct inputScan* in, int ch, bool raw, const struct timespec* now){
+	int bit = 1 << ch;
+
+	if(raw == !!(in->level & bit)){
+		in->pending &= ~bit;
+		return 0;
 	}
-	return INVAL_CMD;
+	if(!(in->pending & bit)){
+		in->pending |= bit;
+		in->since[ch] = *now;
+	}
+	if(tsDIFF(now, &in->since[ch]) < in->debounce)
+		return 0;
+	in->pending &= ~bit;
+	in->level ^= bit;
+	return 1;
 }
 
-void enableSWint(struct piplate* plate){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, DAQC)){
-			sendCMD(plate, 0x51, 0, 0, 0);
+static void inputSTEP(struct piplate* plate, struct inputScan* in){
+	struct plateStack* st = plateSTACK(plate);
+	struct inputEvent ev[20];
+	inputHandler fn[INPUT_SUBS];
+	void* ctx[INPUT_SUBS];
+	double volts[4];
+	struct timespec now;
+	int din = 0;
+	int pressed = 0;
+	bool ok = 1;
+	int n = 0;
+	int i, j;
+
+	busLOCK(st);
+	stampOPEN();
+	if(in->dinMask){
+		int resp = safeExtract(sendCMD(plate, 0x25, 0, 0, 1));
+		if(resp < 0)
+			ok = 0;
+		din = resp;
+	}
+	for(i = 0; i < 8; i++){
+		if(in->buttonMask & (1 << i)){
+			int resp = safeExtract(sendCMD(plate, 0x2A, i, 0, 1));
+			if(resp < 0)
+				ok = 0;
+			else if(resp)
+				pressed |= 1 << i;
+		}
+	}
+	if(in->motionMask | in->potMask){
+		unsigned char* resp = (unsigned char*)sendCMD(plate, 0x31, 0, 0, 8);
+
+		if(resp){
+			for(i = 0; i < 4; i++)
+				volts[i] = (resp[2*i]*256 + resp[2*i+1]) * 5.10 * 2.4 / 4095.0;
+		}else{
+			ok = 0;
+		}
+	}
+	stampCLOSE();
+	busUNLOCK(st);
+
+	pthread_mutex_lock(&in->lock);
+	in->scans++;
+	if(!ok){
+		in->misses++;
+		pthread_mutex_unlock(&in->lock);
+		return;
+	}
+	in->sample = lastStamp;
+	now = lastStamp.end;
+	if(!in->primed){//Levels at start are not edges, and a latch may be stale
+		in->level = din & in->dinMask;
+		for(i = 0; i < 4; i++){
+			if((in->motionMask & (1 << i)) && volts[i] >= INPUT_MOTION_V)
+				in->level |= 1 << i;
+			if(in->potMask & (1 << i))
+				in->pot[i] = fmin(100*volts[i]/in->potRange[i], 100.0);
+		}
+		in->primed = 1;
+		pthread_mutex_unlock(&in->lock);
+		return;
+	}
+	for(i = 0; i < 8; i++){
+		int bit = 1 << i;
+		bool raw;
+
+		if(in->dinMask & bit)
+			raw = (din & bit) != 0;
+		else if(in->motionMask & bit)
+			raw = volts[i] >= INPUT_MOTION_V;
+		else
+			continue;
+		if(inputEDGE(in, i, raw, &now)){
+			ev[n].channel = i + 1;
+			ev[n].kind = (in->motionMask & bit ? INPUT_MOTION : INPUT_DIN);
+			ev[n].level = raw;
+			ev[n].value = raw;
+			ev[n].stamp = in->sample;
+			n++;
+		}
+	}
+	in->level = (in->level & ~in->buttonMask) | pressed;//The latch already debounces
+	for(i = 0; i < 8; i++){
+		if(pressed & (1 << i)){
+			ev[n].channel = i + 1;
+			ev[n].kind = INPUT_BUTTON;
+			ev[n].level = 1;
+			ev[n].value = 1;
+			ev[n].stamp = in->sample;
+			n++;
+		}
+	}
+	for(i = 0; i < 4; i++){
+		double pct;
+
+		if(!(in->potMask & (1 << i)))
+			continue;
+		pct = fmin(100*volts[i]/in->potRange[i], 100.0);
+		if(fabs(pct - in->pot[i]) >= in->potStep && pct != in->pot[i]){
+			in->pot[i] = pct;
+			ev[n].channel = i + 1;
+			ev[n].kind = INPUT_POT;
+			ev[n].level = 0;
+			ev[n].value = pct;
+			ev[n].stamp = in->sample;
+			n++;
+		}
+	}
+	for(j = 0; j < INPUT_SUBS; j++){
+		fn[j] = in->subs[j].fn;
+		ctx[j] = in->subs[j].ctx;
+	}
+	pthread_mutex_unlock(&in->lock);
+
+	if(in->dinMask)
+		stateIN(plate, STATE_DIN, 0, din);
+	for(i = 0; i < n; i++){
+		for(j = 0; j < INPUT_SUBS; j++){
+			if(fn[j])
+				fn[j](plate, &ev[i], ctx[j]);
 		}
 	}
 }
 
-void disableSWint(struct piplate* plate){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, DAQC)){
-			sendCMD(plate, 0x52, 0, 0, 0);
-		}
+static void* inputTHREAD(void* arg){
+	struct piplate* plate = (struct piplate*)arg;
+	struct inputScan* in = plate->inputs;
+	struct timespec next;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while(__atomic_load_n(&in->running, __ATOMIC_ACQUIRE)){
+		inputSTEP(plate, in);
+		tsADD(&next, in->period);
+		wakeSLEEP(&in->lock, &in->wake, &in->running, &next);
 	}
+	return NULL;
 }
 
-void enableSWpower(struct piplate* plate){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, DAQC)){
-			sendCMD(plate, 0x53, 0, 0, 0);
-		}
+/*
+* Starts scanning at rate scans/sec. Digital, button and motion channels come
+* from setMODE; pots are channels 1-4 in potMask (bit 0 is channel 1),
+* reported when they move by potStep percent. potRange gives each pot's full
+* scale in volts as getPOT's range does, NULL or a negative entry for 5 V.
+*/
+int inputSCANstart(struct piplate* plate, double rate, long debounce, int potMask, const double* potRange, double potStep){
+	struct inputScan* in;
+	int dinMask = 0;
+	int buttonMask = 0;
+	int motionMask = 0;
+	int i;
+
+	if(!plate->isValid || !compareWith(plate->id, 1, TINKER) || plate->inputs)
+		return INVAL_CMD;
+	if(rate < RATE_MIN || rate > 1000 || debounce < 0 || (potMask & ~0x0F) || potStep < 0)
+		return INVAL_CMD;
+	for(i = 0; potRange && i < 4; i++){
+		if((potMask & (1 << i)) && (potRange[i] == 0 || potRange[i] > 12))
+			return INVAL_CMD;
 	}
-}
 
-void disableSWpower(struct piplate* plate){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, DAQC)){
-			sendCMD(plate, 0x54, 0, 0, 0);
-		}
+	for(i = 0; i < 8; i++){
+		int mode = plateHEALTH(plate)->modes[i];
+		const char* m = (mode ? modes[mode - 1] : "");
+
+		if(!strcmp(m, "din"))
+			dinMask |= 1 << i;
+		else if(!strcmp(m, "button"))
+			buttonMask |= 1 << i;
+		else if(!strcmp(m, "motion") && i < 4)
+			motionMask |= 1 << i;
+	}
+	if((potMask & (dinMask | buttonMask | motionMask)) || !(dinMask | buttonMask | motionMask | potMask))
+		return INVAL_CMD;
+
+	in = (struct inputScan*)plateALLOC(plate, SLOT_INPUTS, 1, sizeof(struct inputScan));
+	if(!in)
+		return INVAL_CMD;
+	pthread_mutex_init(&in->lock, NULL);
+	wakeINIT(&in->wake);
+	in->period = (long long)(1e9/rate);
+	in->debounce = debounce;
+	in->potStep = potStep;
+	in->dinMask = dinMask;
+	in->buttonMask = buttonMask;
+	in->motionMask = motionMask;
+	in->potMask = potMask;
+	for(i = 0; i < 4; i++)
+		in->potRange[i] = (potRange && potRange[i] > 0 ? potRange[i] : 5.0);
+	in->running = 1;
+	plate->inputs = in;
+
+	if(pthread_create(&in->thread, NULL, inputTHREAD, plate)){
+		plate->inputs = NULL;
+		pthread_cond_destroy(&in->wake);
+		pthread_mutex_destroy(&in->lock);
+		plateFREE(plate, in);
+		return INVAL_CMD;
 	}
+	return 0;
 }
 
-/* End of DAQC switch commands */
-
-/* Start of motor sensor commands */
+void inputSCANstop(struct piplate* plate){
+	if(plate->inputs){
+		struct inputScan* in = plate->inputs;
 
-char getSENSORS(struct piplate* plate){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, MOTOR)){
-			return safeExtract(sendCMD(plate, 0x20, 0, 0, 1));
-		}
+		wakeSTOP(&in->lock, &in->wake, &in->running);
+		pthread_join(in->thread, NULL);
+		plate->inputs = NULL;
+		pthread_cond_destroy(&in->wake);
+		pthread_mutex_destroy(&in->lock);
+		plateFREE(plate, in);
 	}
-	return INVAL_CMD;
 }
 
-int getTACHcoarse(struct piplate* plate, char tachnum){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, MOTOR)){
-			if(tachnum >= 1 && tachnum <= 4){
-				char* resp = sendCMD(plate, 0x22, tachnum, 0, 2);
+int inputSUBSCRIBE(struct piplate* plate, inputHandler fn, void* ctx){
+	int r = INVAL_CMD;
+	int i;
 
-				if(resp){
-					return (resp[0]*256 + resp[1]);
-				}
-			}
+	if(!plate->inputs || !fn)
+		return INVAL_CMD;
+	pthread_mutex_lock(&plate->inputs->lock);
+	for(i = 0; i < INPUT_SUBS; i++){
+		if(!plate->inputs->subs[i].fn){
+			plate->inputs->subs[i].fn = fn;
+			plate->inputs->subs[i].ctx = ctx;
+			r = 0;
+			break;
 		}
 	}
-	return INVAL_CMD;
+	pthread_mutex_unlock(&plate->inputs->lock);
+	return r;
 }
 
-int getTACHfine(struct piplate* plate, char tachnum){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, MOTOR)){
-			if(tachnum >= 1 && tachnum <= 4){
-				char* resp = sendCMD(plate, 0x23, tachnum, 0, 2);
+void inputUNSUBSCRIBE(struct piplate* plate, inputHandler fn, void* ctx){
+	int i;
 
-				if(resp){
-					return (resp[0]*256 + resp[1]);
-				}
-			}
-		}
+	if(!plate->inputs)
+		return;
+	pthread_mutex_lock(&plate->inputs->lock);
+	for(i = 0; i < INPUT_SUBS; i++){
+		if(plate->inputs->subs[i].fn == fn && plate->inputs->subs[i].ctx == ctx)
+			plate->inputs->subs[i].fn = NULL;
 	}
-	return INVAL_CMD;
+	pthread_mutex_unlock(&plate->inputs->lock);
 }
 
-/* End of motor sensor commands */
+//Debounced digital and motion levels without touching the bus, bit 0 is channel 1. getSTAMP gives the last scan.
+int inputSCANget(struct piplate* plate){
+	int level = INVAL_CMD;
 
-/* Start of servo commands */
+	if(plate->inputs){
+		pthread_mutex_lock(&plate->inputs->lock);
+		level = plate->inputs->level;
+		lastStamp = plate->inputs->sample;
+		pthread_mutex_unlock(&plate->inputs->lock);
+	}
+	return level;
+}
 
-void servoINIT(struct piplate* plate){
-	plate->servo = (struct servoParams*)calloc(1, sizeof(struct servoParams));
+long inputSCANmisses(struct piplate* plate){
+	long n = INVAL_CMD;
 
-	plate->servo->servoLow = 0.6;
-	plate->servo->servoHigh = 2.35;
+	if(plate->inputs){
+		pthread_mutex_lock(&plate->inputs->lock);
+		n = plate->inputs->misses;
+		pthread_mutex_unlock(&plate->inputs->lock);
+	}
+	return n;
 }
 
-void setSERVO(struct piplate* plate, char servo, double angle){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, TINKER)){
-			if(!plate->servo)
-				servoINIT(plate);
-
-			if(angle >= 0 && angle <= 180){
-				double clockDec;
-				int clockStart;
+/* End of input scanner */
+
+/* Start of output sequencer */
+
+struct sequencer {
+	pthread_t thread;
+	struct seqEvent* events;
+	int count;
+	long window;
+	int dispatched;
+	bool done;
+	bool abort;
+	struct timespec t0;
+};
+
+static int seqCOMPARE(const void* a, const void* b){
+	long long ta = ((const struct seqEvent*)a)->time;
+	long long tb = ((const struct seqEvent*)b)->time;
+	return (ta > tb) - (ta < tb);
+}
 
-				servo--;
-				clockDec = 1e-3*(plate->servo->servoLow + (plate->servo->servoHigh - plate->servo->servoLow)*(180-angle)/180.0);
-				clockDec = (int)((clockDec*49e6)/12.0);
-				clockStart = 65536-clockDec;
-				sendCMD(plate, 0x50+servo, (clockStart>>8), (clockStart&0xFF), 0);
-			}
-		}
+static void seqOUTPUT(struct piplate* plate, char output, char channel, double value){
+	switch(output){
+		case SEQ_DAC:
+			setDAC(plate, channel, value);
+			break;
+		case SEQ_DOUT:
+			if(value)
+				setDOUTbit(plate, channel);
+			else
+				clrDOUTbit(plate, channel);
+			break;
+		case SEQ_RELAY:
+			if(value)
+				relayON(plate, channel);
+			else
+				relayOFF(plate, channel);
+			break;
+		case SEQ_PWM:
+			setPWM(plate, channel, (int)value);
+			break;
 	}
 }
 
-void setSERVO2(struct piplate* plate, char servo, double pw){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, TINKER)){
-			if(!plate->servo)
-				servoINIT(plate);
+static void* seqTHREAD(void* arg){
+	struct sequencer* seq = (struct sequencer*)arg;
+	int i = 0;
 
-			if(servo >= 1 && servo <= 8){
-				double clockDec;
-				int clockStart;
-				if(pw > 2.45)
-					pw = 2.45;
-				if(pw < 0.5)
-					pw = 0.5;
-				servo--;
+	while(i < seq->count && !__atomic_load_n(&seq->abort, __ATOMIC_ACQUIRE)){
+		struct timespec due = seq->t0;
+		unsigned mask = stackBIT(seq->events[i].plate);
+		int last = i;
 
-				clockDec=1e-3*pw;
-				clockDec=(int)((clockDec*49e6)/12.0);
-				clockStart = 65536-clockDec;
-				sendCMD(plate, 0x50+servo, (clockStart>>8), (clockStart&0xFF), 0);
-			}
+		//Everything due within the window of the first event goes out as one batch.
+		while(last + 1 < seq->count && seq->events[last + 1].time - seq->events[i].time <= seq->window)
+			mask |= stackBIT(seq->events[++last].plate);
+
+		tsADD(&due, seq->events[i].time);
+		while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR);
+
+		beginBATCHon(mask);
+		for(; i <= last; i++){
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			seq->events[i].error = tsDIFF(&now, &seq->t0) - seq->events[i].time;
+			seqOUTPUT(seq->events[i].plate, seq->events[i].output, seq->events[i].channel, seq->events[i].value);
 		}
+		endBATCHon(mask);
+
+		__atomic_store_n(&seq->dispatched, i, __ATOMIC_RELEASE);
 	}
+	__atomic_store_n(&seq->done, 1, __ATOMIC_RELEASE);
+	return NULL;
 }
 
-void setSERVOlow(struct piplate* plate, double value){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, TINKER)){
-			if(!plate->servo)
-				servoINIT(plate);
+/*
+* Plays back events from a dedicated timer thread, SCHED_FIFO when permitted.
+* The array is sorted by time in place and must stay valid until seqWAIT or
+* seqSTOP. Each event's error field gets actual minus planned issue time.
+*/
 
-			if(value > 2.45)
-				value = 2.45;
-			if(value < 0.5)
-				value = 0.5;
+struct sequencer* seqSTART(struct seqEvent* events, int count, long window){
+	struct sequencer* seq;
+	pthread_attr_t attr;
+	struct sched_param sp;
+	int i;
 
-			plate->servo->servoLow = value;
+	if(!events || count <= 0 || window < 0)
+		return NULL;
+
+	qsort(events, count, sizeof(struct seqEvent), seqCOMPARE);
+	for(i = 0; i < count; i++)
+		events[i].error = 0;
+
+	seq = (struct sequencer*)calloc(1, sizeof(struct sequencer));
+	if(!seq)
+		return NULL;
+	seq->events = events;
+	seq->count = count;
+	seq->window = window;
+	clock_gettime(CLOCK_MONOTONIC, &seq->t0);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+	sp.sched_priority = sched_get_priority_max(SCHED_FIFO) - 1;
+	pthread_attr_setschedparam(&attr, &sp);
+
+	if(pthread_create(&seq->thread, &attr, seqTHREAD, seq)){
+		if(pthread_create(&seq->thread, NULL, seqTHREAD, seq)){//No realtime permission
+			pthread_attr_destroy(&attr);
+			free(seq);
+			return NULL;
 		}
 	}
+	pthread_attr_destroy(&attr);
+	return seq;
 }
 
-void setSERVOhigh(struct piplate* plate, double value){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, TINKER)){
-			if(!plate->servo)
-				servoINIT(plate);
+bool seqDONE(struct sequencer* seq){
+	return __atomic_load_n(&seq->done, __ATOMIC_ACQUIRE);
+}
 
-			if(value > 2.45)
-				value = 2.45;
-			if(value < 0.5)
-				value = 0.5;
+//Waits for the schedule to finish, frees the sequencer and returns the events dispatched.
+int seqWAIT(struct sequencer* seq){
+	int n;
 
-			plate->servo->servoHigh = value;
-		}
-	}
+	pthread_join(seq->thread, NULL);
+	n = seq->dispatched;
+	free(seq);
+	return n;
 }
 
-/* End of servo commands */
-
-/* Start of miscellaneous commands */
+int seqSTOP(struct sequencer* seq){
+	__atomic_store_n(&seq->abort, 1, __ATOMIC_RELEASE);
+	return seqWAIT(seq);
+}
 
-double changeUnits(double value, char units){
-	if(units == CM)
-		value /= 58.326;
-	if(units == IN)
-		value /= 148.148;
+/* End of output sequencer */
+
+/* Start of process image */
+
+struct imageSlot {
+	int leader;//Input whose read this one shares, itself if it reads
+	bool all;//The leader reads every channel of the plate at once
+	double raw[8];
+	int word;
+	struct sampleStamp stamp;//Of the leader's read
+};
+
+struct procImage {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	bool stop;
+	long period;
+	imageCompute fn;
+	void* ctx;
+	int nin;
+	int nout;
+	struct imagePoint* inputs;
+	struct imagePoint* outputs;
+	struct imageSlot* slot;
+	double* in;//Working images, only touched by the cycle thread
+	double* out;
+	double* written;//Last value put out per output, NAN to send again
+	double* shownIn;//Copies for imageREAD
+	double* shownOut;
+	struct sampleStamp* stamp;//Per input, zero if its read failed
+	struct sampleStamp* shownStamp;
+	unsigned inStacks;//Stacks the inputs and outputs are on, see beginBATCHon
+	unsigned outStacks;
+	struct imageStats stats;
+	long long cycleSum;
+	long long jitterSum;
+};
+
+static bool imageINPUT(const struct imagePoint* p){
+	if(!p->plate || !p->plate->isValid)
+		return 0;
+	if(p->kind == IMG_ADC)
+		return compareWith(p->plate->id, 3, DAQC, DAQC2, TINKER);
+	if(p->kind == IMG_DIN)
+		return compareWith(p->plate->id, 3, DAQC, DAQC2, TINKER);
+	return 0;
+}
 
-	value = ((int)(100*value))/100.0;
-	return value;
+static bool imageOUTPUT(const struct imagePoint* p){
+	return p->plate && p->plate->isValid && p->kind >= SEQ_DAC && p->kind <= SEQ_PWM;
 }
 
-double getRANGE(struct piplate* plate, char channel, char units){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, TINKER)){
-			if((channel == 12 || channel == 34 || channel == 56 || channel == 78) && (units == CM || units == IN)){
-				channel=(int)((channel>>1)/10);//Map channel to be from 0 to 3
-				char* resp = sendCMD(plate, 0x81, channel, 0, 2);
+/*
+* Inputs on the same plate share one read where the plate allows it: every
+* DIN point of a plate comes from one getDINall, and two or more ADC points on
+* a DAQC2 from one getADCall.
+*/
 
-				if(resp){
-					int r = resp[0] * 256 + resp[1];
-					double range;
-					if(r == 0){
-						printf("ERROR: Sensor Failure\n");
-						return INVAL_CMD;
-					}
-					range = (r<<1)*12.0/49.0;
+static void imageGROUP(struct procImage* img){
+	int i, j, n;
 
-					return changeUnits(range, units);
-				}
-			}
-		}else if(compareWith(plate->id, 1, DAQC)){
-			if(channel >= 0 && channel <= 6 && (units == CM || units == IN)){
-				char* resp;
-				sendCMD(plate, 0x80, channel, 0, 0);//Initate measurement
-				sleep(0.07);
-				resp = sendCMD(plate, 0x81, channel, 0, 2);//Get data
+	for(i = 0; i < img->nin; i++){
+		struct imagePoint* p = &img->inputs[i];
 
-				if(resp){
-					double range = resp[0]*256 + resp[1];
-					if(range == 0){
-						printf("ERROR: Sensor Failure\n");
-						return INVAL_CMD;
-					}
+		img->slot[i].leader = i;
+		for(j = 0; j < i; j++){
+			struct imagePoint* q = &img->inputs[j];
 
-					return changeUnits(range, units);
-				}
+			if(img->slot[j].leader == j && q->plate == p->plate && q->kind == p->kind && (p->kind == IMG_DIN || img->slot[j].all)){
+				img->slot[i].leader = j;
+				break;
 			}
 		}
+		if(img->slot[i].leader != i || p->kind != IMG_ADC || !compareWith(p->plate->id, 1, DAQC2) || p->channel > 7)
+			continue;
+		for(j = i + 1, n = 1; j < img->nin; j++)
+			if(img->inputs[j].plate == p->plate && img->inputs[j].kind == IMG_ADC && img->inputs[j].channel <= 7)
+				n++;
+		img->slot[i].all = (n > 1);
 	}
-	return INVAL_CMD;
 }
 
-double getRANGEfast(struct piplate* plate, char channel, char units){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, TINKER)){
-			if((channel == 12 || channel == 34 || channel == 56 || channel == 78) && (units == CM || units == IN)){
-				channel=(channel>>1)/10;//Map values to be from 0 to 3.
-				char* resp = sendCMD(plate, 0x82, channel, 0, 2);
-
-				if(resp){
-					int r = resp[0] * 256 + resp[1];
-					double range;
-
-					if(range == 0){
-						printf("ERROR: Sensor Failure\n");
-						return INVAL_CMD;
-					}
-					range = (r<<1)*12.0/49.0;
+static void imageREADS(struct procImage* img){
+	int i;
 
-					return changeUnits(range, units);
-				}
+	for(i = 0; i < img->nin; i++){
+		struct imagePoint* p = &img->inputs[i];
+		struct imageSlot* s = &img->slot[i];
+		struct imageSlot* l = &img->slot[s->leader];
+		double v = NAN;
+
+		if(s->leader == i){
+			if(p->kind == IMG_DIN){
+				s->word = getDINall(p->plate);
+			}else if(s->all){
+				double* vals = getADCall(p->plate);
+
+				if(vals)
+					memcpy(s->raw, vals, sizeof(s->raw));
+				s->word = (vals ? 0 : INVAL_CMD);
 			}
+			s->stamp = lastStamp;
+		}
+		if(p->kind == IMG_DIN){
+			int bit = p->channel - (compareWith(p->plate->id, 1, TINKER) ? 1 : 0);
+
+			if(l->word >= 0 && bit >= 0 && bit <= 7)
+				v = (l->word >> bit) & 1;
+			img->stamp[i] = l->stamp;
+		}else if(l->all && p->channel <= 7){
+			if(l->word >= 0)
+				v = l->raw[(int)p->channel];
+			img->stamp[i] = l->stamp;
+		}else{
+			v = getADC(p->plate, p->channel);
+			if(v == INVAL_CMD)
+				v = NAN;
+			img->stamp[i] = lastStamp;
+		}
+		if(isnan(v)){
+			img->stats.readFails++;
+			memset(&img->stamp[i], 0, sizeof(struct sampleStamp));
 		}
+		img->in[i] = v;
 	}
 }
 
-bool getMOTION(struct piplate* plate, char channel){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, TINKER)){
-			if(channel >= 1 && channel <= 4){
-				char* resp = sendCMD(plate, 0x30, (--channel), 0, 2);
+//Puts out the outputs that changed since they were last sent.
+static void imageWRITES(struct procImage* img){
+	int i;
 
-				if(resp){
-					double val = resp[0] * 256 + resp[1];
-					val = val * 5.10 * 2.4 / 4095.0;
-					sleep(0.05);//Necessary throttle on this function to allow plate's motion buffer to refill
-					if(val >= 2.5)
-						return 1;
-					return 0;
-				}
+	for(i = 0; i < img->nout; i++){
+		struct imagePoint* p = &img->outputs[i];
+		double v = img->out[i];
+
+		if(isnan(v) || v == img->written[i])
+			continue;
+		plateError = PLATE_OK;
+		seqOUTPUT(p->plate, p->kind, p->channel, v);
+		if(plateError == PLATE_OK){
+			img->written[i] = v;
+			img->stats.writes++;
+		}else{
+			img->written[i] = NAN;//Sent again next cycle
+			img->stats.writeFails++;
+		}
+	}
+}
+
+static void* imageTHREAD(void* arg){
+	struct procImage* img = (struct procImage*)arg;
+	struct imageStats* st = &img->stats;
+	struct timespec due, now, done;
+
+	clock_gettime(CLOCK_MONOTONIC, &due);
+	while(!__atomic_load_n(&img->stop, __ATOMIC_ACQUIRE)){
+		long long jitter, cycle;
+
+		while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		beginBATCHon(img->inStacks);
+		imageREADS(img);
+		endBATCHon(img->inStacks);
+		img->fn(img->in, img->out, img->ctx);
+		beginBATCHon(img->outStacks);
+		imageWRITES(img);
+		endBATCHon(img->outStacks);
+		clock_gettime(CLOCK_MONOTONIC, &done);
+
+		jitter = tsDIFF(&now, &due);
+		cycle = tsDIFF(&done, &now);
+		tsADD(&due, img->period);
+
+		pthread_mutex_lock(&img->lock);
+		memcpy(img->shownIn, img->in, img->nin*sizeof(double));
+		memcpy(img->shownOut, img->out, img->nout*sizeof(double));
+		memcpy(img->shownStamp, img->stamp, img->nin*sizeof(struct sampleStamp));
+		st->cycles++;
+		st->lastCycle = cycle;
+		if(cycle > st->maxCycle)
+			st->maxCycle = cycle;
+		if(jitter > st->maxJitter)
+			st->maxJitter = jitter;
+		img->cycleSum += cycle;
+		img->jitterSum += jitter;
+		st->avgCycle = img->cycleSum / st->cycles;
+		st->avgJitter = img->jitterSum / st->cycles;
+		if(tsDIFF(&done, &due) > 0){//Ran into the next period, start it now and drop the ones missed
+			st->overruns++;
+			while(tsDIFF(&done, &due) > img->period){
+				tsADD(&due, img->period);
+				st->skipped++;
 			}
 		}
+		pthread_mutex_unlock(&img->lock);
 	}
-	return INVAL_CMD;
+	return NULL;
 }
 
-double getPOT(struct piplate* plate, char channel, double range){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, TINKER)){
-			if(channel >= 1 && channel <= 4 && range <= 12){
-				double max = (range >= 0 ? range : 5.0);
-				char* resp = sendCMD(plate, 0x30, channel - 1, 0, 2);
+static void imageFREE(struct procImage* img){
+	free(img->stamp);
+	free(img->in);
+	free(img->slot);
+	free(img->inputs);
+	free(img);
+}
 
-				if(resp){
-					double val = resp[0]*256 + resp[1];
-					val = val * 5.10 * 2.4 / 4095.0;
-					val = ((int)(1000*(100*val/max)))/1000.0;
-					if(val > 100.0)
-						val = 100.0;
+/*
+* Runs a scan cycle every period ns from a dedicated thread: all inputs are
+* read into one image in a bus batch, fn computes the output image from it,
+* and the outputs that changed go out in a second batch. Failed reads come in
+* as NAN; outputs left at NAN are not written. The point arrays are copied.
+* The thread runs under the normal scheduler with priority 0, or SCHED_FIFO
+* at priority (capped at the maximum) when permitted. A realtime cycle that
+* overruns starts again at once, so fn must leave the period mostly idle.
+*/
 
-					return val;
-				}
-			}
-		}
+struct procImage* imageSTART(const struct imagePoint* inputs, int nin, const struct imagePoint* outputs, int nout, long period, int priority, imageCompute fn, void* ctx){
+	struct procImage* img;
+	pthread_attr_t attr;
+	struct sched_param sp;
+	int made;
+	int i;
+
+	if(!fn || period <= 0 || priority < 0 || nin < 0 || nout < 0 || (nin && !inputs) || (nout && !outputs))
+		return NULL;
+	for(i = 0; i < nin; i++)
+		if(!imageINPUT(&inputs[i]))
+			return NULL;
+	for(i = 0; i < nout; i++)
+		if(!imageOUTPUT(&outputs[i]))
+			return NULL;
+
+	img = (struct procImage*)calloc(1, sizeof(struct procImage));
+	if(!img)
+		return NULL;
+	img->inputs = (struct imagePoint*)calloc(nin + nout + 1, sizeof(struct imagePoint));
+	img->slot = (struct imageSlot*)calloc(nin + 1, sizeof(struct imageSlot));
+	img->in = (double*)calloc(2*nin + 3*nout + 1, sizeof(double));
+	img->stamp = (struct sampleStamp*)calloc(2*nin + 1, sizeof(struct sampleStamp));
+	if(!img->inputs || !img->slot || !img->in || !img->stamp){
+		imageFREE(img);
+		return NULL;
 	}
-	return INVAL_CMD;
+	img->period = period;
+	img->fn = fn;
+	img->ctx = ctx;
+	img->nin = nin;
+	img->nout = nout;
+	img->outputs = img->inputs + nin;
+	img->shownStamp = img->stamp + nin;
+	img->shownIn = img->in + nin;
+	img->out = img->shownIn + nin;
+	img->shownOut = img->out + nout;
+	img->written = img->shownOut + nout;
+	memcpy(img->inputs, inputs, nin*sizeof(struct imagePoint));
+	memcpy(img->outputs, outputs, nout*sizeof(struct imagePoint));
+	for(i = 0; i < 2*nin + 3*nout; i++)
+		img->in[i] = NAN;
+	for(i = 0; i < nin; i++)
+		img->inStacks |= stackBIT(inputs[i].plate);
+	for(i = 0; i < nout; i++)
+		img->outStacks |= stackBIT(outputs[i].plate);
+	imageGROUP(img);
+	pthread_mutex_init(&img->lock, NULL);
+
+	made = 0;
+	if(priority){
+		pthread_attr_init(&attr);
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		sp.sched_priority = (priority < sched_get_priority_max(SCHED_FIFO) ? priority : sched_get_priority_max(SCHED_FIFO));
+		pthread_attr_setschedparam(&attr, &sp);
+		made = !pthread_create(&img->thread, &attr, imageTHREAD, img);
+		pthread_attr_destroy(&attr);
+	}
+	if(!made && pthread_create(&img->thread, NULL, imageTHREAD, img)){//Normal scheduler, or no realtime permission
+		pthread_mutex_destroy(&img->lock);
+		imageFREE(img);
+		return NULL;
+	}
+	return img;
 }
 
-bool getBUTTON(struct piplate* plate, char channel){
-	if(plate->isValid){
-		if(compareWith(plate->id, 1, TINKER)){
-			if(channel >= 1 && channel <= 8){
-				char* resp = sendCMD(plate, 0x2A, (--channel), 0, 1);
-				sleep(0.05);
-				return safeExtract(resp);
-			}
-		}
+//Finishes the cycle in progress and frees the engine. Outputs keep their last values.
+void imageSTOP(struct procImage* img){
+	if(!img)
+		return;
+	__atomic_store_n(&img->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(img->thread, NULL);
+	pthread_mutex_destroy(&img->lock);
+	imageFREE(img);
+}
+
+/*
+* Copies the images of the last finished cycle and the transaction stamp of
+* each input, zero for failed reads. Any pointer may be NULL. Returns the
+* cycles run.
+*/
+long imageREAD(struct procImage* img, double* in, double* out, struct sampleStamp* stamps){
+	long cycles;
+
+	pthread_mutex_lock(&img->lock);
+	if(in)
+		memcpy(in, img->shownIn, img->nin*sizeof(double));
+	if(out)
+		memcpy(out, img->shownOut, img->nout*sizeof(double));
+	if(stamps)
+		memcpy(stamps, img->shownStamp, img->nin*sizeof(struct sampleStamp));
+	cycles = img->stats.cycles;
+	pthread_mutex_unlock(&img->lock);
+	return cycles;
+}
+
+void imageSTATS(struct procImage* img, struct imageStats* stats){
+	pthread_mutex_lock(&img->lock);
+	*stats = img->stats;
+	pthread_mutex_unlock(&img->lock);
+}
+
+void imageRESETstats(struct procImage* img){
+	pthread_mutex_lock(&img->lock);
+	memset(&img->stats, 0, sizeof(img->stats));
+	img->cycleSum = 0;
+	img->jitterSum = 0;
+	pthread_mutex_unlock(&img->lock);
+}
+
+/* End of process image */
+
+/* Start of plate handles */
+
+#define ARENA_SLOT(n, type) ARENA_ALIGN((n)*sizeof(type))
+
+//Bytes of arena a plate type can use.
+static size_t arenaSIZE(char id){
+	if(compareWith(id, 1, DAQC))
+		return ARENA_SLOT(1, struct tempParams) + ARENA_SLOT(1, struct rangeScan) + ARENA_SLOT(1, struct dinMonitor);
+	if(compareWith(id, 1, THERMO))
+		return ARENA_SLOT(1, struct tempParams);
+	if(compareWith(id, 1, MOTOR))
+		return ARENA_SLOT(2, struct stepperMotorParams) + ARENA_SLOT(4, struct dcMotorParams) + ARENA_SLOT(4, struct speedLoop);
+	if(compareWith(id, 1, DAQC2))
+		return ARENA_SLOT(1, struct oscilloscope) + ARENA_SLOT(1, struct oscDSP) + ARENA_SLOT(2, struct stepperMotorParams)
+			+ ARENA_SLOT(2, struct moveQueue) + ARENA_SLOT(1, struct DAQC2CalParams) + ARENA_SLOT(1, struct freqMonitor)
+			+ ARENA_SLOT(1, struct dinMonitor);
+	if(compareWith(id, 1, TINKER))
+		return ARENA_SLOT(1, struct servoParams) + ARENA_SLOT(1, struct servoMotion) + ARENA_SLOT(1, struct rangeScan)
+			+ ARENA_SLOT(1, struct inputScan);
+	return 0;
+}
+
+/*
+* Opens a plate as a heap handle. The handle, its arena and every piece of
+* per-plate state live in one allocation, so there is no malloc once features
+* are running and pi_plate_close releases it all. Returns NULL if the plate
+* does not answer.
+*/
+
+struct piplate* pi_plate_open_stack(struct plateStack* stack, char id, char addr){
+	struct piplate probe = pi_plate_init_stack(stack, id, addr);
+	size_t head = ARENA_ALIGN(sizeof(struct piplate) + sizeof(struct plateArena));
+	struct piplate* plate;
+	struct plateArena* a;
+	unsigned char* block;
+
+	if(!probe.isValid)
+		return NULL;
+
+	block = (unsigned char*)aligned_alloc(64, head + arenaSIZE(id));
+	if(!block)
+		return NULL;
+	memset(block, 0, head);
+
+	plate = (struct piplate*)block;
+	*plate = probe;
+	a = (struct plateArena*)(block + sizeof(struct piplate));
+	a->base = block + head;
+	a->size = arenaSIZE(id);
+	plate->arena = a;
+	return plate;
+}
+
+struct piplate* pi_plate_open(char id, char addr){
+	return pi_plate_open_stack(NULL, id, addr);
+}
+
+/*
+* Stops every background feature of the plate, detaches its interrupt handlers
+* and frees its state. Plates from pi_plate_init can be passed too, then only
+* the struct itself is left to the caller. Motion plans and sequencers that
+* use the plate must be finished first, and it must not be called from an
+* interrupt handler.
+*/
+
+void pi_plate_close(struct piplate* plate){
+	int i;
+
+	if(!plate)
+		return;
+
+	servoMOTIONstop(plate);
+	freqMONstop(plate);
+	rangeSCANstop(plate);
+	inputSCANstop(plate);
+	dinMONstop(plate);
+	for(i = 1; plate->spd && i <= 4; i++)
+		dcSPEEDstop(plate, i);
+	if(plate->osc)
+		stopOSC(plate);
+	intRELEASE(plate);
+
+	for(i = 0; plate->mq && i < 2; i++)
+		pthread_mutex_destroy(&plate->mq[i].lock);
+
+	plateFREE(plate, plate->stm);
+	plateFREE(plate, plate->mq);
+	plateFREE(plate, plate->dc);
+	plateFREE(plate, plate->spd);
+	plateFREE(plate, plate->tmp);
+	plateFREE(plate, plate->servo);
+	plateFREE(plate, plate->daqc2p);
+
+	if(plate->arena){
+		free(plate);
+	}else{
+		plate->stm = NULL;
+		plate->mq = NULL;
+		plate->dc = NULL;
+		plate->spd = NULL;
+		plate->tmp = NULL;
+		plate->servo = NULL;
+		plate->daqc2p = NULL;
+		plate->isValid = 0;
 	}
 }
 
-/* End of miscellaneous commands */
+/* End of plate handles */
@@ -3,6 +3,8 @@
 
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
 
 #define DAQC 8
 #define MOTOR 16
@@ -34,16 +36,120 @@
 #define CM 'c'
 #define IN 'i'
 
+#define OSC_LENGTH 1024
+
+struct piplate;
+struct oscRecorder;
+struct oscReader;
+struct oscDSP;
+
+struct sampleStamp {
+	struct timespec start;//CLOCK_MONOTONIC, before the first command of the reading went out
+	struct timespec end;//After the last reply came back
+};
+
+struct oscMeta {
+	unsigned int seq;//Captures taken since startOSC
+	struct sampleStamp stamp;//Transfer of the traces
+	bool c1State;
+	bool c2State;
+	char sRate;
+	long sampleRate;//Samples/sec
+	char triggerChan;
+	char triggerType;//'n'ormal or 'a'uto
+	char triggerEdge;//'r'ising or 'f'alling
+	int triggerLevel;
+};
+
 struct oscilloscope {
 	bool c1State;
 	bool c2State;
 	char sRate;
-	int trace1[1024];
-	int trace2[1024];
+	uint16_t* trace1;//Raw 12 bit samples, point into samples[]
+	uint16_t* trace2;
 	char triggerChan;
 	char triggerType;
 	char triggerEdge;
 	int triggerLevel;
+	struct oscMeta meta;//Settings in effect when trace1/trace2 were captured
+	struct oscRecorder* rec;//Set while oscRECstart is active
+	struct oscDSP* dsp;//Set while oscDSPattach is active
+	uint16_t samples[2][OSC_LENGTH];
+};
+
+#define OSC_BINS (OSC_LENGTH/2 + 1)
+
+struct oscMetrics {
+	unsigned int seq;
+	long sampleRate;
+	bool valid[2];//Channel was captured
+	double mean[2];//Volts
+	double rms[2];
+	double pkpk[2];
+	uint16_t min[2];//Raw counts
+	uint16_t max[2];
+	double freq[2];//Dominant frequency in Hz, 0 without FFT
+	const float* spectrum[2];//OSC_BINS magnitudes, NULL without FFT
+	int buckets;//Min/max decimation for display
+	const uint16_t* decMin[2];
+	const uint16_t* decMax[2];
+};
+
+typedef void (*oscDSPcallback)(struct piplate*, const struct oscMetrics*, void*);
+
+/*
+* Scope capture file written by oscRECstart. All fields are host (little) endian.
+*
+* Offset:		Contents:
+* 0:			struct oscFileHeader
+* indexOffset:		capacity x struct oscIndexEntry
+* dataOffset:		capacity x struct oscRecord
+*
+* The file is preallocated to hold capacity records. count is written last,
+* after the record and its index entry are complete, so a reader that maps a
+* file still being recorded only ever sees whole records. Records are in
+* capture order, so the index can be binary searched by time. Version 1
+* files, from before the transfer times, are still read.
+*/
+
+#define OSC_FILE_MAGIC "PPOSCREC"
+#define OSC_FILE_VERSION 2
+
+struct oscFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t headerSize;
+	uint32_t recordSize;
+	uint32_t capacity;
+	uint64_t indexOffset;
+	uint64_t dataOffset;
+	uint64_t count;//Records committed so far
+	uint8_t plateAddr;
+	uint8_t reserved[7];
+};
+
+struct oscIndexEntry {
+	int64_t time;//ns since the epoch, CLOCK_REALTIME
+	uint32_t seq;
+	uint32_t reserved;
+	uint64_t offset;//File offset of the record
+};
+
+struct oscRecord {
+	int64_t time;
+	uint32_t seq;
+	int32_t sampleRate;//Samples/sec
+	uint8_t channels;//Bit 0: trace1 valid, bit 1: trace2 valid
+	int8_t sRate;//setOSCsweep rate
+	uint8_t triggerChan;
+	char triggerType;
+	char triggerEdge;
+	uint8_t reserved[3];
+	int32_t triggerLevel;
+	int64_t xferStart;//CLOCK_MONOTONIC ns, transfer of the traces
+	int64_t xferEnd;
+	uint16_t trace1[OSC_LENGTH];
+	uint16_t trace2[OSC_LENGTH];
 };
 
 struct stepperMotorParams {
@@ -51,12 +157,40 @@ struct stepperMotorParams {
 	char resolution;
 	int rate;
 	double acc;
+	long position;//Eighth steps, updated when a move starts or stops
+	long target;//Where the commanded move ends
+	long origin;//Position when the current move started
+	char moving;//0: stopped, 1: move, 2: jog
+	char moveDir;//+1 or -1
+	int micro;//Eighth steps per step at the move's resolution
+	int trackRate;
+	double trackAcc;
+	struct timespec started;
+	bool used;//Configured through stepperCONFIG (MOTOR)
+	bool synced;//cfgWord/incWord match the plate
+	int cfgWord;
+	int incWord;
+};
+
+#define AXIS_MAX 8
+
+struct axisMove {
+	struct piplate* plate;
+	char motor;
+	int steps;//Negative runs CCW
+	int rate;
+	double acc;//MOTOR only
+	long long skew;//Filled in: ns after the first axis' start command was issued
 };
 
 struct dcMotorParams {
 	char dir;
 	char speed;
 	double acc;
+	bool used;//Configured through dcCONFIG
+	bool synced;//cfgWord/incWord match the plate
+	int cfgWord;
+	int incWord;
 };
 
 struct tempParams {
@@ -67,11 +201,70 @@ struct tempParams {
 	double calBias;
 };
 
+#define SERVO_STEPS 1801//Table entries, 0.1 degree apart
+
+struct servoMotion;
+
 struct servoParams {
 	double servoLow;
 	double servoHigh;
+	uint16_t clock[SERVO_STEPS];//clockStart per 0.1 degree for servoLow/servoHigh
+	uint16_t sent[8];//Last clock value sent per servo
+	unsigned char sentMask;//Bit per servo whose sent[] is known
+	double angle[8];//Last commanded angle, negative if unknown
+	struct servoMotion* motion;
 };
 
+#define FREQ_AVERAGE 'a'
+#define FREQ_MEDIAN 'm'
+#define FREQ_WINDOW_MAX 32
+
+struct freqMonitor;
+
+#define RANGE_CHANNELS 7//Scan channel indexes: DAQC 0-6, TINKER 0-3
+#define RANGE_ECHO 70000000//ns from a DAQC trigger until the reading is ready
+
+struct rangeScan;
+
+#define INPUT_DIN 0
+#define INPUT_MOTION 1
+#define INPUT_POT 2
+#define INPUT_BUTTON 3//Pressed since the last scan
+#define INPUT_MOTION_V 2.5//Motion sensor threshold in volts
+#define INPUT_SUBS 8
+
+struct inputEvent {
+	char channel;//1-8
+	char kind;//INPUT_*
+	bool level;//New debounced level, INPUT_DIN and INPUT_MOTION, 1 for INPUT_BUTTON
+	double value;//Percent for INPUT_POT
+	struct sampleStamp stamp;//Transactions of the scan
+};
+
+struct inputScan;
+
+#define DIN_RING 256//Edges a DIN monitor keeps until read
+#define DAQC_INT_DIN 0xFF//getINTflags on a DAQC, one change flag per DIN bit
+
+struct dinEdge {
+	char bit;
+	bool level;//Level after the edge
+	struct sampleStamp stamp;//Transaction of the snapshot that saw it
+};
+
+struct dinStats {
+	long snapshots;
+	long interrupts;//Snapshots taken on an interrupt
+	long edges;
+	long dropped;//Edges lost to a full ring
+	long misses;//Snapshots that failed
+	long pulses;//Pulses over before their snapshot, known only from the interrupt flags
+	long long worst;//ns, worst detection latency of an edge
+	bool irq;//Interrupt assisted
+};
+
+struct dinMonitor;
+
 struct DAQC2CalParams {
 	double calScale[8];
 	double calOffset[8];
@@ -79,25 +272,150 @@ struct DAQC2CalParams {
 	int pwm[2];
 };
 
+#define PLATES_MAX 48//Type/address pairs, indexed by id + addr - DAQC
+
+#define PLATE_OK 0
+#define PLATE_ENODEV 1//Device node could not be opened
+#define PLATE_EIO 2//ioctl failed
+#define PLATE_ENORESP 3//Plate did not answer
+#define PLATE_ETIMEOUT 4//Plate timeout or caller deadline ran out
+#define PLATE_EOPEN 5//Breaker open after repeated failures
+#define PLATE_EBUSY 6//Shared state entry stuck mid update
+
+#define RETRY_DEFAULT 2
+#define BACKOFF_DEFAULT 1000000//ns
+#define BREAKER_TRIP 5//Failures in a row that open the breaker
+#define BREAKER_COOLDOWN 1000000000//ns before an open breaker lets a command through
+
+struct plateStats {
+	long commands;
+	long retries;
+	long failures;
+	long timeouts;
+	long trips;//Times the breaker opened
+	long long worst;//ns, slowest command including retries
+	int consecutive;//Failures in a row
+	bool open;//Breaker open
+};
+
+#define BUS_SAFETY 0//Stops and resets, served first
+#define BUS_NORMAL 1
+#define BUS_BULK 2//Scope traces, discovery, calibration; yields between commands
+#define BUS_LANES 3
+
+struct busStats {
+	long long maxWait[BUS_LANES];//ns, longest wait for the bus per class
+	long long totalWait[BUS_LANES];
+	long grants[BUS_LANES];
+	long yields;//Times bulk work stepped aside
+};
+
+#define STACKS_MAX 8//Device nodes, each an independent bus
+#define STACK_PATH 64
+
+#define ASYNC_QUEUE 64//Queued writes per stack
+#define ASYNC_BATCH 16//Most queued writes the writer thread sends per hold of the bus
+
+struct asyncStats {
+	long queued;
+	long sent;
+	long failed;//No acknowledge or ioctl error
+	long dropped;//Discarded by a stop or reset of their plate
+	unsigned peak;//Deepest the queue has been
+	unsigned pending;//Queued now
+};
+
+struct asyncFail {
+	char id;
+	char addr;
+	unsigned char cmd;
+	unsigned char p1;
+	unsigned char p2;
+	int error;//PLATE_*
+};
+
+typedef void (*asyncHandler)(const struct asyncFail*, void*);//Runs on the thread that sent the write, with the bus held
+
+struct plateArena;
+struct plateStack;
+
 struct piplate {
 	char id;
 	char addr;
 	char mapped_addr;
 	bool isValid;
 	bool ack;
+	char txn;//motorBEGIN depth
 	struct oscilloscope* osc;
 	struct stepperMotorParams* stm;
 	struct dcMotorParams* dc;
 	struct tempParams* tmp;
 	struct servoParams* servo;
 	struct DAQC2CalParams* daqc2p;
+	struct freqMonitor* fmon;
+	struct rangeScan* range;
+	struct inputScan* inputs;
+	struct dinMonitor* dinmon;
+	struct moveQueue* mq;
+	struct speedLoop* spd;
+	struct plateArena* arena;//Set by pi_plate_open
+	struct plateStack* stack;//Device node the plate is on, NULL for the default
+};
+
+#define INT_HANDLERS_MAX 16
+
+typedef void (*intHandler)(struct piplate*, int, const struct timespec*, void*);//plate, flags, when the line was seen, context
+
+#define PLATE_CACHE_DIR "/run/piplates"
+#define PLATE_CACHE PLATE_CACHE_DIR "/inventory"
+
+struct plateInfo {
+	char id;//DAQC, MOTOR, ...
+	char addr;
+	char ident[64];//getID string
+	int hw;
+	int fw;
 };
 
 extern struct piplate	pi_plate_init(char, char);
+extern struct piplate	pi_plate_init_stack(struct plateStack*, char, char);
+extern struct piplate*	pi_plate_open(char, char);//Handle with all per-plate state in one block
+extern struct piplate*	pi_plate_open_stack(struct plateStack*, char, char);
+extern void	pi_plate_close(struct piplate*);//Stops the plate's threads and frees its state
+extern struct plateStack*	stackDEFAULT(void);//The /dev/PiPlates stack
+extern struct plateStack*	stackOPEN(const char*);//Device node path, the same stack is returned for the same path
+extern void	stackCLOSE(struct plateStack*);//Stops its dispatch thread and closes the node
+extern const char*	stackPATH(struct plateStack*);
+extern int	getSTACKstats(struct plateStack*, struct busStats*);
+extern void	setASYNC(struct piplate*, bool);//Queue writes and check their acknowledge in the background
+extern void	asyncHANDLER(struct plateStack*, asyncHandler, void*);//Called for each failed queued write, NULL stack for the default
+extern int	asyncFLUSH(struct plateStack*);//Sends queued writes now, returns how many failed
+extern int	getASYNCstats(struct plateStack*, struct asyncStats*);
+extern int	discoverPLATES(struct plateInfo*, int, bool);//list, max entries, use the cached inventory
 extern bool	getINT(void);
+extern void	beginBATCH(void);//Commands until endBATCH go out back to back
+extern void	endBATCH(void);
+extern unsigned	stackBIT(struct piplate*);//Mask bit of the plate's stack
+extern void	beginBATCHon(unsigned);//Batch over the stacks in the mask only
+extern void	endBATCHon(unsigned);
+extern int	setBUSclass(int);//BUS_SAFETY, BUS_NORMAL or BUS_BULK for this thread, returns the old one
+extern void	getBUSstats(struct busStats*);
+extern void	resetBUSstats(void);
+extern int	brokerCONNECT(int);//Use ppbroker with the given priority (higher first) instead of the device
+extern void	brokerDISCONNECT(void);
 
 /* Start of system level functions */
 
+extern int	getERROR(void);//PLATE_* for the calling thread's last command
+extern int	getSTAMP(struct sampleStamp*);//Start and end of the transaction behind the calling thread's last reading
+extern void	stampMID(const struct sampleStamp*, struct timespec*);//Midpoint, the best single estimate of the sample time
+extern void	setRETRIES(struct piplate*, int, long);//Retries for failed reads, first backoff in ns
+extern void	setTIMEOUT(struct piplate*, long);//ns per command including retries, 0 for none
+extern void	beginDEADLINE(long long);//This thread's commands must finish within ns
+extern void	endDEADLINE(void);
+extern int	getHEALTH(struct piplate*, struct plateStats*);
+extern void	resetHEALTH(struct piplate*);
+
 extern int	getADDR(struct piplate*);//Any plate
 extern char*	getID(struct piplate*);//Any plate
 extern int	getHWrev(struct piplate*);//Any plate
@@ -109,6 +427,13 @@ extern int	getINTflag0(struct piplate*);//MOTOR
 extern int	getINTflag1(struct piplate*);//MOTOR
 extern void	reset(struct piplate*);//Any plate
 
+extern int	intATTACH(struct piplate*, intHandler, void*);//THERMO, DAQC, DAQC2, MOTOR
+extern void	intDETACH(struct piplate*, intHandler, void*);
+extern int	intSERVICE(void);//Reads and dispatches flags if the interrupt line is set
+extern int	intTHREADstart(long);//Poll period in ns
+extern void	intTHREADstop(void);
+extern bool	intTHREADrunning(void);
+
 /* End of system level functions */
 
 /* Start of LED commands */
@@ -148,6 +473,10 @@ extern int	getDINbit(struct piplate*, char);
 extern int	getDINall(struct piplate*);
 extern void	enableDINint(struct piplate*, char, char);
 extern void	disableDINint(struct piplate*, char);
+extern int	dinMONstart(struct piplate*, int, long, long);//DAQC, DAQC2: bit mask, fastest and slowest poll period in ns
+extern void	dinMONstop(struct piplate*);
+extern int	dinMONread(struct piplate*, struct dinEdge*, int);//Oldest edges first, returns how many
+extern int	dinMONstats(struct piplate*, struct dinStats*);
 
 /* End of digital io functions */
 
@@ -169,6 +498,27 @@ extern void	getOSCtraces(struct piplate*);
 extern void	setOSCtrigger(struct piplate*, char, char*, char*, int);
 extern void	trigOSCnow(struct piplate*);
 extern void	runOSC(struct piplate*);
+extern long	getOSCrate(char);//Samples/sec for a setOSCsweep rate
+extern int	getOSCvolts(struct piplate*, char, double*);//channel 1-2, buffer of OSC_LENGTH
+
+extern int	oscRECstart(struct piplate*, const char*, unsigned int);//file path, capacity in captures
+extern void	oscRECstop(struct piplate*);
+extern long	oscRECcount(struct piplate*);
+extern long	oscRECdropped(struct piplate*);//Captures that did not fit in the file
+
+extern int	oscDSPattach(struct piplate*, int, bool);//decimation buckets (divides OSC_LENGTH, 0 for none), FFT on/off
+extern void	oscDSPdetach(struct piplate*);
+extern void	oscDSPretain(struct piplate*, bool);//Keep unpacking trace1/trace2 (default on)
+extern int	oscDSPsubscribe(struct piplate*, oscDSPcallback, void*);
+extern void	oscDSPunsubscribe(struct piplate*, oscDSPcallback, void*);
+extern const struct oscMetrics*	getOSCmetrics(struct piplate*);
+
+extern struct oscReader*	oscREADopen(const char*);
+extern void	oscREADclose(struct oscReader*);
+extern long	oscREADcount(struct oscReader*);
+extern const struct oscFileHeader*	oscREADheader(struct oscReader*);
+extern const struct oscRecord*	oscREADrecord(struct oscReader*, long);
+extern long	oscREADfind(struct oscReader*, int64_t);//First record at or after a time
 
 /* End of DAQC2 Oscilloscope functions */
 
@@ -185,14 +535,76 @@ extern void	stepperRATE(struct piplate*, char, int, char);//motor, rate, step si
 extern void	stepperACC(struct piplate*, char, double);
 
 extern void	stepperMOVE(struct piplate*, char, int);//motor, steps
+extern long long	stepperMOVEsync(struct axisMove*, int);//axes, count; returns the spread in issuing the starts, ns
+extern long	stepperPOS(struct piplate*, char);//Estimated position in eighth steps
+extern long	stepperTARGET(struct piplate*, char);//Commanded end position in eighth steps
+extern bool	stepperMOVING(struct piplate*, char);
+extern void	stepperSETPOS(struct piplate*, char, long);//Home/zero a motor
 extern void	stepperJOG(struct piplate*, char);//motor
 extern void	stepperSTOP(struct piplate*, char);//motor
 extern void	stepperOFF(struct piplate*, char);
 
 /* End of stepper motor functions */
 
+/* Start of stepper motion planner */
+
+#define PROFILE_TRAPEZOID 0
+
+//Stop interrupt flags used to chain moves
+#define MOTOR_INT_STEPA_STOP 0x01//getINTflag0
+#define MOTOR_INT_STEPB_STOP 0x02
+#define MOTOR_INT_STEPA_STEADY 0x04
+#define MOTOR_INT_STEPB_STEADY 0x08
+#define DAQC2_INT_STEP1_STOP 0x40//getINTflags
+#define DAQC2_INT_STEP2_STOP 0x80
+
+struct pathPoint {
+	long position;//Absolute target in steps
+	int rate;//Velocity limit, steps/sec
+	double acc;//Ramp time in seconds, MOTOR only
+};
+
+struct motionPlan;
+
+extern struct motionPlan*	planPATH(struct piplate*, char, long, const struct pathPoint*, int, char);//motor, start position, path, points, profile
+extern int	planRUN(struct motionPlan*);
+extern int	planWAIT(struct motionPlan*);//Segments completed
+extern int	planSTOP(struct motionPlan*);
+extern void	planFREE(struct motionPlan*);
+extern double	planTIME(struct motionPlan*);//Estimated seconds for the path
+extern long long	planGAP(struct motionPlan*);//Worst ns from a stop to the next move
+extern bool	planTIMEDOUT(struct motionPlan*);//A segment's stop never came and the plan was stopped there
+
+/* End of stepper motion planner */
+
+/* Start of DAQC2 stepper move queue */
+
+#define MOVEQ_DEPTH 32
+
+struct moveQueue;
+
+struct moveQueueStats {
+	int depth;
+	bool active;
+	long issued;
+	long underruns;//Stops that found the queue empty before stepperQUEUEend
+	long long latMin;//ns from interrupt seen to next move sent
+	long long latMax;
+	long long latAvg;
+};
+
+extern int	stepperQUEUE(struct piplate*, char, int);//motor, steps
+extern void	stepperQUEUEclear(struct piplate*, char);
+extern void	stepperQUEUEend(struct piplate*, char);//motor, no more moves follow
+extern int	stepperQUEUEstats(struct piplate*, char, struct moveQueueStats*);
+
+/* End of DAQC2 stepper move queue */
+
 /* Start of dc motor functions */
 
+extern void	motorBEGIN(struct piplate*);//MOTOR: hold dc/stepper config changes
+extern int	motorCOMMIT(struct piplate*);//Send only what changed, returns commands sent
+
 extern void	dcCONFIG(struct piplate*, char, char, char, double);
 extern void	dcSPEED(struct piplate*, char, char);
 extern void	dcDIR(struct piplate*, char, char);
@@ -203,6 +615,29 @@ extern void	dcSTOP(struct piplate*, char);
 
 /* End of dc motor functions */
 
+/* Start of dc motor speed control */
+
+struct speedLoop;
+
+struct speedLoopStats {
+	double setpoint;
+	double measured;//Last tach reading
+	int output;//Last dcSPEED value sent
+	long cycles;
+	long actuations;//dcSPEED commands sent
+	long errors;//Failed tach reads
+	long overruns;//Cycles that started after their slot had passed
+	long long jitterMax;//ns late against the schedule
+	long long jitterAvg;
+};
+
+extern int	dcSPEEDloop(struct piplate*, char, double, double, double, bool);//motor, loop Hz (0.001 to 1000), kp, ki, use getTACHfine
+extern void	dcSPEEDset(struct piplate*, char, double);//motor, tach setpoint
+extern void	dcSPEEDstop(struct piplate*, char);
+extern int	dcSPEEDstats(struct piplate*, char, struct speedLoopStats*);
+
+/* End of dc motor speed control */
+
 /* Start of motor interrupt functions */
 
 extern void	setSENSORint(struct piplate*, char);
@@ -258,6 +693,11 @@ extern int	getPWM(struct piplate*, char);
 
 extern double	getFREQ(struct piplate*);
 
+extern int	freqMONstart(struct piplate*, double, int, char);//samples/sec (0.001 to 1000), window, FREQ_AVERAGE or FREQ_MEDIAN
+extern void	freqMONstop(struct piplate*);
+extern double	freqMONget(struct piplate*, double*);//Filtered Hz, seconds since the reading
+extern long	freqMONinvalid(struct piplate*);//Readings with counts <= 0 or no response
+
 /* End of PWM and freq */
 
 /* Start of function generator commands */
@@ -294,6 +734,12 @@ void	setSERVO(struct piplate*, char, double);//TINKER
 void	setSERVO2(struct piplate*, char, double);//TINKER
 void	setSERVOlow(struct piplate*, double);//TINKER
 void	setSERVOhigh(struct piplate*, double);//TINKER
+int	setSERVOall(struct piplate*, const double*);//TINKER: angles for servos 1-8, negative to skip
+
+int	servoMOTIONstart(struct piplate*, double);//TINKER: frames/sec (0.001 to 500)
+void	servoMOTIONstop(struct piplate*);
+void	servoMOVE(struct piplate*, char, double, double);//servo, angle, seconds
+bool	servoMOVING(struct piplate*);
 
 /* End of Servo commands */
 
@@ -301,10 +747,150 @@ void	setSERVOhigh(struct piplate*, double);//TINKER
 
 double	getRANGE(struct piplate*, char, char);//DAQC, TINKER
 double	getRANGEfast(struct piplate*, char, char);//TINKER
+long	getRANGEfails(struct piplate*, char);//Zero readings on the channel so far
+int	rangeSCAN(struct piplate*, const char*, int, char, double*);//channel masks, groups, units, RANGE_CHANNELS ranges out. Returns sensors read
+int	rangeSCANstart(struct piplate*, const char*, int, char, double);//As rangeSCAN, scans/sec (0.001 to 100) or 0 for back to back
+void	rangeSCANstop(struct piplate*);
+int	rangeSCANget(struct piplate*, double*, double*);//Latest ranges, seconds since that scan
+double	rangeSCANrate(struct piplate*);//Achieved scans/sec
 bool	getMOTION(struct piplate*, char);//TINKER
 double	getPOT(struct piplate*, char, double);//TINKER
 bool	getBUTTON(struct piplate*, char);//TINKER
 
 /* End of miscellaneous commands */
 
+/* Start of input scanner */
+
+typedef void (*inputHandler)(struct piplate*, const struct inputEvent*, void*);
+
+int	inputSCANstart(struct piplate*, double, long, int, const double*, double);//TINKER: scans/sec (0.001 to 1000), debounce ns, pot channel mask, pot ranges in volts or NULL, pot step in percent
+void	inputSCANstop(struct piplate*);
+int	inputSUBSCRIBE(struct piplate*, inputHandler, void*);
+void	inputUNSUBSCRIBE(struct piplate*, inputHandler, void*);
+int	inputSCANget(struct piplate*);//Debounced levels, bit 0 is channel 1
+long	inputSCANmisses(struct piplate*);//Scans lost to a failed read
+
+/* End of input scanner */
+
+/* Start of output sequencer */
+
+#define SEQ_DAC 1
+#define SEQ_DOUT 2
+#define SEQ_RELAY 3
+#define SEQ_PWM 4
+
+struct seqEvent {
+	long long time;//ns after seqSTART
+	struct piplate* plate;
+	char output;//SEQ_DAC, SEQ_DOUT, SEQ_RELAY, SEQ_PWM
+	char channel;
+	double value;//Volts, 0/1 or PWM value
+	long long error;//Filled in: actual minus planned issue time in ns
+};
+
+struct sequencer;
+
+extern struct sequencer*	seqSTART(struct seqEvent*, int, long);//events, count, batch window in ns
+extern bool	seqDONE(struct sequencer*);
+extern int	seqWAIT(struct sequencer*);
+extern int	seqSTOP(struct sequencer*);
+
+/* End of output sequencer */
+
+/* Start of process image */
+
+#define IMG_ADC 1//Volts
+#define IMG_DIN 2//0 or 1
+
+struct imagePoint {
+	struct piplate* plate;
+	char kind;//IMG_ADC or IMG_DIN for inputs, SEQ_DAC, SEQ_DOUT, SEQ_RELAY or SEQ_PWM for outputs
+	char channel;//As the plate's own call numbers it
+};
+
+struct imageStats {
+	long cycles;
+	long overruns;//Cycles that ran past the start of the next one
+	long skipped;//Periods dropped to catch up after an overrun
+	long readFails;//Inputs that came in as NAN
+	long writes;
+	long writeFails;
+	long long lastCycle;//ns from the first read to the last write
+	long long maxCycle;
+	long long avgCycle;
+	long long maxJitter;//ns the cycle started after its due time
+	long long avgJitter;
+};
+
+typedef void (*imageCompute)(const double*, double*, void*);//input image, output image, context
+
+struct procImage;
+
+extern struct procImage*	imageSTART(const struct imagePoint*, int, const struct imagePoint*, int, long, int, imageCompute, void*);//inputs, count, outputs, count, period in ns, SCHED_FIFO priority or 0, compute, context
+extern void	imageSTOP(struct procImage*);
+extern long	imageREAD(struct procImage*, double*, double*, struct sampleStamp*);//Copies of the last input and output images and input stamps, returns cycles run
+extern void	imageSTATS(struct procImage*, struct imageStats*);
+extern void	imageRESETstats(struct procImage*);
+
+/* End of process image */
+
+/* Start of shared state image */
+
+#define STATE_SHM "/piplates-state"
+#define STATE_MAGIC 0x50505354//"PPST"
+#define STATE_VERSION 1
+#define STATE_PLATES PLATES_MAX
+#define STATE_RETRIES 10000//Reads of an entry before stateREAD gives up on a dead publisher
+
+struct stateInput {
+	double value;
+	int64_t time;//CLOCK_MONOTONIC ns of the reading
+};
+
+struct plateState {
+	uint32_t seq;//Odd while the publisher is writing
+	char id;
+	char addr;
+	bool present;//Something was published for this plate
+	int64_t updated;//CLOCK_MONOTONIC ns of the last change
+	struct stateInput adc[9];//DAQC/DAQC2 0-8, TINKER 1-4 at 0-3
+	struct stateInput din;//DIN bits
+	struct stateInput temp[12];//Zero based channel
+	struct stateInput freq;
+	struct stateInput tach[4];
+	int dout;//Shadowed DOUT bits, zero based
+	int relays;//Shadowed relay bits, zero based
+	double dac[4];
+	int pwm[6];
+	double servo[8];//Last commanded angles, negative if unknown
+	struct {
+		char dir;
+		char speed;
+		double acc;
+	} dc[4];
+	struct {
+		char dir;
+		char resolution;
+		int rate;
+		double acc;
+		long position;//Eighth steps
+		long target;
+		char moving;
+	} stm[2];
+};
+
+struct stateImage {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t writerPid;//0 when nobody is publishing
+	struct plateState plate[STATE_PLATES];
+};
+
+extern int	stateOPEN(void);//Publish this process's plate traffic to STATE_SHM
+extern void	stateCLOSE(void);
+extern const struct stateImage*	stateMAP(void);//Read only mapping for consumers
+extern int	stateREAD(const struct stateImage*, char, char, struct plateState*);//image, id, addr, copy
+
+/* End of shared state image */
+
 #endif /* PLATEIO_H_INCLUDED */